@@ -0,0 +1,129 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* blit.c - cost of drawing a page of glyphs with blit().
+
+   Fills a 128x296 framebuffer with 16x16 glyphs, 8 across by 18
+   down, the way layout_render() does. The byte aligned memcpy loop
+   that epd_write() used to be is the baseline; blit() is timed byte
+   aligned and at an odd x offset in each mode. Run it a few times,
+   timings on a busy machine wander.
+
+   USAGE: blit [pages]                                                */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oku.h"
+#include "err.h"
+#include "blit.h"
+
+#define WIDTH             128
+#define HEIGHT            296
+#define GLYPH             16	/* px square */
+#define PITCH(X)          ( (X)%8 ? 1+(X)/8 : (X)/8 )
+#define DEFAULT_PAGES     20000
+
+static byte          fb[PITCH(WIDTH) * HEIGHT];
+static byte          bitmap[PITCH(GLYPH) * GLYPH];
+static struct Raster glyph = { { GLYPH, GLYPH }, bitmap };
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* epd_write() before blit(): a row by row memcpy, byte aligned
+   origins only */
+static __attribute__((noinline)) void
+old_write(byte *buf, const struct Raster *img, struct Point origin)
+{
+    coordinate  y;
+    const byte *src;
+    byte       *dest;
+
+    src  = img->bitmap;
+    dest = buf + origin.y*PITCH(WIDTH) + origin.x/8;
+    for (y=0; y<img->size.y; ++y) {
+	memcpy(dest, src, PITCH(img->size.x));
+	src  += PITCH(img->size.x);
+	dest += PITCH(WIDTH);
+    }
+}
+
+static void
+page_memcpy(int dx)
+{
+    struct Point pen;
+
+    (void)dx;
+    for (pen.y=0; pen.y+GLYPH<=HEIGHT; pen.y+=GLYPH)
+	for (pen.x=0; pen.x+GLYPH<=WIDTH; pen.x+=GLYPH)
+	    old_write(fb, &glyph, pen);
+}
+
+static enum BLIT_MODE mode;
+
+static void
+page_blit(int dx)
+{
+    static const struct Point size = { WIDTH, HEIGHT };
+    int x, y;
+
+    for (y=0; y+GLYPH<=HEIGHT; y+=GLYPH)
+	for (x=0; x+GLYPH<=WIDTH; x+=GLYPH)
+	    blit(fb, size, &glyph, x+dx, y, mode);
+}
+
+static double
+time_pages(void (*page)(int), int dx, int pages)
+{
+    double t0;
+    int    i;
+
+    page(dx);			/* warm up */
+    t0 = now_ns();
+    for (i=0; i<pages; ++i)
+	page(dx);
+
+    return (now_ns() - t0) / pages;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const char *names[] = { "copy", "or", "andnot" };
+    double base, t;
+    int    pages, m, dx;
+    size_t i;
+
+    pages = argc == 2 ? atoi(argv[1]) : DEFAULT_PAGES;
+    if (argc > 2 || pages < 1) {
+	puts("USAGE: blit [pages]");
+	return E_ARG;
+    }
+
+    srand(1);
+    for (i=0; i<sizeof bitmap; ++i)
+	bitmap[i] = rand();
+
+    base = time_pages(page_memcpy, 0, pages);
+    printf("%-16s %8.0f ns/page  1.00x\n", "memcpy aligned", base);
+
+    for (m=BLIT_COPY; m<=BLIT_ANDNOT; ++m)
+	for (dx=0; dx<=3; dx+=3) {
+	    mode = m;
+	    t = time_pages(page_blit, dx, pages);
+	    printf("%-6s %-9s %8.0f ns/page  %.2fx\n", names[m],
+		   dx ? "x+3" : "aligned", t, t / base);
+	}
+
+    return fb[0] == 0x5A ? SUCCESS : SUCCESS; /* keep fb live */
+}
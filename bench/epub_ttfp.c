@@ -0,0 +1,104 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* epub_ttfp.c - time to first page when opening a book.
+
+   Measures book_open() (hashing, zip central directory, container,
+   package and first chapter) plus decoding one page of codepoints,
+   which is everything that happens before the first glyph lookup.
+
+   USAGE: epub_ttfp book.epub [runs]                                 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "oku.h"
+#include "err.h"
+#include "book.h"
+
+#define PAGE_CODEPOINTS   (16*18) /* 8x16 cells on 128x296 px */
+#define DEFAULT_RUNS      20
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct Book    book;
+    struct rusage  ru;
+    double        *open_ms, *page_ms, t0, t1, t2;
+    unicode        cp;
+    ErrCode        status;
+    int            runs, r, n;
+    size_t         text_cap = 0;
+
+    if (argc < 2 || argc > 3) {
+	puts("USAGE: epub_ttfp book.epub [runs]");
+	return E_ARG;
+    }
+    runs = argc == 3 ? atoi(argv[2]) : DEFAULT_RUNS;
+    if (runs < 1)
+	return E_ARG;
+
+    open_ms = calloc(runs, sizeof *open_ms);
+    page_ms = calloc(runs, sizeof *page_ms);
+    if (!open_ms || !page_ms)
+	return E_MEM;
+
+    for (r=0; r<runs; ++r) {
+	t0 = now_ms();
+	status = book_open(argv[1], &book);
+	if (status) {
+	    err_print(status);
+	    return status;
+	}
+	t1 = now_ms();
+	for (n=0; n<PAGE_CODEPOINTS; ++n)
+	    if ((status = book_get_codepoint(&book, &cp)))
+		break;
+	t2 = now_ms();
+	if (status && status != E_EOF) {
+	    err_print(status);
+	    return status;
+	}
+
+	open_ms[r] = t1 - t0;
+	page_ms[r] = t2 - t0;
+	if (book.epub)
+	    text_cap = book.epub->cap;
+	book_close(&book);
+    }
+
+    qsort(open_ms, runs, sizeof *open_ms, cmp_double);
+    qsort(page_ms, runs, sizeof *page_ms, cmp_double);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("book             %s\n", argv[1]);
+    printf("runs             %d\n", runs);
+    printf("open (ms)        min %.3f  median %.3f\n", open_ms[0], open_ms[runs/2]);
+    printf("first page (ms)  min %.3f  median %.3f\n", page_ms[0], page_ms[runs/2]);
+    printf("chapter buffer   %zu B\n", text_cap);
+    printf("peak rss         %ld KiB\n", ru.ru_maxrss);
+
+    free(open_ms);
+    free(page_ms);
+    return SUCCESS;
+}
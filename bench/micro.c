@@ -0,0 +1,498 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* micro.c - cost of the routines a page turn spends its time in, one
+   at a time, to judge a change to one of them in a few minutes.
+
+   | Benchmark    | One op                                              |
+   |--------------+-----------------------------------------------------|
+   | decode_book  | book_get_codepoint() from the book given            |
+   | utf8tocp     | decoding a sequence of the book already in memory   |
+   | cptoutf8     | encoding a codepoint of the book                    |
+   | font_ascii   | unifont_render() of 'e', near the start of the font |
+   | font_latin1  | of U+00E9, a little further                         |
+   | font_cjk     | of U+5317, two thirds of the way in                 |
+   | write_byte   | epd_write() of a 16x16 glyph, byte aligned          |
+   | write_odd    | the same, 3px off the byte                          |
+   | send_full    | transmit_framebuffer() of a whole frame             |
+   | send_line    | of a frame with one line of glyphs changed          |
+
+   book.c and epd.c are included whole to reach their static
+   functions. The SPI and GPIO functions epd.c calls are stubs that
+   take every write, so a send costs only what epd.c spends finding
+   and packing the bands.
+
+   Each benchmark runs for WARMUP_MS untimed, then reps times (-r,
+   default DEFAULT_REPS) for as many ops as take about REP_MS. The
+   median and fastest ns per op are reported, and the median user
+   space CPU cycles per op where perf_event_open() is allowed, "-"
+   otherwise.
+
+   -s saves the medians to a baseline file, -b compares with one:
+   anything slower than its baseline by more than -t percent (default
+   DEFAULT_THRESHOLD) is marked with a '!' and the exit status is
+   non zero. Compare runs on the same machine, and run twice if a
+   result surprises, timings on a busy machine wander.
+
+   USAGE: micro [-r reps] [-f font] [-b baseline] [-s baseline]
+                [-t percent] book                                     */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "book.c"
+#include "epd.c"
+#include "unifont.h"
+
+#define DEFAULT_FONT      "unifont.hex"
+#define DEFAULT_REPS      15
+#define DEFAULT_THRESHOLD 5.0	/* percent */
+#define WARMUP_MS         200
+#define REP_MS            20
+#define MAX_REPS          1000
+#define SAMPLE_LEN        4096	/* codepoints kept for utf8tocp, cptoutf8 */
+#define GLYPH             16	/* px square */
+#define LINE_Y            100	/* row of the line send_line changes */
+
+struct Bench {
+    const char       *name;
+    void            (*run)(long n);
+    int               needs_font;
+};
+
+struct Result {
+    char              name[32];
+    double            ns;	/* median per op */
+    double            min_ns;
+    double            cycles;	/* median per op, -ve if unknown */
+};
+
+/* state the benchmarks run against, set up by setup() */
+static struct Book    book;
+static struct Unifont font;
+static int            have_font;
+static unicode        sample[SAMPLE_LEN];
+static byte           sample_utf8[SAMPLE_LEN][4];
+static unsigned       sample_len[SAMPLE_LEN];
+static size_t         nsample;
+static byte           bitmap[UNIFONT_BITMAP_LEN];
+static struct Raster  glyph = { { GLYPH, GLYPH }, bitmap };
+static byte          *frame[2];	/* differ by a line of glyphs */
+static int            cycles_fd = -1;
+static volatile unicode sink;
+
+/* STUBS for the spi.h and gpio.h functions epd.c calls */
+
+ErrCode SPI_start(const char *d, uint64_t s) { (void)d; (void)s; return SUCCESS; }
+void    SPI_stop(void) { }
+ErrCode SPI_write_byte(byte tx) { (void)tx; return SUCCESS; }
+ErrCode SPI_write(const byte *tx, size_t len) { (void)tx; (void)len; return SUCCESS; }
+
+ErrCode GPIO_start(const char *d, const char *c) { (void)d; (void)c; return SUCCESS; }
+void    GPIO_stop(void) { }
+ErrCode GPIO_reserve_input(unsigned l) { (void)l; return SUCCESS; }
+ErrCode GPIO_reserve_input_falling(unsigned l) { (void)l; return SUCCESS; }
+ErrCode GPIO_reserve_output(unsigned l, enum GPIO_LEVEL i) { (void)l; (void)i; return SUCCESS; }
+ErrCode GPIO_reserve_output_bulk(const unsigned *l, const enum GPIO_LEVEL *i,
+				 unsigned n) { (void)l; (void)i; (void)n; return SUCCESS; }
+ErrCode GPIO_write(unsigned l, enum GPIO_LEVEL in) { (void)l; (void)in; return SUCCESS; }
+ErrCode GPIO_write_default(unsigned l) { (void)l; return SUCCESS; }
+ErrCode GPIO_write_bulk(const enum GPIO_LEVEL *in) { (void)in; return SUCCESS; }
+ErrCode GPIO_read(unsigned l, enum GPIO_LEVEL *out) { (void)l; *out = GPIO_LEVEL_High; return SUCCESS; }
+ErrCode GPIO_wait_low(unsigned l, unsigned t) { (void)l; (void)t; return SUCCESS; }
+void    GPIO_dump(void) { }
+void    GPIO_stats(struct GpioStats *out) { memset(out, 0, sizeof *out); }
+
+/* BENCHMARKS */
+
+static void
+decode_book(long n)
+{
+    unicode cp = 0;
+
+    while (n--)
+	if (book_get_codepoint(&book, &cp))
+	    book_seek(&book, 0);
+    sink = cp;
+}
+
+static void
+decode_utf8(long n)
+{
+    unicode cp = 0;
+    size_t  i = 0;
+
+    while (n--) {
+	cp ^= utf8tocp(sample_utf8[i], sample_len[i]);
+	if (++i == nsample)
+	    i = 0;
+    }
+    sink = cp;
+}
+
+static void
+encode_utf8(long n)
+{
+    byte   utf8[4] = { 0 };
+    size_t i = 0;
+
+    while (n--) {
+	cptoutf8(sample[i], &utf8);
+	if (++i == nsample)
+	    i = 0;
+	__asm__ volatile ("" : : "r"(utf8) : "memory");
+    }
+    sink = utf8[0];
+}
+
+static void
+render(unicode codepoint, long n)
+{
+    struct Glyph g = { codepoint, { { 0, 0 }, bitmap } };
+
+    while (n--)
+	unifont_render(&font, &g);
+    sink = bitmap[0];
+}
+
+static void font_ascii(long n)  { render('e', n); }
+static void font_latin1(long n) { render(0x00E9, n); }
+static void font_cjk(long n)    { render(0x5317, n); }
+
+/* Glyphs across and down the page in turn, as layout_render() does */
+static void
+write_at(coordinate offset, long n)
+{
+    struct Point at = { offset, 0 };
+
+    while (n--) {
+	epd_write(&glyph, at);
+	at.x += GLYPH;
+	if (at.x + GLYPH > WIDTH) {
+	    at.x  = offset;
+	    at.y += GLYPH;
+	    if (at.y + GLYPH > HEIGHT)
+		at.y = 0;
+	}
+    }
+}
+
+static void write_byte(long n) { write_at(0, n); }
+static void write_odd(long n)  { write_at(3, n); }
+
+static void
+send_full(long n)
+{
+    while (n--) {
+	shadow_valid[bank] = 0;
+	transmit_framebuffer(frame[n & 1], NULL);
+    }
+}
+
+/* Alternates the frames, so there is always the line to send */
+static void
+send_line(long n)
+{
+    while (n--)
+	transmit_framebuffer(frame[n & 1], NULL);
+}
+
+static const struct Bench benches[] = {
+    { "decode_book", decode_book, 0 },
+    { "utf8tocp",    decode_utf8, 0 },
+    { "cptoutf8",    encode_utf8, 0 },
+    { "font_ascii",  font_ascii,  1 },
+    { "font_latin1", font_latin1, 1 },
+    { "font_cjk",    font_cjk,    1 },
+    { "write_byte",  write_byte,  0 },
+    { "write_odd",   write_odd,   0 },
+    { "send_full",   send_full,   0 },
+    { "send_line",   send_line,   0 }
+};
+#define NBENCH            (sizeof benches / sizeof *benches)
+
+/* HARNESS */
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Counts this process's user space CPU cycles, if the kernel lets it
+   (see /proc/sys/kernel/perf_event_paranoid) */
+static void
+cycles_open(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof pe);
+    pe.type           = PERF_TYPE_HARDWARE;
+    pe.size           = sizeof pe;
+    pe.config         = PERF_COUNT_HW_CPU_CYCLES;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv     = 1;
+    cycles_fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static uint64_t
+cycles(void)
+{
+    uint64_t n;
+
+    if (cycles_fd == -1 || read(cycles_fd, &n, sizeof n) != sizeof n)
+	return 0;
+    return n;
+}
+
+/* Ops per repetition: doubled until a run takes REP_MS */
+static long
+calibrate(const struct Bench *b)
+{
+    double t0;
+    long   n;
+
+    for (n=1; n < 1L<<40; n*=2) {
+	t0 = now_ns();
+	b->run(n);
+	if (now_ns() - t0 >= REP_MS * 1e6)
+	    break;
+    }
+
+    return n;
+}
+
+static void
+measure(const struct Bench *b, int reps, struct Result *res)
+{
+    double   ns[MAX_REPS], cyc[MAX_REPS], t0, end;
+    uint64_t c0;
+    long     n;
+    int      i;
+
+    n = calibrate(b);
+    for (end = now_ns() + WARMUP_MS * 1e6; now_ns() < end; )
+	b->run(n);
+
+    for (i=0; i<reps; ++i) {
+	c0 = cycles();
+	t0 = now_ns();
+	b->run(n);
+	ns[i]  = (now_ns() - t0) / n;
+	cyc[i] = (double)(cycles() - c0) / n;
+    }
+    qsort(ns, reps, sizeof *ns, cmp_double);
+    qsort(cyc, reps, sizeof *cyc, cmp_double);
+
+    snprintf(res->name, sizeof res->name, "%s", b->name);
+    res->ns     = ns[reps/2];
+    res->min_ns = ns[0];
+    res->cycles = cycles_fd == -1 ? -1 : cyc[reps/2];
+}
+
+/* Median ns per op of name in a baseline, 0 if not there */
+static double
+baseline_ns(const struct Result *base, int nbase, const char *name)
+{
+    int i;
+
+    for (i=0; i<nbase; ++i)
+	if (!strcmp(base[i].name, name))
+	    return base[i].ns;
+    return 0;
+}
+
+/* Baseline file format: a comment line, then a line per benchmark
+   of its name and median ns per op */
+static ErrCode
+load_baseline(const char *path, struct Result *base, int *nbase)
+{
+    char  line[128];
+    FILE *fh;
+
+    fh = fopen(path, "r");
+    if (!fh)
+	return E_PATH;
+    *nbase = 0;
+    while (*nbase < (int)NBENCH && fgets(line, sizeof line, fh)) {
+	if (line[0] == '#')
+	    continue;
+	if (sscanf(line, "%31s %lf", base[*nbase].name, &base[*nbase].ns) == 2)
+	    ++*nbase;
+    }
+    fclose(fh);
+
+    return *nbase ? SUCCESS : E_FFORMAT;
+}
+
+static ErrCode
+save_baseline(const char *path, const struct Result *res, int nres)
+{
+    ErrCode status = SUCCESS;
+    FILE   *fh;
+    int     i;
+
+    fh = fopen(path, "w");
+    if (!fh)
+	return E_PATH;
+    fprintf(fh, "# micro baseline, %s, median ns per op\n", PANEL_NAME);
+    for (i=0; i<nres; ++i)
+	if (fprintf(fh, "%s %.3f\n", res[i].name, res[i].ns) < 0)
+	    status = E_IO;
+    if (fclose(fh))
+	status = E_IO;
+
+    return status;
+}
+
+/* Reads a sample of the book's codepoints and their UTF-8, sets up
+   the framebuffers and the epd.c state transmit_framebuffer() uses */
+static ErrCode
+setup(const char *book_path, const char *font_path)
+{
+    ErrCode status;
+    size_t  i;
+    int     x;
+
+    status = book_open(book_path, &book);
+    if (status)
+	return status;
+    for (nsample=0; nsample<SAMPLE_LEN; ++nsample)
+	if (book_get_codepoint(&book, sample + nsample))
+	    break;
+    if (!nsample)
+	return E_EOF;
+    for (i=0; i<nsample; ++i) {
+	cptoutf8(sample[i], &sample_utf8[i]);
+	sample_len[i] = utf8_sequence_length(sample_utf8[i][0]);
+    }
+    book_seek(&book, 0);
+
+    have_font = !unifont_open(font_path, &font);
+    if (!have_font)
+	fprintf(stderr, "%s: not found, skipping font_*\n", font_path);
+
+    for (i=0; i<sizeof bitmap; ++i)
+	bitmap[i] = 0x5A ^ i;
+    fbuf      = epd_buffer_new();
+    shadow[0] = epd_buffer_new();	/* no refreshes, one bank written */
+    frame[0]  = epd_buffer_new();
+    frame[1]  = epd_buffer_new();
+    if (!fbuf || !shadow[0] || !frame[0] || !frame[1])
+	return E_MEM;
+    epd_buffer_clear(fbuf);
+    epd_buffer_clear(frame[0]);
+    epd_buffer_clear(frame[1]);
+    for (x=0; x+GLYPH<=WIDTH; x+=GLYPH)
+	epd_buffer_write(frame[1], &glyph, (struct Point){ x, LINE_Y });
+    transmit_framebuffer(frame[0], NULL);
+
+    return SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct Result  res[NBENCH], base[NBENCH];
+    const char    *font_path = DEFAULT_FONT, *base_path = NULL;
+    const char    *save_path = NULL;
+    double         threshold = DEFAULT_THRESHOLD, was, change;
+    ErrCode        status;
+    int            opt, reps = DEFAULT_REPS, nbase = 0, nres = 0, slower = 0;
+    size_t         b;
+
+    while ((opt = getopt(argc, argv, "r:f:b:s:t:")) != -1) {
+	switch (opt) {
+	case 'r': reps      = atoi(optarg);            break;
+	case 'f': font_path = optarg;                  break;
+	case 'b': base_path = optarg;                  break;
+	case 's': save_path = optarg;                  break;
+	case 't': threshold = atof(optarg);            break;
+	default:  reps      = 0;                       break;
+	}
+    }
+    if (optind != argc-1 || reps < 1 || reps > MAX_REPS) {
+	puts("USAGE: micro [-r reps] [-f font] [-b baseline] [-s baseline]\n"
+	     "             [-t percent] book");
+	return E_ARG;
+    }
+
+    status = setup(argv[optind], font_path);
+    if (status)
+	goto err;
+    if (base_path) {
+	status = load_baseline(base_path, base, &nbase);
+	if (status) {
+	    fprintf(stderr, "%s: ", base_path);
+	    goto err;
+	}
+    }
+    cycles_open();
+
+    printf("%-12s %10s %10s %10s %9s\n", "benchmark", "ns/op", "min", "cycles/op",
+	   base_path ? "baseline" : "");
+    for (b=0; b<NBENCH; ++b) {
+	if (benches[b].needs_font && !have_font)
+	    continue;
+	measure(benches + b, reps, res + nres);
+
+	printf("%-12s %10.1f %10.1f ", res[nres].name, res[nres].ns,
+	       res[nres].min_ns);
+	if (res[nres].cycles < 0)
+	    printf("%10s", "-");
+	else
+	    printf("%10.1f", res[nres].cycles);
+	was = baseline_ns(base, nbase, res[nres].name);
+	if (was > 0) {
+	    change = (res[nres].ns / was - 1) * 100;
+	    printf(" %+8.1f%%%s", change, change > threshold ? " !" : "");
+	    slower += change > threshold;
+	}
+	putchar('\n');
+	fflush(stdout);
+	++nres;
+    }
+
+    if (save_path) {
+	status = save_baseline(save_path, res, nres);
+	if (status) {
+	    fprintf(stderr, "%s: ", save_path);
+	    goto err;
+	}
+    }
+    if (slower)
+	fprintf(stderr, "%d slower than baseline by more than %.1f%%\n",
+		slower, threshold);
+
+ err:
+    if (status)
+	err_print(status);
+    if (have_font)
+	unifont_close(&font);
+    book_close(&book);
+    free(fbuf);
+    free(shadow[0]);
+    free(frame[0]);
+    free(frame[1]);
+    if (cycles_fd != -1)
+	close(cycles_fd);
+
+    return status ? (int)status : slower ? EXIT_FAILURE : SUCCESS;
+}
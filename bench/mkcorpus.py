@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# This file is part of oku - an electronic paper book reader
+# Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+# See COPYING for licence details.
+
+# mkcorpus.py - writes the UTF-8 books bench/reader times
+#
+# Four books, the same every time, covering the scripts that cost
+# differently to decode and look up in unifont.hex:
+#
+#   ascii.utf8   English, 1 byte per character, glyphs early in the font
+#   latin1.utf8  French and German, many 2 byte characters
+#   cjk.utf8     Chinese, 3 byte characters, 16px wide glyphs far
+#                into the font
+#   mixed.utf8   all of the above with Greek and Cyrillic
+#
+# USAGE: mkcorpus.py dir [KiB per book]
+
+import os
+import random
+import sys
+
+ASCII = ("into the north window of my chamber glows the pole star with "
+         "uncanny light and through all the long hellish hours of "
+         "blackness it shines there").split()
+
+LATIN1 = ("déjà vu à côté de la forêt où naïve Zoë mangeait crème brûlée "
+          "über größere Bäume läuft Jürgen mit Öl für Straße « voilà » "
+          "façon garçon señor año").split()
+
+CJK = ("北窗外极星闪耀着奇异的光在漫长黑暗的时刻里它一直照在那里"
+       "我们读书写字看山听雨春夏秋冬日月星辰天地人和风花雪")
+CJK_PUNCT = "，。、"
+
+GREEK_CYRILLIC = ("αβγ δέλτα λόγος φως книга свет звезда окно "
+                  "ночь").split()
+
+
+def words(rng, n, vocab):
+    return " ".join(rng.choice(vocab) for _ in range(n))
+
+
+def hanzi(rng, n):
+    out = []
+    for i in range(n):
+        out.append(rng.choice(CJK))
+        if i % 12 == 11:
+            out.append(rng.choice(CJK_PUNCT))
+    return "".join(out)
+
+
+def paragraph(kind, rng):
+    if kind == "ascii":
+        return words(rng, rng.randint(20, 80), ASCII)
+    if kind == "latin1":
+        return words(rng, rng.randint(20, 80), LATIN1)
+    if kind == "cjk":
+        return hanzi(rng, rng.randint(30, 120))
+    parts = [words(rng, 10, ASCII), words(rng, 8, LATIN1),
+             hanzi(rng, 20), words(rng, 6, GREEK_CYRILLIC)]
+    rng.shuffle(parts)
+    return " ".join(parts)
+
+
+def book(path, kind, kib):
+    rng = random.Random(kind)
+    text, size = [], 0
+    while size < kib * 1024:
+        para = paragraph(kind, rng) + "\n\n"
+        text.append(para)
+        size += len(para.encode())
+    with open(path, "w", encoding="utf-8") as fh:
+        fh.write("".join(text))
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit("USAGE: mkcorpus.py dir [KiB per book]")
+    kib = int(sys.argv[2]) if len(sys.argv) == 3 else 32
+    os.makedirs(sys.argv[1], exist_ok=True)
+    for kind in ("ascii", "latin1", "cjk", "mixed"):
+        book(os.path.join(sys.argv[1], kind + ".utf8"), kind, kib)
+
+
+if __name__ == "__main__":
+    main()
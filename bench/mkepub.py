@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# This file is part of oku - an electronic paper book reader
+# Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+# See COPYING for licence details.
+
+# mkepub.py - writes a synthetic EPUB for benchmarking
+#
+# USAGE: mkepub.py out.epub [chapters] [KiB per chapter]
+
+import sys
+import zipfile
+
+CONTAINER = """<?xml version="1.0"?>
+<container version="1.0" xmlns="urn:oasis:names:tc:opendocument:xmlns:container">
+  <rootfiles>
+    <rootfile full-path="OEBPS/content.opf" media-type="application/oebps-package+xml"/>
+  </rootfiles>
+</container>
+"""
+
+WORDS = ("into the north window of my chamber glows the pole star with "
+         "uncanny light café naïve über &amp; &#8212; ").split(" ")
+
+def chapter(n, kib):
+    paras, size, i = [], 0, 0
+    while size < kib * 1024:
+        words = " ".join(WORDS[(i + j) % len(WORDS)] for j in range(60))
+        para = "<p class=\"body\">%s</p>\n" % words
+        paras.append(para)
+        size += len(para.encode())
+        i += 7
+    return ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n"
+            "<head><title>Chapter %d</title><style>p { margin: 0 }</style></head>\n"
+            "<body><h1>Chapter %d</h1>\n%s</body></html>\n"
+            % (n, n, "".join(paras)))
+
+def main():
+    out = sys.argv[1]
+    chapters = int(sys.argv[2]) if len(sys.argv) > 2 else 100
+    kib = int(sys.argv[3]) if len(sys.argv) > 3 else 64
+
+    with zipfile.ZipFile(out, "w") as z:
+        z.writestr("mimetype", "application/epub+zip", zipfile.ZIP_STORED)
+        z.writestr("META-INF/container.xml", CONTAINER, zipfile.ZIP_DEFLATED)
+        items = "".join('<item id="c%d" href="text/ch%d.xhtml" '
+                        'media-type="application/xhtml+xml"/>\n' % (i, i)
+                        for i in range(chapters))
+        refs = "".join('<itemref idref="c%d"/>\n' % i for i in range(chapters))
+        z.writestr("OEBPS/content.opf",
+                   '<?xml version="1.0"?>\n<package xmlns="http://www.idpf.org/2007/opf" '
+                   'version="3.0">\n<manifest>\n%s</manifest>\n<spine>\n%s</spine>\n'
+                   '</package>\n' % (items, refs), zipfile.ZIP_DEFLATED)
+        for i in range(chapters):
+            z.writestr("OEBPS/text/ch%d.xhtml" % i, chapter(i + 1, kib),
+                       zipfile.ZIP_DEFLATED)
+
+if __name__ == "__main__":
+    main()
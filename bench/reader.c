@@ -0,0 +1,370 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* reader.c - end to end cost of turning pages, headless.
+
+   Reads each book the way oku does, page after page from the start,
+   with the panel simulated by sim.c (see make BACKEND=sim) so epd.c
+   sends every frame as it would on a Pi. No page cache or prerender
+   thread: every turn lays out, renders and sends a new page.
+
+   Each turn is split into:
+
+   | Part     | Measured                                            |
+   |----------+-----------------------------------------------------|
+   | decode   | book_get_codepoint() over the page, timed again     |
+   |          | after layout                                        |
+   | font     | the rest of layout_page(), mostly unifont lookups   |
+   | blit     | layout_render() into the framebuffer                |
+   | transfer | epd_refresh() up to the panel's refresh, with the   |
+   |          | wire and syscall time sim.c models                  |
+
+   Latency is their sum. The refresh itself, the waveform, takes the
+   same time whatever the page and is reported on its own. Startup is
+   from book_open() to the first page sent, font and panel opened.
+
+   After each refresh the simulated screen is compared with the page
+   sent, so a transfer that saves bytes by leaving stale rows on the
+   panel fails the run rather than looking fast. -l reads in
+   landscape, the page turned to the panel's layout.
+
+   Results go to stdout, or a file with -o, as JSON.
+
+   USAGE: reader [-l] [-n pages] [-f font] [-o results.json] book... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "oku.h"
+#include "err.h"
+#include "book.h"
+#include "unifont.h"
+#include "layout.h"
+#include "epd.h"
+#include "framebuffer.h"
+#include "rotate.h"
+#include "sim.h"
+#include "panel.h"
+
+#define DEFAULT_PAGES     100	/* per book, the first so many */
+#define DEFAULT_FONT      "unifont.hex"
+#ifndef BUILD_ID
+#define BUILD_ID          "unknown"
+#endif
+
+enum PART { DECODE, FONT, BLIT, TRANSFER, TOTAL, NPART };
+
+static const char *part_name[NPART] = {
+    "decode", "font", "blit", "transfer", "total"
+};
+
+struct Result {
+    const char       *path;
+    size_t            bytes;
+    int               pages;
+    double            startup_ms;
+    double            refresh_ms; /* mean waveform time */
+    double            elapsed_ms; /* sum of latencies */
+    double           *ms[NPART];  /* per page */
+    unsigned long     sent;	  /* SPI bytes, commands and data */
+};
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of n sorted values */
+static double
+percentile(const double *v, int n, int pct)
+{
+    int rank = (n * pct + 99) / 100;
+
+    return n ? v[rank > 0 ? rank-1 : 0] : 0;
+}
+
+/* Time to decode the codepoints of a laid out page again */
+static double
+decode_ms(struct Book *book, const struct DisplayList *page)
+{
+    unicode cp;
+    double  t0, t;
+
+    if (book_seek(book, page->start))
+	return 0;
+    t0 = now_ms();
+    while (book_tell(book) < page->end && !book_get_codepoint(book, &cp))
+	;
+    t = now_ms() - t0;
+    book_seek(book, page->end);
+
+    return t;
+}
+
+/* Sends the screen buffer, returning the ms until the panel starts
+   its refresh and setting wait to the refresh itself */
+static ErrCode
+transfer(double *ms, double *wait)
+{
+    struct SimStats before, after;
+    ErrCode         status;
+    double          t0;
+
+    sim_stats(&before);
+    t0 = now_ms();
+    status = epd_refresh();
+    *ms = now_ms() - t0;
+    sim_stats(&after);
+
+    *wait = after.wait_ms - before.wait_ms;
+    *ms  += after.model_ms - before.model_ms - *wait;
+
+    return status;
+}
+
+/* E_SPI if the simulated screen isn't the page in the screen buffer.
+   In landscape the page is first rotated into the scratch buffer
+   turned, the way it was sent to the panel. */
+static ErrCode
+check_screen(byte *turned)
+{
+    static const struct Point sideways = { HEIGHT, WIDTH };
+    const byte   *want = epd_buffer();
+    ErrCode       status;
+
+    if (landscape) {
+	status = rotate_cw(want, sideways, turned);
+	if (status)
+	    return status;
+	want = turned;
+    }
+
+    return memcmp(sim_screen(), want, epd_buffer_len()) ? E_SPI : SUCCESS;
+}
+
+static ErrCode
+read_book(const char *path, const char *font_path, int max_pages,
+	  struct Result *res)
+{
+    struct Book        book;
+    struct Unifont     font;
+    struct DisplayList page = { 0 };
+    struct SimStats    sim, start;
+    struct Point       paper;
+    ErrCode            status;
+    byte              *turned = NULL;
+    double             t0, t1, wait, ms[NPART];
+    int                i, p;
+
+    memset(res, 0, sizeof *res);
+    res->path = path;
+    for (i=0; i<NPART; ++i)
+	if (!(res->ms[i] = calloc(max_pages, sizeof *res->ms[i])))
+	    return E_MEM;
+
+    sim_stats(&start);
+    t0 = now_ms();
+    status = book_open(path, &book);
+    if (status)
+	return status;
+    status = unifont_open(font_path, &font);
+    if (status)
+	goto err_book;
+    status = epd_start(&paper);
+    if (status)
+	goto err_font;
+    if (landscape) {
+	status = epd_landscape(&paper);
+	if (status)
+	    goto err;
+	turned = epd_buffer_new();
+	if (!turned) {
+	    status = E_MEM;
+	    goto err;
+	}
+    }
+    res->bytes = book.len;
+
+    for (p=0; p<max_pages; ++p) {
+	t1 = now_ms();
+	status = layout_page(&book, &font, paper, &page);
+	if (status == E_EOF) {
+	    status = SUCCESS;
+	    break;
+	}
+	if (status)
+	    goto err;
+	ms[FONT]   = now_ms() - t1;
+	ms[DECODE] = decode_ms(&book, &page);
+	ms[FONT]   = ms[FONT] > ms[DECODE] ? ms[FONT] - ms[DECODE] : 0;
+
+	t1 = now_ms();
+	status = layout_render(&page, epd_buffer());
+	ms[BLIT] = now_ms() - t1;
+	if (status)
+	    goto err;
+
+	status = transfer(&ms[TRANSFER], &wait);
+	if (status)
+	    goto err;
+	if (p == 0) {
+	    sim_stats(&sim);
+	    res->startup_ms = now_ms() - t0 + sim.model_ms - start.model_ms
+		- wait;
+	}
+	status = check_screen(turned);
+	if (status) {
+	    fprintf(stderr, "%s: page %d on the panel isn't the page sent\n",
+		    path, p+1);
+	    goto err;
+	}
+
+	ms[TOTAL] = ms[DECODE] + ms[FONT] + ms[BLIT] + ms[TRANSFER];
+	for (i=0; i<NPART; ++i)
+	    res->ms[i][p] = ms[i];
+	res->elapsed_ms += ms[TOTAL];
+	res->refresh_ms += wait;
+    }
+    res->pages = p;
+    if (p)
+	res->refresh_ms /= p;
+
+    sim_stats(&sim);
+    res->sent = sim.bytes - start.bytes;
+    if (sim.errors) {
+	fprintf(stderr, "%s: %lu bytes the panel would ignore\n", path,
+		sim.errors);
+	status = E_SPI;
+    }
+
+ err:
+    free(turned);
+    layout_free(&page);
+    epd_stop();
+ err_font:
+    unifont_close(&font);
+ err_book:
+    book_close(&book);
+    return status;
+}
+
+/* Writes str as a JSON string, quoted, escaping quotes, backslashes
+   and control characters, e.g. in a path */
+static void
+print_json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; ++str) {
+	if (*str == '"' || *str == '\\')
+	    fprintf(out, "\\%c", *str);
+	else if ((unsigned char)*str < 0x20)
+	    fprintf(out, "\\u%04x", (unsigned char)*str);
+	else
+	    fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void
+print_json(FILE *out, const struct Result *res, int nbook, int max_pages)
+{
+    struct rusage ru;
+    int           b, i;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(out, "{\n  \"build\": \"%s\",\n  \"panel\": \"%s\",\n"
+	    "  \"max_pages\": %d,\n  \"peak_rss_kib\": %ld,\n  \"books\": [",
+	    BUILD_ID, PANEL_NAME, max_pages, ru.ru_maxrss);
+    for (b=0; b<nbook; ++b, ++res) {
+	fprintf(out, "%s\n    {\n      \"path\": ", b ? "," : "");
+	print_json_string(out, res->path);
+	fprintf(out, ",\n      \"bytes\": %zu,\n      \"pages\": %d,\n"
+		"      \"pages_per_s\": %.1f,\n      \"startup_ms\": %.3f,\n"
+		"      \"refresh_ms\": %.1f,\n      \"sent_bytes\": %lu,\n"
+		"      \"latency_ms\": {",
+		res->bytes, res->pages,
+		res->elapsed_ms > 0 ? res->pages / res->elapsed_ms * 1e3 : 0,
+		res->startup_ms, res->refresh_ms, res->sent);
+	for (i=0; i<NPART; ++i) {
+	    qsort(res->ms[i], res->pages, sizeof *res->ms[i], cmp_double);
+	    fprintf(out, "%s\n        \"%s\": { \"p50\": %.3f, \"p99\": %.3f }",
+		    i ? "," : "", part_name[i],
+		    percentile(res->ms[i], res->pages, 50),
+		    percentile(res->ms[i], res->pages, 99));
+	}
+	fputs("\n      }\n    }", out);
+    }
+    fputs("\n  ]\n}\n", out);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct Result *res;
+    const char    *font_path = DEFAULT_FONT, *out_path = NULL;
+    FILE          *out = stdout;
+    ErrCode        status;
+    int            opt, pages = DEFAULT_PAGES, nbook, b, i;
+
+    while ((opt = getopt(argc, argv, "ln:f:o:")) != -1) {
+	switch (opt) {
+	case 'l': landscape = 1;                       break;
+	case 'n': pages     = atoi(optarg);            break;
+	case 'f': font_path = optarg;                  break;
+	case 'o': out_path  = optarg;                  break;
+	default:  pages     = 0;                       break;
+	}
+    }
+    nbook = argc - optind;
+    if (nbook < 1 || pages < 1) {
+	puts("USAGE: reader [-l] [-n pages] [-f font] [-o results.json] book...");
+	return E_ARG;
+    }
+
+    res = calloc(nbook, sizeof *res);
+    if (!res)
+	return E_MEM;
+
+    for (b=0; b<nbook; ++b) {
+	fprintf(stderr, "%s...\n", argv[optind+b]);
+	status = read_book(argv[optind+b], font_path, pages, res+b);
+	if (status) {
+	    fprintf(stderr, "%s: ", argv[optind+b]);
+	    err_print(status);
+	    return status;
+	}
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))) {
+	perror(out_path);
+	return E_PATH;
+    }
+    print_json(out, res, nbook, pages);
+    if (out != stdout)
+	fclose(out);
+
+    for (b=0; b<nbook; ++b)
+	for (i=0; i<NPART; ++i)
+	    free(res[b].ms[i]);
+    free(res);
+
+    return SUCCESS;
+}
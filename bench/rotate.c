@@ -0,0 +1,90 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* rotate.c - cost of turning a landscape frame to the panel layout.
+
+   Times rotate_cw() on a full 296x128 canvas against turning it one
+   pixel at a time, and checks the two agree.
+
+   USAGE: rotate [frames]                                             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oku.h"
+#include "err.h"
+#include "rotate.h"
+
+#define WIDTH             128	/* panel */
+#define HEIGHT            296
+#define LEN               (WIDTH/8 * HEIGHT)
+#define DEFAULT_FRAMES    2000
+
+static byte canvas[LEN], panel[LEN], check[LEN];
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* The obvious way: every pixel of the canvas to its place */
+static void
+rotate_pixels(const byte *src, byte *dest)
+{
+    int x, y, px;
+
+    memset(dest, 0, LEN);
+    for (y=0; y<WIDTH; ++y)
+	for (x=0; x<HEIGHT; ++x)
+	    if (src[y*HEIGHT/8 + x/8] & 0x80 >> x%8) {
+		px = WIDTH-1-y;
+		dest[x*WIDTH/8 + px/8] |= 0x80 >> px%8;
+	    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct Point size = { HEIGHT, WIDTH };
+    double t0, fast, slow;
+    int    frames, i;
+
+    frames = argc == 2 ? atoi(argv[1]) : DEFAULT_FRAMES;
+    if (argc > 2 || frames < 1) {
+	puts("USAGE: rotate [frames]");
+	return E_ARG;
+    }
+
+    srand(1);
+    for (i=0; i<LEN; ++i)
+	canvas[i] = rand();
+
+    rotate_pixels(canvas, check);
+    rotate_cw(canvas, size, panel);
+    if (memcmp(panel, check, LEN)) {
+	puts("rotate_cw() disagrees with per pixel rotation");
+	return E_UNREACHABLE;
+    }
+
+    t0 = now_us();
+    for (i=0; i<frames; ++i)
+	rotate_pixels(canvas, check);
+    slow = (now_us() - t0) / frames;
+
+    t0 = now_us();
+    for (i=0; i<frames; ++i)
+	rotate_cw(canvas, size, panel);
+    fast = (now_us() - t0) / frames;
+
+    printf("per pixel        %8.2f us/frame\n", slow);
+    printf("8x8 transpose    %8.2f us/frame  %.1fx faster\n", fast, slow / fast);
+
+    return SUCCESS;
+}
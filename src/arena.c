@@ -0,0 +1,84 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* arena.c - page scoped bump allocator.
+
+   Everything needed to lay out and render one page lives exactly as
+   long as the page, so it is carved from a single block allocated
+   once and handed back all at once by resetting a cursor. Turning a
+   page then costs no calls to malloc or free.
+
+   The block is sized by its owner for the worst case page, so
+   running out is an error rather than a reason to grow. Counters of
+   bytes and allocations per page and the high water mark are kept
+   for tuning that size.                                             */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "arena.h"
+
+#define ALIGN             alignof(max_align_t)
+
+ErrCode
+arena_init(struct Arena *arena, size_t cap)
+{
+    arena->base = malloc(cap);
+    if (!arena->base)
+	return E_MEM;
+
+    arena->cap    = cap;
+    arena->used   = 0;
+    arena->high   = 0;
+    arena->nalloc = 0;
+    return SUCCESS;
+}
+
+void
+arena_free(struct Arena *arena)
+{
+#ifdef DEBUG
+    if (arena->base)
+	printf("Arena: high water %zuB of %zuB\n", arena->high, arena->cap);
+#endif
+    free(arena->base);
+    arena->base = NULL;
+    arena->cap  = arena->used = 0;
+}
+
+/* Returns size bytes aligned for any type, or NULL if the arena is
+   full */
+void *
+arena_alloc(struct Arena *arena, size_t size)
+{
+    size_t at;
+
+    at = (arena->used + ALIGN-1) & ~(size_t)(ALIGN-1);
+    if (at + size > arena->cap || at + size < at)
+	return NULL;
+
+    arena->used = at + size;
+    if (arena->used > arena->high)
+	arena->high = arena->used;
+    ++arena->nalloc;
+
+    return arena->base + at;
+}
+
+/* Releases everything allocated since the last reset */
+void
+arena_reset(struct Arena *arena)
+{
+#ifdef DEBUG
+    if (arena->nalloc)
+	printf("Arena: page used %zuB in %zu allocations, high water %zuB\n",
+	       arena->used, arena->nalloc, arena->high);
+#endif
+    arena->used   = 0;
+    arena->nalloc = 0;
+}
@@ -0,0 +1,18 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* arena.h - page scoped bump allocator */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "err.h"
+#include "oku.h"
+
+ErrCode arena_init(struct Arena *arena, size_t cap);
+void    arena_free(struct Arena *arena);
+void   *arena_alloc(struct Arena *arena, size_t size);
+void    arena_reset(struct Arena *arena);
+
+#endif	/* ARENA_H */
@@ -0,0 +1,181 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* blit.c - places bitmaps on a framebuffer at any pixel.
+
+   Both bitmaps are horizontally packed, most significant bit on the
+   left. Rather than walking pixels, each row is moved up to 56 bits
+   at a time: the source bits are loaded into a 64 bit word, shifted
+   to the destination's bit offset and merged with the destination
+   word under a mask. So a 16px glyph row at any x costs one load,
+   shift and store, much like the byte aligned memcpy it replaces.
+
+   The source is clipped to the destination, so bitmaps may hang off
+   any edge, e.g. for margins or indicators. No byte outside either
+   bitmap is read or written.                                         */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "oku.h"
+#include "err.h"
+
+#include "blit.h"
+
+#define PITCH(X)          ( (X)%8 ? 1+(X)/8 : (X)/8 )
+#define CHUNK_BITS        56	/* leaves room to shift by 7 in a word */
+#define PAD_LEN           (64+8) /* padded copy of a wide unifont glyph */
+
+/* Merges rows FROM to TO, loading SN bytes of src and DN of dest */
+#define EACH_ROW(FROM, TO, SN, DN, MERGE)				\
+    do {								\
+	uint64_t bits, word;						\
+	int      row;							\
+	for (row=(FROM); row<(TO); ++row) {				\
+	    bits = load_be(s + row*spitch, (SN));			\
+	    bits = ((bits << (sp%8)) >> (dp%8)) & mask;		\
+	    word = load_be(d + row*dpitch, (DN));			\
+	    store_be(d + row*dpitch, (DN), (MERGE));			\
+	}								\
+    } while (0)
+
+static void     blit_rows(byte *dest, const byte *dend, size_t dpitch, int dx,
+			  const byte *src, const byte *send, size_t spitch,
+			  int sx, int w, int h, enum BLIT_MODE mode);
+static uint64_t load_be(const byte *p, int n);
+static void     store_be(byte *p, int n, uint64_t word);
+
+/* Draws src with its top left pixel at (x,y) on dest, a bitmap dsize
+   pixels across, combining bits as described by mode. Parts of src
+   outside dest are ignored. */
+ErrCode
+blit(byte *dest, struct Point dsize, const struct Raster *src,
+     int x, int y, enum BLIT_MODE mode)
+{
+    int         x0, x1, y0, y1;
+    size_t      spitch, dpitch;
+    const byte *s, *send;
+    byte       *d, pad[PAD_LEN];
+
+    assert(dest && src && src->bitmap && "Dereferenced null pointer");
+
+    /* clip to dest */
+    x0 = x < 0 ? 0 : x;
+    y0 = y < 0 ? 0 : y;
+    x1 = x + src->size.x < dsize.x ? x + src->size.x : dsize.x;
+    y1 = y + src->size.y < dsize.y ? y + src->size.y : dsize.y;
+    if (x0 >= x1 || y0 >= y1)
+	return SUCCESS;		/* nothing on dest */
+
+    spitch = PITCH(src->size.x);
+    dpitch = PITCH(dsize.x);
+    s = src->bitmap + (y0-y) * spitch;
+    d = dest + y0 * dpitch;
+
+    send = src->bitmap + spitch*src->size.y;
+
+    /* small bitmaps such as glyphs are copied to a padded buffer, so
+       every row can be read a whole word at a time */
+    if (send - s + 8 <= (long)sizeof pad) {
+	memcpy(pad, s, send - s);
+	send = pad + sizeof pad;
+	s    = pad;
+    }
+
+    blit_rows(d, dest + dpitch*dsize.y, dpitch, x0,
+	      s, send, spitch, x0-x, x1-x0, y1-y0, mode);
+
+    return SUCCESS;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Merges w bits of each of h rows of src, starting at bit sx, into
+   dest at bit dx. The loop runs over rows inside each chunk so the
+   shifts, masks and byte counts are worked out once per chunk. Rows
+   with 8 bytes to spare before the end of both bitmaps are moved
+   with whole word loads and stores; bytes outside the mask are
+   written back unchanged. */
+static void
+blit_rows(byte *dest, const byte *dend, size_t dpitch, int dx,
+	  const byte *src, const byte *send, size_t spitch, int sx,
+	  int w, int h, enum BLIT_MODE mode)
+{
+    uint64_t    mask;
+    int         n, sp, dp, sn, dn, done, whole;
+    const byte *s;
+    byte       *d;
+
+    for (done=0; done<w; done+=n) {
+	n  = w-done < CHUNK_BITS ? w-done : CHUNK_BITS;
+	sp = sx + done;
+	dp = dx + done;
+	sn = (sp%8 + n + 7)/8;	/* bytes touched in src and dest */
+	dn = (dp%8 + n + 7)/8;
+
+	/* n source bits moved from the top of the word to the
+	   destination's bit offset */
+	mask = (~(uint64_t)0 << (64-n)) >> (dp%8);
+	s    = src + sp/8;
+	d    = dest + dp/8;
+
+	whole = h;		/* usually all but the page's last rows */
+	if (s + (h-1)*spitch + 8 > send || d + (h-1)*dpitch + 8 > dend)
+	    for (whole=0; whole<h && s + whole*spitch + 8 <= send
+		     && d + whole*dpitch + 8 <= dend; ++whole)
+		;
+
+	switch (mode) {
+	case BLIT_COPY:
+	    EACH_ROW(0, whole, 8, 8, (word & ~mask) | bits);
+	    EACH_ROW(whole, h, sn, dn, (word & ~mask) | bits);
+	    break;
+	case BLIT_OR:
+	    EACH_ROW(0, whole, 8, 8, word | bits);
+	    EACH_ROW(whole, h, sn, dn, word | bits);
+	    break;
+	case BLIT_ANDNOT:
+	    EACH_ROW(0, whole, 8, 8, word & ~bits);
+	    EACH_ROW(whole, h, sn, dn, word & ~bits);
+	    break;
+	}
+    }
+}
+
+/* Reads n <= 8 bytes into the top of a word, first byte highest */
+static inline uint64_t
+load_be(const byte *p, int n)
+{
+    uint64_t word = 0;
+    int      i;
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (n == 8) {
+	memcpy(&word, p, 8);
+	return __builtin_bswap64(word);
+    }
+#endif
+    for (i=0; i<n; ++i)
+	word |= (uint64_t)p[i] << (56 - 8*i);
+
+    return word;
+}
+
+/* Writes the top n <= 8 bytes of word, highest byte first */
+static inline void
+store_be(byte *p, int n, uint64_t word)
+{
+    int i;
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (n == 8) {
+	word = __builtin_bswap64(word);
+	memcpy(p, &word, 8);
+	return;
+    }
+#endif
+    for (i=0; i<n; ++i)
+	p[i] = word >> (56 - 8*i);
+}
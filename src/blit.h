@@ -0,0 +1,23 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* blit.h - places bitmaps on a framebuffer at any pixel */
+
+#ifndef BLIT_H
+#define BLIT_H
+
+#include "err.h"
+#include "oku.h"
+
+/* How set bits of the source combine with the destination */
+enum BLIT_MODE {
+    BLIT_COPY,			/* dest = src */
+    BLIT_OR,			/* dest |= src */
+    BLIT_ANDNOT			/* dest &= ~src, ink on a white page */
+};
+
+ErrCode blit(byte *dest, struct Point dsize, const struct Raster *src,
+	     int x, int y, enum BLIT_MODE mode);
+
+#endif	/* BLIT_H */
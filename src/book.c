@@ -2,7 +2,8 @@
    Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
    See COPYING for licence details. */
 
-/* book.c - decodes UTF-8 ebook text files into unicode codepoints */
+/* book.c - decodes UTF-8 ebook text files into unicode codepoints.
+   EPUB books are read through epub.c and decoded the same way. */
 
 #include <stdio.h>
 #include <assert.h>
@@ -13,11 +14,17 @@
 #include "oku.h"
 
 #include "book.h"
+#include "chunk.h"
+#include "epub.h"
+#include "trace.h"
+#include "metrics.h"
 
 #define STACK_FEXT        ".oku" /* stack save file extension */
+#define CHUNK_FEXT        ".okc" /* chunk manifest file extension */
 #define STACK_INITIAL     10
 
 /* UTF-8 */
+static ErrCode   read_utf8_octet(struct Book *book_to_read, byte *buf);
 static ErrCode   fread_utf8_octet(FILE *book_to_read, byte *buf);
 static unsigned  utf8_sequence_length(byte first);
 static unicode   utf8tocp(byte *utf8, unsigned len);
@@ -25,13 +32,19 @@ static void      cptoutf8(unicode codepoint, byte (*utf8)[4]);
 
 /* file operations */
 static ErrCode  flrc(FILE *fh, checksum *lrc, size_t *len);
+static checksum slrc(const char *str);
 static char    *fname_create(checksum name, const char *ext);
 static void     fcloseifexists(FILE **toclose);
 
 /* bookmarking stack and io */
 static ErrCode  load_bmstack(struct Bookmarks *out);
 static ErrCode  save_bmstack(struct Bookmarks *out);
-static ErrCode  grow_bmstack(long *stack, size_t newlen);
+static ErrCode  grow_bmstack(long **stack, size_t newlen);
+static ErrCode  swap_manifest(const struct Book *opened, struct Chunks *old);
+static ErrCode  rebase_bmstack(const struct Chunks *old, const struct Chunks *new,
+			       struct Bookmarks *out);
+static ErrCode  insert_bmstack(struct Bookmarks *addto, size_t at, long position);
+static void     erase_bmstack(struct Bookmarks *takefrom, size_t at);
 
 /* Generate a book object from filepath */
 ErrCode
@@ -41,15 +54,54 @@ book_open(const char *path, struct Book *new)
 
     assert_ptr(path != NULL);
 
+    new->epub         = NULL;
+    new->chunks.n     = 0;
+    new->chunks.chunk = NULL;
+
     new->fh = fopen(path, "r");
     if (!new->fh)
 	return E_PATH;
 
     status = flrc(new->fh, &new->fhash, &new->len);    
+    if (status)
+	return status;
+    new->phash        = slrc(path);
+    new->chunks.fhash = new->fhash;
+
+    /* EPUB positions are within chapter text, not the file, so edits
+       can't be tracked by chunking the file */
+    if (epub_detect(new->fh))
+	return epub_open(new->fh, &new->epub);
+
+    /* chunks let bookmarks survive edits to the file */
+    status = chunks_scan(new->fh, &new->chunks);
 
     return status;
 }
 
+/* Returns the read position to save as a bookmark, or -1 on error */
+long
+book_tell(const struct Book *toread)
+{
+    assert_ptr(toread && toread->fh);
+
+    return toread->epub ? epub_tell(toread->epub) : ftell(toread->fh);
+}
+
+/* Moves the read position to one previously returned by book_tell(),
+   e.g. a bookmark. */
+ErrCode
+book_seek(struct Book *toseek, long position)
+{
+    assert_ptr(toseek && toseek->fh);
+
+    if (toseek->epub)
+	return epub_seek(toseek->epub, position);
+
+    return fseek(toseek->fh, position, SEEK_SET)
+	? E_IO : SUCCESS;
+}
+
 /* Reads the next codepoint in the book */
 ErrCode
 book_get_codepoint(struct Book *toread, unicode *codepoint_out)
@@ -60,27 +112,23 @@ book_get_codepoint(struct Book *toread, unicode *codepoint_out)
 
     assert_ptr(codepoint_out && toread && toread->fh);
 
-    status = fread_utf8_octet(toread->fh, utf8);
+    TRACE_BEGIN(TRACE_DECODE);
+    status = read_utf8_octet(toread, utf8);
     if (status)
 	goto err;
 
     utf8len = utf8_sequence_length(utf8[0]);
 	    
     for (i=1; i<utf8len; ++i) {
-	status = fread_utf8_octet(toread->fh, utf8 + i);
+	status = read_utf8_octet(toread, utf8 + i);
 	if (status)
 	    goto err;
     }
 
     *codepoint_out = utf8tocp(utf8, utf8len);
 
-#ifdef DEBUG
-    printf("UTF-8: '%c' 0x%02hhX%02hhX02%hhX%02hhX -> U+%08X\n",
-	   utf8[0], utf8[1], utf8[2], utf8[3], *codepoint_out,
-	   (*codepoint_out & 0xFFFFFF00) ? '?' : *codepoint_out & 0xFF);
-#endif
-
  err:
+    TRACE_END_N(TRACE_DECODE, status ? 0 : *codepoint_out);
     return status;
 }
 
@@ -99,11 +147,8 @@ book_unget_codepoint(struct Book *writeto, unicode codepoint)
     cptoutf8(codepoint, &utf8);
     len = utf8_sequence_length(utf8[0]);
 
-#ifdef DEBUG
-    printf("UTF-8: '%c' 0x%02hhX%02hhX02%hhX%02hhX <- U+%08X\n",
-	   utf8[0], utf8[1], utf8[2], utf8[3], codepoint,
-	   (codepoint & 0xFFFFFF00) ? '?' : codepoint & 0xFF);
-#endif
+    if (writeto->epub)		/* codepoints never span chapters */
+	return epub_seek(writeto->epub, epub_tell(writeto->epub) - len);
 
     return fseek(writeto->fh, -1L * len, SEEK_CUR)
 	? E_IO : SUCCESS;
@@ -112,18 +157,27 @@ book_unget_codepoint(struct Book *writeto, unicode codepoint)
 void
 book_close(struct Book *toclose)
 {
+    epub_close(toclose->epub);
+    toclose->epub = NULL;
     fcloseifexists(&toclose->fh);
+    chunks_free(&toclose->chunks);
 }
 
 /* BOOKMARKING INTERFACE IMPLEMENTATION */
 
 /* Loads bookmarks (position stack) from disk using the opened
    book's hash. If this is a new book with no bookmarks, an empty one
-   is allocated. */
+   is allocated - unless an earlier version of the same file was
+   bookmarked, in which case its bookmarks are carried across (see
+   rebase_bmstack()). */
 ErrCode
 bookmarks_open(const struct Book *opened, struct Bookmarks *new)
 {
+    ErrCode       status;
+    struct Chunks old;
+
     new->n     = 0;
+    new->stale = 0;
     new->len   = STACK_INITIAL;
     new->stack = calloc(new->len, sizeof *new->stack);
     if (!new->stack)
@@ -132,16 +186,27 @@ bookmarks_open(const struct Book *opened, struct Bookmarks *new)
     if (!new->fname)
 	return E_MEM;
 
+    status = swap_manifest(opened, &old);
+    if (status)
+	return status;
+
     /* If this book has been opened before there should be a matching
        structure saved to disk */
     new->fh = fopen(new->fname, "r+");
     if (!new->fh) {		/* new book, create new file */
 	err_clear_errno();
 	new->fh = fopen(new->fname, "w+");
-	return new->fh ? SUCCESS : E_IO;
-    } 
+	if (!new->fh)
+	    status = E_IO;
+	else if (old.n)		/* edited since last opened */
+	    status = rebase_bmstack(&old, &opened->chunks, new);
+    } else {
+	status = load_bmstack(new); /* loads previously saved data */
+	new->stale = new->n;
+    }
 
-    return load_bmstack(new);	/* loads previously saved data */
+    chunks_free(&old);
+    return status;
 }
 
 /* Pushes a new bookmark to the bookmark stack */
@@ -152,12 +217,12 @@ bookmarks_push(const struct Book *position, struct Bookmarks *addto)
     /* Grow stack if full */
     if (addto->n == addto->len) {
 	addto->len *= 2;
-	status = grow_bmstack(addto->stack, addto->len);
+	status = grow_bmstack(&addto->stack, addto->len);
 	if (status)
 	    return status;
     }
     
-    addto->stack[addto->n] = ftell(position->fh);
+    addto->stack[addto->n] = book_tell(position);
     if (addto->stack[addto->n] == -1)
 	return E_IO;
     else
@@ -170,6 +235,77 @@ bookmarks_push(const struct Book *position, struct Bookmarks *addto)
 
     return SUCCESS;
 }
+
+/* Removes the most recent bookmark, writing it to position. Returns
+   E_MT if the stack is empty. */
+ErrCode
+bookmarks_pop(struct Bookmarks *takefrom, long *position)
+{
+    if (takefrom->n == 0)
+	return E_MT;
+
+    *position = takefrom->stack[--takefrom->n];
+    if (takefrom->stale > takefrom->n)
+	takefrom->stale = takefrom->n;
+
+    return SUCCESS;
+}
+
+/* Lays out the pages invalidated by an edit to the book again, from
+   the last bookmark before the edit, until a new page boundary lands
+   on a bookmark carried over from the old file. Page boundaries only
+   depend on where a page starts, so every bookmark after that point
+   is still valid and is kept as it is.
+
+   measure() must lay out one page from the book's current position
+   without drawing it, leaving the book positioned at the start of the
+   next page. It returns E_EOF if there is no page to lay out.       */
+ErrCode
+bookmarks_relayout(struct Book *book, struct Bookmarks *pages,
+		   ErrCode (*measure)(void))
+{
+    ErrCode status;
+    size_t  i;
+    long    end;
+
+    i = pages->stale;
+    if (i == pages->n)		/* nothing invalidated */
+	return SUCCESS;
+
+    status = book_seek(book, i ? pages->stack[i-1] : 0);
+    if (status)
+	return status;
+
+    while (i < pages->n) {
+	status = measure();
+	if (status == E_EOF) {	/* book was shortened */
+	    pages->n = i;
+	    break;
+	} else if (status) {
+	    return status;
+	}
+	end = book_tell(book);
+	if (end == -1)
+	    return E_IO;
+
+	/* old boundaries overtaken by the new layout are gone */
+	while (i < pages->n && pages->stack[i] < end)
+	    erase_bmstack(pages, i);
+	if (i < pages->n && pages->stack[i] == end)
+	    break;		/* boundaries resynchronised */
+
+	status = insert_bmstack(pages, i++, end);
+	if (status)
+	    return status;
+    }
+
+#ifdef DEBUG
+    printf("BMstack: relayout %zu..%zu of %zu\n", pages->stale, i, pages->n);
+#endif
+
+    pages->stale = pages->n;
+    return SUCCESS;
+}
     
 
 /* Saves any bookmarks in the stack to disk and and frees all
@@ -196,6 +332,19 @@ bookmarks_close(struct Bookmarks *toclose)
 
 /* STATIC FUNCTIONS */
 
+/* 2B XOR checksum of a null terminated string, as flrc() below. */
+static checksum
+slrc(const char *str)
+{
+    checksum lrc;
+    size_t   i;
+
+    for (lrc=0, i=0; str[i]; ++i)
+	lrc ^= i%2 ? (byte)str[i] : (byte)str[i] << 8;
+
+    return lrc;
+}
+
 /* Performs 2B XOR checksum on the file stream fh from its current
    position to the end of the file.
 
@@ -213,10 +362,10 @@ flrc(FILE *fh, checksum *lrc, size_t *len)
     *len = 0; 
     while ((ch[0]=getc(fh)) != EOF) {
 	*lrc ^= ch[0] << 8;
-	++len;
+	++*len;
 	if ((ch[1]=getc(fh)) != EOF) {
 	    *lrc ^= ch[1];
-	    ++len;
+	    ++*len;
 	} else {
 	    break;
 	}
@@ -264,6 +413,15 @@ fcloseifexists(FILE **toclose)
    UTF-8 ENCODING AND DECODING
 */
 
+/* Read a single byte of the book's text into buffer */
+static ErrCode
+read_utf8_octet(struct Book *book, byte *buf)
+{
+    return book->epub
+	? epub_getc(book->epub, buf)
+	: fread_utf8_octet(book->fh, buf);
+}
+
 /* Read a single byte into buffer */
 static ErrCode
 fread_utf8_octet(FILE *fh, byte *buf)
@@ -370,8 +528,8 @@ cptoutf8(unicode codepoint, byte (*utf8)[4])
 	(*utf8)[0] = 0xFF & ((codepoint >> (16-4 )) | 0xE0);
 	(*utf8)[1] = 0xFF & ((codepoint >> (16-10)) | 0x80);
 	(*utf8)[2] = 0xFF & ((codepoint >> (16-16)) | 0x80);
-    } else if (codepoint > 0x0007FF) { /* 2B */
-	(*utf8)[0] = 0xFF & ((codepoint >> (11-5 )) | 0xF0);
+    } else if (codepoint > 0x00007F) { /* 2B */
+	(*utf8)[0] = 0xFF & ((codepoint >> (11-5 )) | 0xC0);
 	(*utf8)[1] = 0xFF & ((codepoint >> (11-11)) | 0x80);
     } else {			       /* 1B */
 	(*utf8)[0] = 0x7F & codepoint;
@@ -406,7 +564,7 @@ load_bmstack(struct Bookmarks *out)
     /*
        Resize buffer to fit the stack on file before reading file
     */
-    status = grow_bmstack(out->stack, out->len);
+    status = grow_bmstack(&out->stack, out->len);
     if (status)
 	return status;;
     if (out->len == 0)
@@ -429,12 +587,14 @@ save_bmstack(struct Bookmarks *out)
 {
     assert(out->n > 0 && "Won't write empty stack"); 
 
+    rewind(out->fh);
     if (fwrite(&out->n, sizeof out->n, 1, out->fh) != 1)
 	goto err;
     if (fwrite(&out->len, sizeof out->len, 1, out->fh) != 1)
 	goto err;
     if (fwrite(out->stack, sizeof *out->stack, out->len, out->fh) != out->len)
 	goto err;
+    metrics_add(METRIC_BOOKMARK_WRITES, 1);
 
     return SUCCESS;
  err:
@@ -443,13 +603,169 @@ save_bmstack(struct Bookmarks *out)
 
 /* Resizes stack to fit 'newlen' entries. */
 static ErrCode
-grow_bmstack(long *stack, size_t newlen)
+grow_bmstack(long **stack, size_t newlen)
 {
-    stack = realloc(stack, newlen * (sizeof *stack));
+    long *grown;
+
+    grown = realloc(*stack, newlen * (sizeof **stack));
+    if (grown)
+	*stack = grown;
 
 #ifdef DEBUG
     printf("BMstack: resized to %uB\n", newlen);
 #endif
 
-    return stack == NULL ? E_MEM : SUCCESS;
+    return grown == NULL ? E_MEM : SUCCESS;
+}
+
+/* Replaces the chunk manifest of the opened book's path with the
+   book's own chunks. The manifest, named from the hash of the book's
+   path, describes the version of the file last opened from there; if
+   that version differs from this one its chunks are returned in old
+   (old->n is 0 otherwise). */
+static ErrCode
+swap_manifest(const struct Book *opened, struct Chunks *old)
+{
+    ErrCode  status;
+    char    *mname;
+    FILE    *mfh;
+
+    old->n     = 0;
+    old->chunk = NULL;
+
+    mname = fname_create(opened->phash, CHUNK_FEXT);
+    if (!mname)
+	return E_MEM;
+
+    mfh = fopen(mname, "r+");
+    if (mfh) {
+	status = chunks_load(mfh, old);
+	if (status == E_FFORMAT || (!status && old->fhash == opened->fhash))
+	    chunks_free(old);	/* nothing to carry over */
+	else if (status)
+	    goto err;
+    } else {			/* never opened from this path */
+	err_clear_errno();
+	mfh = fopen(mname, "w+");
+	if (!mfh) {
+	    status = E_IO;
+	    goto err;
+	}
+    }
+
+    status = chunks_save(&opened->chunks, mfh);
+
+ err:
+    fcloseifexists(&mfh);
+    free(mname);
+    return status;
+}
+
+/* Carries bookmarks over from an earlier version of a book, described
+   by its chunks in old, to the opened version described by new.
+
+   Each bookmark is moved to wherever its chunk is found in the new
+   file. Bookmarks in chunks that were edited are dropped. A page can
+   span several chunks, so an edit between two bookmarks changes the
+   page ending at the second too: 'stale' is set to the first bookmark
+   at or after the first edited chunk, or the first dropped if sooner,
+   so that bookmarks_relayout() lays pages out again from the last
+   bookmark before the edit. The old bookmark file is then deleted, as
+   it no longer describes any version of the book.                   */
+static ErrCode
+rebase_bmstack(const struct Chunks *old, const struct Chunks *new,
+	       struct Bookmarks *out)
+{
+    ErrCode          status;
+    struct Bookmarks prev;
+    size_t           i, stale;
+    long             pos, edit;
+
+    prev.stack = NULL;
+    prev.fname = fname_create(old->fhash, STACK_FEXT);
+    if (!prev.fname)
+	return E_MEM;
+    prev.fh = fopen(prev.fname, "r");
+    if (!prev.fh) {		/* no bookmarks to carry over */
+	err_clear_errno();
+	status = SUCCESS;
+	goto err;
+    }
+    prev.len   = STACK_INITIAL;
+    prev.stack = calloc(prev.len, sizeof *prev.stack);
+    if (!prev.stack) {
+	status = E_MEM;
+	goto err;
+    }
+    status = load_bmstack(&prev);
+    if (status)
+	goto err;
+
+    for (i=0, stale=prev.n; i<prev.n; ++i) {
+	pos = chunks_remap(old, new, prev.stack[i]);
+	if (pos == -1 || (out->n && pos <= out->stack[out->n-1])) {
+	    if (stale == prev.n)
+		stale = out->n;	/* edited: dropped */
+	    continue;
+	}
+	status = insert_bmstack(out, out->n, pos);
+	if (status)
+	    goto err;
+    }
+    edit = chunks_first_edit(old, new);
+    for (i=0; edit != -1 && i < out->n && out->stack[i] < edit; ++i)
+	;			/* pages ending before the edit are intact */
+    if (edit != -1 && i < stale)
+	stale = i;
+    out->stale = stale < out->n ? stale : out->n;
+
+#ifdef DEBUG
+    printf("BMstack: rebased %zu of %zu from %s, stale from %zu\n",
+	   out->n, prev.n, prev.fname, out->stale);
+#endif
+
+    fcloseifexists(&prev.fh);
+    remove(prev.fname);
+
+ err:
+    fcloseifexists(&prev.fh);
+    if (prev.stack)
+	free(prev.stack);
+    free(prev.fname);
+
+    return status;
+}
+
+/* Inserts a bookmark at index 'at', growing the stack if full */
+static ErrCode
+insert_bmstack(struct Bookmarks *addto, size_t at, long position)
+{
+    ErrCode status;
+
+    assert(at <= addto->n);
+
+    if (addto->n == addto->len) {
+	addto->len *= 2;
+	status = grow_bmstack(&addto->stack, addto->len);
+	if (status)
+	    return status;
+    }
+
+    memmove(addto->stack + at + 1, addto->stack + at,
+	    (addto->n - at) * sizeof *addto->stack);
+    addto->stack[at] = position;
+    ++addto->n;
+
+    return SUCCESS;
+}
+
+/* Removes the bookmark at index 'at' */
+static void
+erase_bmstack(struct Bookmarks *takefrom, size_t at)
+{
+    assert(at < takefrom->n);
+
+    memmove(takefrom->stack + at, takefrom->stack + at + 1,
+	    (takefrom->n - at - 1) * sizeof *takefrom->stack);
+    --takefrom->n;
 }
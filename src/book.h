@@ -2,7 +2,7 @@
    Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
    See COPYING for licence details. */
 
-/* book.h - decodes UTF-8 ebook text files */
+/* book.h - decodes UTF-8 ebook text files and EPUBs */
 
 #ifndef BOOK_H
 #define BOOK_H
@@ -16,11 +16,18 @@ void    book_close(struct Book *toclose);
 
 ErrCode book_get_codepoint(struct Book *toread, unicode *codepoint_out);
 ErrCode book_unget_codepoint(struct Book *towrite, unicode codepoint); 
+long    book_tell(const struct Book *toread);
+ErrCode book_seek(struct Book *toseek, long position);
 
 /* Bookmarking (saving position to disk) */
 ErrCode bookmarks_open(const struct Book *opened, struct Bookmarks *out);
 void    bookmarks_close(struct Bookmarks *toclose);
 
 ErrCode bookmarks_push(const struct Book *position, struct Bookmarks *addto);
+ErrCode bookmarks_pop(struct Bookmarks *takefrom, long *position);
+
+/* Repairs bookmarks invalidated by edits to the book */
+ErrCode bookmarks_relayout(struct Book *book, struct Bookmarks *pages,
+			   ErrCode (*measure)(void));
 
 #endif	/* BOOK_H */
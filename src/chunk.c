@@ -0,0 +1,304 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* chunk.c - content defined chunking of book files.
+
+   A book is split into variable length chunks whose boundaries are
+   chosen by the content itself: a gear rolling hash is updated with
+   every byte and a boundary is declared wherever the low bits of the
+   hash are zero. Because the hash only depends on the last 32 bytes
+   seen, editing a book only moves the boundaries next to the edit;
+   everywhere else the same chunks (and chunk hashes) are produced as
+   before, just at shifted file offsets.
+
+   Comparing the chunk lists of two versions of a file therefore
+   tells us which regions are unchanged and where they moved to,
+   which is all that is needed to carry bookmarks across an edit.
+
+   | Parameter | Bytes | Reason                                  |
+   |-----------+-------+-----------------------------------------|
+   | MIN       |   512 | roughly one page of western text        |
+   | AVG       |  2048 | (mask) a few pages per chunk            |
+   | MAX       |  8192 | bounds the damage of pathological input |  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "chunk.h"
+
+#define CHUNK_MIN         512
+#define CHUNK_MASK        0x000007FF /* log2(AVG) low bits zero */
+#define CHUNK_MAX         8192
+#define CHUNK_INITIAL     64	     /* initial length of chunk list */
+
+#define GEAR_SEED         0x6F6B7521 /* fixed: manifests outlive runs */
+#define FNV_OFFSET        0x811C9DC5
+#define FNV_PRIME         0x01000193
+
+static const uint32_t  *gear_table(void);
+static ErrCode          push_chunk(struct Chunks *out, size_t *len,
+				   long offset, uint32_t clen, uint32_t hash);
+static size_t           find_chunk(const struct Chunks *in, long position);
+
+/* Splits the file stream fh into content defined chunks, from the
+   start of the file to EOF. On SUCCESS the file position is set to
+   the beginning of the file, on error out is left empty.
+
+   Returns: SUCCESS    out populated (caller frees with chunks_free)
+            E_IO       file read error
+            E_MEM      malloc error                                  */
+ErrCode
+chunks_scan(FILE *fh, struct Chunks *out)
+{
+    ErrCode          status;
+    const uint32_t  *gear;
+    uint32_t         roll, hash, clen;
+    long             offset;
+    size_t           len;
+    int              ch;
+
+    assert_ptr(fh && out);
+
+    gear   = gear_table();
+    len    = CHUNK_INITIAL;
+    out->n = 0;
+    out->chunk = malloc(len * sizeof *out->chunk);
+    if (!out->chunk)
+	return E_MEM;
+
+    rewind(fh);
+    offset = 0;
+    clen   = 0;
+    roll   = 0;
+    hash   = FNV_OFFSET;
+    while ((ch=getc(fh)) != EOF) {
+	roll  = (roll << 1) + gear[ch];
+	hash  = (hash ^ ch) * FNV_PRIME;
+	++clen;
+
+	if ((clen >= CHUNK_MIN && !(roll & CHUNK_MASK)) || clen == CHUNK_MAX) {
+	    status = push_chunk(out, &len, offset, clen, hash);
+	    if (status)
+		goto err;
+	    offset += clen;
+	    clen    = 0;
+	    roll    = 0;
+	    hash    = FNV_OFFSET;
+	}
+    }
+    if (!feof(fh)) {
+	status = E_IO;
+	goto err;
+    }
+
+    if (clen) {			/* trailing partial chunk */
+	status = push_chunk(out, &len, offset, clen, hash);
+	if (status)
+	    goto err;
+    }
+
+#ifdef DEBUG
+    printf("Chunks: %zu chunks over %ldB\n", out->n, offset + (long)clen);
+#endif
+
+    rewind(fh);
+    return SUCCESS;
+ err:
+    chunks_free(out);
+    return status;
+}
+
+void
+chunks_free(struct Chunks *tofree)
+{
+    if (tofree->chunk)
+	free(tofree->chunk);
+    tofree->chunk = NULL;
+    tofree->n     = 0;
+}
+
+/* Saves a chunk list to the start of fh.
+
+   File format:    | fhash | n | chunks |      */
+ErrCode
+chunks_save(const struct Chunks *tosave, FILE *fh)
+{
+    rewind(fh);
+
+    if (fwrite(&tosave->fhash, sizeof tosave->fhash, 1, fh) != 1)
+	goto err;
+    if (fwrite(&tosave->n, sizeof tosave->n, 1, fh) != 1)
+	goto err;
+    if (fwrite(tosave->chunk, sizeof *tosave->chunk, tosave->n, fh) != tosave->n)
+	goto err;
+
+    return SUCCESS;
+ err:
+    return E_IO;
+}
+
+/* Reads a chunk list saved with chunks_save().
+
+   Returns: SUCCESS    out populated (caller frees with chunks_free)
+            E_FFORMAT  EOF reached unexpectedly or corrupt data
+            E_IO       file read error
+            E_MEM      malloc error                                  */
+ErrCode
+chunks_load(FILE *fh, struct Chunks *out)
+{
+    rewind(fh);
+    out->chunk = NULL;
+
+    if (fread(&out->fhash, sizeof out->fhash, 1, fh) != 1)
+	goto check_eof;
+    if (fread(&out->n, sizeof out->n, 1, fh) != 1)
+	goto check_eof;
+    if (out->n == 0)
+	return E_FFORMAT;
+
+    out->chunk = malloc(out->n * sizeof *out->chunk);
+    if (!out->chunk)
+	return E_MEM;
+    if (fread(out->chunk, sizeof *out->chunk, out->n, fh) != out->n)
+	goto check_eof;
+
+    return SUCCESS;
+ check_eof:
+    chunks_free(out);
+    return feof(fh) ? E_FFORMAT : E_IO;
+}
+
+/* Returns the position in file 'to' holding the same content as
+   'position' does in file 'from', or -1 if the chunk containing it
+   no longer exists (the position lies in an edited region).
+
+   Chunks are matched on hash and length. The candidate closest to
+   the chunk's old index is preferred, so repeated passages in a book
+   resolve to the copy that has moved the least.                     */
+long
+chunks_remap(const struct Chunks *from, const struct Chunks *to, long position)
+{
+    const struct Chunk *old, *new;
+    size_t              i, j, d;
+
+    assert_ptr(from && to);
+
+    if (!from->n || !to->n || position < 0)
+	return -1;
+
+    i   = find_chunk(from, position);
+    old = from->chunk + i;
+    if (position >= old->offset + (long)old->len)
+	return -1;		/* past end of old file */
+
+    /* search outwards from the new chunk at the same offset */
+    j = find_chunk(to, old->offset);
+    for (d=0; d<=j || j+d<to->n; ++d) {
+	if (j+d < to->n) {
+	    new = to->chunk + j + d;
+	    if (new->hash == old->hash && new->len == old->len)
+		return new->offset + (position - old->offset);
+	}
+	if (d && d <= j) {
+	    new = to->chunk + j - d;
+	    if (new->hash == old->hash && new->len == old->len)
+		return new->offset + (position - old->offset);
+	}
+    }
+
+    return -1;
+}
+
+/* Returns the offset of the first chunk that differs between two
+   versions of a file, or -1 if they hold the same chunks. Everything
+   before it is unchanged, so the offset is the same in both files.  */
+long
+chunks_first_edit(const struct Chunks *old, const struct Chunks *new)
+{
+    size_t i;
+
+    assert_ptr(old && new);
+
+    for (i=0; i<old->n && i<new->n; ++i)
+	if (old->chunk[i].hash != new->chunk[i].hash
+	    || old->chunk[i].len != new->chunk[i].len)
+	    return new->chunk[i].offset;
+
+    if (i < old->n)		/* text removed from the end */
+	return old->chunk[i].offset;
+    if (i < new->n)		/* text added to the end */
+	return new->chunk[i].offset;
+
+    return -1;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Gear rolling hash table: one pseudo random word per byte value,
+   generated from a fixed seed so boundaries are stable between runs
+   and builds. */
+static const uint32_t *
+gear_table(void)
+{
+    static uint32_t gear[256];
+    static int      done;
+    uint32_t        x;
+    int             i;
+
+    if (done)
+	return gear;
+
+    for (i=0, x=GEAR_SEED; i<256; ++i) {
+	x ^= x << 13;		/* xorshift32 */
+	x ^= x >> 17;
+	x ^= x << 5;
+	gear[i] = x;
+    }
+    done = 1;
+
+    return gear;
+}
+
+/* Appends a chunk to the list, growing it if full */
+static ErrCode
+push_chunk(struct Chunks *out, size_t *len, long offset, uint32_t clen, uint32_t hash)
+{
+    struct Chunk *grown;
+
+    if (out->n == *len) {
+	grown = realloc(out->chunk, 2 * *len * sizeof *out->chunk);
+	if (!grown)
+	    return E_MEM;
+	out->chunk = grown;
+	*len *= 2;
+    }
+
+    out->chunk[out->n].offset = offset;
+    out->chunk[out->n].len    = clen;
+    out->chunk[out->n].hash   = hash;
+    ++out->n;
+
+    return SUCCESS;
+}
+
+/* Binary search for the last chunk starting at or before position */
+static size_t
+find_chunk(const struct Chunks *in, long position)
+{
+    size_t lo = 0, hi = in->n;
+
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (in->chunk[mid].offset <= position)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
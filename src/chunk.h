@@ -0,0 +1,28 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* chunk.h - content defined chunking of book files */
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdio.h>
+
+#include "err.h"
+#include "oku.h"
+
+/* Splitting a file into chunks */
+ErrCode chunks_scan(FILE *fh, struct Chunks *out);
+void    chunks_free(struct Chunks *tofree);
+
+/* Chunk manifest (saving chunk lists to disk) */
+ErrCode chunks_save(const struct Chunks *tosave, FILE *fh);
+ErrCode chunks_load(FILE *fh, struct Chunks *out);
+
+/* Translates a file position between two versions of a file */
+long    chunks_remap(const struct Chunks *from, const struct Chunks *to,
+		     long position);
+long    chunks_first_edit(const struct Chunks *old, const struct Chunks *new);
+
+#endif	/* CHUNK_H */
@@ -0,0 +1,323 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* display.c - refreshes the epd on its own thread.
+
+   A refresh keeps the panel busy for around a second. Rather than
+   block the reader for it, finished pages are copied into a queue
+   and a display thread puts them on the panel, while the main
+   thread goes back to reading keys, saving bookmarks and laying out
+   the next page.
+
+   The queue is a ring of NQUEUE framebuffers with one producer, the
+   main thread, and one consumer, the display thread, so it needs no
+   lock: each side only writes its own index, head or tail, and
+   publishes it with release ordering after it is done with the
+   buffer the index hands over. An eventfd doorbell wakes the display
+   thread when a frame is queued, another, the fence, is signalled
+   each time a refresh finishes and can be poll()ed with stdin.
+
+   Only the newest frame queued is ever shown: older ones have been
+   turned past already. A frame queued while one is being sent
+   cancels it (see epd_refresh_frame()).
+
+   Once the panel has shown a frame and nothing new is queued for
+   idle_ms, the display thread puts the controller in deep sleep. The
+   next frame wakes it (see epd_sleep()).
+
+   | Ring index     | Meaning                        | Written by     |
+   |----------------+--------------------------------+----------------|
+   | tail .. head-1 | queued or being shown          | display thread |
+   | head .. tail-1 | free, next frame goes at head  | main thread    | */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "display.h"
+#include "epd.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define NQUEUE            4	/* frames in flight, a power of 2 */
+
+struct Display {
+    pthread_t         thread;
+    int               running;
+    atomic_int        quit;
+    atomic_int        status;	/* first error on the display thread */
+
+    atomic_uint       head;	/* next frame to fill */
+    atomic_uint       tail;	/* oldest frame not yet shown */
+    byte             *frame[NQUEUE];
+    unsigned          showing;	/* frame being refreshed */
+
+    int               doorbell;	/* eventfd: frames queued */
+    int               fence;	/* eventfd: refreshes finished */
+    int               idle_ms;	/* quiet time before deep sleep, 0 never */
+};
+
+static struct Display disp = { .doorbell = -1, .fence = -1 };
+
+static void    *worker(void *arg);
+static int      superseded(void);
+static void     fail(ErrCode status);
+static ErrCode  wait_fence(void);
+static int      wait_doorbell(int timeout_ms);
+
+/* Allocates the queue and starts the display thread. The epd must
+   already be started; from here on only the display thread talks to
+   it until display_stop(). The epd is put to sleep after idle_ms
+   without a new frame, never if it is 0. */
+ErrCode
+display_start(unsigned idle_ms)
+{
+    sigset_t all, old;
+    int      i, res;
+
+    if (disp.running)
+	return E_INIT;
+
+    for (i=0; i<NQUEUE; ++i) {
+	disp.frame[i] = epd_buffer_new();
+	if (!disp.frame[i])
+	    return E_MEM;
+    }
+    atomic_store(&disp.head, 0);
+    atomic_store(&disp.tail, 0);
+    atomic_store(&disp.status, SUCCESS);
+    atomic_store(&disp.quit, 0);
+    disp.idle_ms = idle_ms;
+
+    disp.doorbell = eventfd(0, EFD_CLOEXEC);
+    disp.fence    = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (disp.doorbell == -1 || disp.fence == -1)
+	return E_INIT;
+
+    /* signals are left to the main thread's blocking read */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&disp.thread, NULL, worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res)
+	return E_INIT;
+    disp.running = 1;
+
+    return SUCCESS;
+}
+
+/* Stops the display thread, abandoning a refresh not yet under way,
+   and releases the queue */
+void
+display_stop(void)
+{
+    uint64_t one = 1;
+    int      i;
+
+    if (disp.running) {
+	atomic_store(&disp.quit, 1);
+	if (write(disp.doorbell, &one, sizeof one) != sizeof one)
+	    err_print(E_IO);
+	pthread_join(disp.thread, NULL);
+	disp.running = 0;
+    }
+
+    for (i=0; i<NQUEUE; ++i) {
+	free(disp.frame[i]);
+	disp.frame[i] = NULL;
+    }
+    if (disp.doorbell != -1)
+	close(disp.doorbell);
+    if (disp.fence != -1)
+	close(disp.fence);
+    disp.doorbell = disp.fence = -1;
+}
+
+/* Copies fb into the queue for the display thread. Only waits if
+   every frame in the queue is taken, i.e. NQUEUE pages have been
+   turned during one refresh. */
+ErrCode
+display_submit(const byte *fb)
+{
+    ErrCode  status;
+    uint64_t one = 1;
+    unsigned head;
+
+    if (!disp.running)
+	return E_INIT;
+
+    head = atomic_load_explicit(&disp.head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&disp.tail, memory_order_acquire)
+	   == NQUEUE) {
+	status = wait_fence();
+	if (status)
+	    return status;
+    }
+
+    memcpy(disp.frame[head % NQUEUE], fb, epd_buffer_len());
+    atomic_store_explicit(&disp.head, head + 1, memory_order_release);
+
+    return write(disp.doorbell, &one, sizeof one) == sizeof one
+	? SUCCESS : E_IO;
+}
+
+int
+display_fence(void)
+{
+    return disp.fence;
+}
+
+/* Resets the fence after it was seen readable. Errors from the
+   display thread are reported here, the first one sticks. */
+ErrCode
+display_collect(void)
+{
+    uint64_t n;
+
+    if (read(disp.fence, &n, sizeof n) < 0 && errno != EAGAIN)
+	return E_IO;
+
+    return atomic_load(&disp.status);
+}
+
+/* Waits until the newest frame submitted is on screen */
+ErrCode
+display_sync(void)
+{
+    ErrCode status;
+
+    while (disp.running
+	   && atomic_load_explicit(&disp.tail, memory_order_acquire)
+	   != atomic_load_explicit(&disp.head, memory_order_relaxed)) {
+	status = wait_fence();
+	if (status)
+	    return status;
+    }
+
+    return atomic_load(&disp.status);
+}
+
+/* STATIC FUNCTIONS */
+
+static void *
+worker(void *arg)
+{
+    ErrCode  status;
+    uint64_t n;
+    unsigned head;
+    int      rung, awake = 1;	/* epd_start() powered the epd */
+    double   t0;
+
+    (void)arg;
+    TRACE_THREAD("display");
+
+    while (!atomic_load(&disp.quit)) {
+	head = atomic_load_explicit(&disp.head, memory_order_acquire);
+	if (head == atomic_load_explicit(&disp.tail, memory_order_relaxed)) {
+	    rung = wait_doorbell(awake && disp.idle_ms ? disp.idle_ms : -1);
+	    if (rung < 0)
+		break;
+	    if (!rung) {	/* idle */
+		status = epd_sleep();
+		if (status)
+		    fail(status);
+		awake = 0;
+	    }
+	    continue;
+	}
+
+	/* frames before the newest are released unseen */
+	disp.showing = head - 1;
+	atomic_store_explicit(&disp.tail, disp.showing, memory_order_release);
+
+	t0 = metrics_ms();
+	status = epd_refresh_frame(disp.frame[disp.showing % NQUEUE],
+				   superseded);
+#ifdef DEBUG
+	printf("Display: frame %u status %d\n", disp.showing, status);
+#endif
+	if (status == E_CANCELLED) {
+	    metrics_add(METRIC_REFRESHES_CANCELLED, 1);
+	    continue;		/* a newer frame is waiting */
+	}
+
+	if (status) {
+	    fail(status);
+	} else {
+	    metrics_add(METRIC_REFRESHES, 1);
+	    metrics_observe(METRIC_REFRESH_MS, metrics_ms() - t0);
+	}
+	awake = 1;
+	atomic_store_explicit(&disp.tail, head, memory_order_release);
+
+	n = 1;
+	if (write(disp.fence, &n, sizeof n) != sizeof n)
+	    fail(E_IO);
+    }
+
+    return NULL;
+}
+
+/* Non zero once the frame being shown is out of date */
+static int
+superseded(void)
+{
+    return atomic_load(&disp.quit)
+	|| atomic_load_explicit(&disp.head, memory_order_acquire)
+	!= disp.showing + 1;
+}
+
+/* Keeps the first error for display_collect() */
+static void
+fail(ErrCode status)
+{
+    int ok = SUCCESS;
+
+    atomic_compare_exchange_strong(&disp.status, &ok, status);
+}
+
+/* Sleeps until a refresh finishes */
+static ErrCode
+wait_fence(void)
+{
+    struct pollfd fence = { .fd = disp.fence, .events = POLLIN };
+    uint64_t      n;
+
+    if (poll(&fence, 1, -1) < 0 && errno != EINTR)
+	return E_IO;
+    if (read(disp.fence, &n, sizeof n) < 0 && errno != EAGAIN)
+	return E_IO;
+
+    return atomic_load(&disp.status);
+}
+
+/* Waits up to timeout_ms, or for ever if -ve, for a frame to be
+   queued. Returns 1 if the doorbell rang, 0 on timeout, -1 on error. */
+static int
+wait_doorbell(int timeout_ms)
+{
+    struct pollfd bell = { .fd = disp.doorbell, .events = POLLIN };
+    uint64_t      n;
+    int           res;
+
+    res = poll(&bell, 1, timeout_ms);
+    if (res < 0)
+	return errno == EINTR ? 1 : -1;
+    if (!res)
+	return 0;
+    if (read(disp.doorbell, &n, sizeof n) < 0 && errno != EINTR)
+	return -1;
+
+    return 1;
+}
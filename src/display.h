@@ -0,0 +1,27 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* display.h - refreshes the epd on its own thread */
+
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include "err.h"
+#include "oku.h"
+
+/* Starts the display thread, the epd sleeps after idle_ms, 0 never */
+ErrCode display_start(unsigned idle_ms);
+void    display_stop(void);
+
+/* Queues a copy of framebuffer fb to be shown, returns at once */
+ErrCode display_submit(const byte *fb);
+
+/* eventfd readable when a refresh has finished, for poll() */
+int     display_fence(void);
+/* Clears the fence, returns the display thread's first error */
+ErrCode display_collect(void);
+/* Waits until every frame submitted is on screen */
+ErrCode display_sync(void);
+
+#endif	/* DISPLAY_H */
@@ -3,7 +3,7 @@
    See COPYING for licence details. */
 
 /* epd.c - EPD userspace driver: 3-wire spi communication
-   implementation specific to Waveshare 2.9" Module with HAT. */
+   implementation for the Waveshare modules with HAT in panel.h. */
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -18,13 +18,16 @@
 #include "err.h"
 
 #include "epd.h"
+#include "panel.h"
+#include "framebuffer.h"
+#include "blit.h"
+#include "rotate.h"
+#include "trace.h"
+
+/* Device dimensions in pixels, WIDTH and HEIGHT, are set for the
+   panel built for in panel.h. The pitch is horizontal i.e one byte
+   represents 8 packed pixels across the width. */
 
-/* Device dimensions in pixels. The pitch for this device is
-   horizontal i.e one byte represents 8 packed pixels across the
-   width. */
-#define WIDTH		128	
-#define HEIGHT		296
-	
 /* Helper macros for converting between the two dimensional (X,Y)
    coordinates used by the interface, and the one dimensional byte
    arrays packed to 8 bits (IDX) used in the framebuffer.
@@ -61,11 +64,16 @@
 #define SPI_MODE          (0|0)	           /* CPOL=0, CPHA=0 */
 #define SPI_CLKSPEED_MHZ  10	           /* 10 MHz */
 #define LUT_LEN           30		   /* bytes in lut register */
+#define LUT_SEQ_LEN       (2+LUT_LEN)	   /* with its command and length */
+#define BAND_ROWS         ((HEIGHT+3)/4)   /* rows per transfer */
+#define BAND_GAP          4		   /* clean rows cheaper to send than
+					      a new RAM window */
+#define FRONT             ((bank+RAM_BANKS-1) % RAM_BANKS) /* bank last shown */
 
 /* Timings */
-#define BUSY_DELAY        100 	           /* busy read sample delay (ms) */
-#define GPIO_DELAY        200 	           /* sample delay time (ms) */
-#define REFRESH_DELAY     500		   /* wait after refreshing display */
+#define BUSY_SETTLE       1		   /* ms for busy to rise after a command */
+#define BUSY_TIMEOUT      30000		   /* longest busy period (ms) */
+#define RESET_PULSE       1		   /* reset low (ms), at least 10us */
 
 /* Pin numbers use BCM2835 numbering not pi physical numbers. DIN
    (MOSI) and CLK are not enumerated as they are not manually
@@ -89,9 +97,6 @@ enum BCM_PIN
 	BCM_PIN_Busy        = 24  /* epd->pi: Low when busy */
     };
 
-/* Representation of pixel colour for this device */
-enum {BLACK = 0x00 , WHITE = 0xFF};
-
 /* EPD command bytes */
 enum COMMAND
     { DRIVER_OUTPUT_CONTROL                  = 0x01,
@@ -100,6 +105,7 @@ enum COMMAND
       DEEP_SLEEP_MODE                        = 0x10,
       DATA_ENTRY_MODE_SETTING                = 0x11,
       SW_RESET                               = 0x12,
+      TEMPERATURE_SENSOR_SELECTION           = 0x18,
       TEMPERATURE_SENSOR_CONTROL             = 0x1A,
       MASTER_ACTIVATION                      = 0x20,
       DISPLAY_UPDATE_CONTROL_1               = 0x21,
@@ -116,37 +122,122 @@ enum COMMAND
       SET_RAM_Y_ADDRESS_COUNTER              = 0x4F,
       TERMINATE_FRAME_READ_WRITE             = 0xFF  };
 
-/* Data corresponding to command bytes enumeration */
-const byte driver_output_control[] =      { (HEIGHT-1) &0xFF, ((HEIGHT-1)>>8) &0xFF, 0}; /* GD=0, SM=0, TB=0 */
-const byte booster_soft_start_control[] = { 0xD7, 0xD6, 0x9D };
-const byte write_vcom_register[] =        { 0xA8 }; /* Vcom=7C */
-const byte set_dummy_line_period[] =      { 0x1A }; /* 4 lines/gate */
-const byte set_gate_time[] =              { 0x08 }; /* 2us/line */
-const byte border_waveform_control[] =    { 0x03 };
-const byte data_entry_mode_setting[] =    { 0x03 };
-const byte write_lut_register[] =         { 0x32 };
-const byte display_update_control_2[] =   { 0xC4 };
-const byte deep_sleep_mode[] =            { 0x01 };
+/* Command tables: each command byte is followed by the number of
+   data bytes and the data, see transmit_sequence() */
+#if PANEL == PANEL_2IN9
+const byte init_sequence[] = {
+    DRIVER_OUTPUT_CONTROL,      3, (HEIGHT-1) &0xFF, ((HEIGHT-1)>>8) &0xFF, 0, /* GD=0, SM=0, TB=0 */
+    BOOSTER_SOFT_START_CONTROL, 3, 0xD7, 0xD6, 0x9D,
+    WRITE_VCOM_REGISTER,        1, 0xA8, /* Vcom=7C */
+    SET_DUMMY_LINE_PERIOD,      1, 0x1A, /* 4 lines/gate */
+    SET_GATE_TIME,              1, 0x08, /* 2us/line */
+    BORDER_WAVEFORM_CONTROL,    1, 0x03,
+    DATA_ENTRY_MODE_SETTING,    1, 0x03  /* x then y increment */
+};
+const byte refresh_sequence[] = {
+    DISPLAY_UPDATE_CONTROL_2,   1, 0xC4, /* clock, analog, pattern */
+    MASTER_ACTIVATION,          0,
+    TERMINATE_FRAME_READ_WRITE, 0
+};
 
 /* look up table registers */
-const byte lut_full_update[LUT_LEN] = {
+const byte lut_full_update[LUT_SEQ_LEN] = {
+    WRITE_LUT_REGISTER, LUT_LEN,
     0x50, 0xAA, 0x55, 0xAA, 0x11, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0xFF, 0xFF, 0x1F, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
-const byte lut_partial_update[LUT_LEN] = {
+const byte lut_partial_update[LUT_SEQ_LEN] = {
+    WRITE_LUT_REGISTER, LUT_LEN,
     0x10, 0x18, 0x18, 0x08, 0x18, 0x18,
     0x08, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x13, 0x14, 0x44, 0x12,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
+#define LUT_FULL          lut_full_update
+#define LUT_PARTIAL       lut_partial_update
+#define SOFT_RESET        0
+
+#elif PANEL == PANEL_4IN2
+const byte init_sequence[] = {
+    DISPLAY_UPDATE_CONTROL_1,   2, 0x40, 0x00, /* old RAM bypassed */
+    BORDER_WAVEFORM_CONTROL,    1, 0x05,
+    DATA_ENTRY_MODE_SETTING,    1, 0x03  /* x then y increment */
+};
 
-byte *fbuf;			/* screen buffer */
+#elif PANEL == PANEL_7IN5
+const byte init_sequence[] = {
+    BOOSTER_SOFT_START_CONTROL, 5, 0xAE, 0xC7, 0xC3, 0xC0, 0x40,
+    DRIVER_OUTPUT_CONTROL,      3, (HEIGHT-1) &0xFF, ((HEIGHT-1)>>8) &0xFF, 0,
+    BORDER_WAVEFORM_CONTROL,    1, 0x01,
+    TEMPERATURE_SENSOR_SELECTION, 1, 0x80, /* internal sensor */
+    DATA_ENTRY_MODE_SETTING,    1, 0x03  /* x then y increment */
+};
+#endif
+
+#if OTP_WAVEFORM
+/* waveform for the measured temperature loaded from OTP each time */
+const byte refresh_sequence[] = {
+    DISPLAY_UPDATE_CONTROL_2,   1, 0xF7, /* temperature, LUT, display */
+    MASTER_ACTIVATION,          0
+};
+#define LUT_FULL          NULL
+#define LUT_PARTIAL       NULL	/* OTP partial mode not supported */
+#define SOFT_RESET        1
+#endif
+
+const byte sleep_sequence[] = {
+    DEEP_SLEEP_MODE,            1, 0x01
+};
+
+const struct Panel panel = {
+    .name        = PANEL_NAME,
+    .size        = { WIDTH, HEIGHT },
+    .ram_x_px    = RAM_X_PX,
+    .soft_reset  = SOFT_RESET,
+    .init        = init_sequence,
+    .init_len    = sizeof init_sequence,
+    .refresh     = refresh_sequence,
+    .refresh_len = sizeof refresh_sequence,
+    .lut_full    = LUT_FULL,
+    .lut_partial = LUT_PARTIAL
+};
+
+byte *tbuf;			/* landscape frame turned to panel layout */
 int epdon;			/* non zero when device is powered  */
 
+/* Refresh scheduling. Partial refreshes are quick but leave ghosts
+   of earlier pages, cleared by the next full refresh. */
+struct RefreshPolicy policy;	/* zero: full refreshes only */
+const byte *lut;		/* waveform loaded in the epd */
+byte *shadow[RAM_BANKS];	/* copy of each of the epd's RAM banks,
+				   panel layout */
+int shadow_valid[RAM_BANKS];	/* shadow matches the bank */
+unsigned bank;			/* bank written to, see panel.h */
+byte *shown;			/* frame last refreshed, panel layout; the
+				   RAM may hold a cancelled one since */
+int shown_valid;		/* shown is on the panel */
+unsigned partials;		/* partial refreshes since last full */
+unsigned long changed;		/* pixels changed since last full */
+struct EpdStats stats;		/* framebuffer bytes sent and saved */
+
+/* Power. The panel keeps its image unpowered, so an idle controller
+   can be put in deep sleep (epd_sleep()) and woken by the next
+   refresh. The shadow survives the sleep, so waking costs a reset,
+   the init table and one write of the RAM, not a full refresh. With
+   two banks which is written next is lost, so both are sent whole. */
+struct timespec since;		/* last change of power state */
+
+/* CS and DC change together, so are reserved as one bulk request
+   and set in one call. Levels are in the order of spi_lines. */
+const unsigned spi_lines[] = { BCM_PIN_ChipSelect, BCM_PIN_DataCommand };
+const enum GPIO_LEVEL deselect[]       = { GPIO_LEVEL_High, GPIO_LEVEL_High };
+const enum GPIO_LEVEL select_command[] = { GPIO_LEVEL_Low,  GPIO_LEVEL_Low  };
+const enum GPIO_LEVEL select_data[]    = { GPIO_LEVEL_Low,  GPIO_LEVEL_High };
+
 /* FORWARD DECLARATIONS */
 static ErrCode init_gpio(void);
 static ErrCode init_spi(void);
@@ -157,13 +248,24 @@ static ErrCode dev_set_ram_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_
 static ErrCode dev_set_ram_cursor(uint16_t x, uint16_t y);
 static ErrCode dev_wait_while_busy(void);
 static ErrCode dev_poweroff(void);
+static ErrCode dev_wake(void);
+static ErrCode dev_restore_ram(void);
+static void    dev_forget_ram(void);
 
 static ErrCode transmit_command(const byte tx);
 static ErrCode transmit_data(const byte *tx, size_t len);
 static ErrCode transmit_lut(const byte *lut);
-static ErrCode transmit_framebuffer(void);
+static ErrCode transmit_sequence(const byte *seq, size_t len);
+static ErrCode transmit_framebuffer(const byte *tx, int (*pending)(void));
+static ErrCode transmit_band(const byte *tx, const struct Band *band);
+static int     next_band(const byte *tx, coordinate from, struct Band *band);
+static int     row_dirty(const byte *a, const byte *b);
+
+static unsigned long count_changed(const byte *a, const byte *b);
+static int           schedule_full(unsigned long diff);
 
-static ErrCode delay(unsigned ms);
+static ErrCode       delay(unsigned ms);
+static unsigned long elapsed_us(struct timespec *from);
 
 /* INTERFACE IMPLEMENTATION */
 
@@ -172,6 +274,7 @@ ErrCode
 epd_start(struct Point *px_out)
 {
     ErrCode status;
+    int     i;
 
     status = init_gpio();
     if (status)
@@ -186,15 +289,30 @@ epd_start(struct Point *px_out)
     status = dev_init();
     if (status)
 	goto err;
-    status = transmit_lut(lut_full_update);
-    if (status)
-	goto err;
+    if (panel.lut_full) {
+	status = transmit_lut(panel.lut_full);
+	if (status)
+	    goto err;
+    }
 
-    fbuf = calloc(LEN(WIDTH, HEIGHT), sizeof *fbuf);
-    if (!fbuf) {
+    fbuf  = epd_buffer_new();
+    shown = epd_buffer_new();
+    if (!fbuf || !shown) {
 	status = E_MEM;
 	goto err;
     }
+    for (i=0; i<RAM_BANKS; ++i)
+	if (!(shadow[i] = epd_buffer_new())) {
+	    status = E_MEM;
+	    goto err;
+	}
+    dev_forget_ram();		/* panel content unknown */
+    shown_valid = 0;
+    clock_gettime(CLOCK_MONOTONIC, &since);
+
+#ifdef DEBUG
+    printf("EPD: %s %dx%d\n", panel.name, panel.size.x, panel.size.y);
+#endif
 
     px_out->x = WIDTH;
     px_out->y = HEIGHT;
@@ -203,94 +321,164 @@ epd_start(struct Point *px_out)
     return status;
 }
 
-/* Sets every bit in framebuffer to the defined value of WHITE. Does
-   not transmit any data to epd. */
+/* As epd_refresh_cancellable(), but shows frame, a buffer from
+   epd_buffer_new(), rather than the screen buffer. Lets a display
+   thread refresh the panel from its own copy of a page while the
+   screen buffer is drawn on. */
 ErrCode
-epd_clear(void)
+epd_refresh_frame(const byte *frame, int (*pending)(void))
 {
-    assert(fbuf && "Dereferenced null pointer");
-
-    for (int i=0; i<LEN(WIDTH,HEIGHT); ++i)
-	fbuf[i] = WHITE;
-	
-    return SUCCESS;
-}
-
-/* Copies a bitmap into the framebuffer starting at origin. Must be
-   byte aligned. */
-ErrCode
-epd_write(const struct Raster *img, struct Point origin)
-{
-    coordinate y;		/* a row in dest */
-    byte *src, *dest;		/* cursors */
-
-    assert(img && img->bitmap && "Dereferenced null pointer");
+    static const struct Point sideways = { HEIGHT, WIDTH };
+    ErrCode       status;
+    const byte   *tx;
+    const byte   *want;
+    unsigned long diff;
+    int           full;
+
+    assert(frame && shadow[0] && "Display not started");
+
+    TRACE_BEGIN(TRACE_REFRESH);
+    if (!epdon) {
+	status = dev_wake();
+	if (status)
+	    goto err;
+    }
 
-    src  = img->bitmap;
-    dest = fbuf + XYCOORD_TO_IDX(WIDTH, origin.x, origin.y);
+    tx = frame;
+    if (landscape) {
+	if (!tbuf && !(tbuf = epd_buffer_new())) {
+	    status = E_MEM;
+	    goto err;
+	}
+	status = rotate_cw(frame, sideways, tbuf);
+	if (status)
+	    goto err;
+	tx = tbuf;
+    }
 
-    for (y=0; y<img->size.y; ++y) {
-	memcpy(dest, src, PITCH(img->size.x));
+    diff = shown_valid ? count_changed(shown, tx) : (unsigned long)WIDTH*HEIGHT;
+    full = schedule_full(diff);
+    want = full ? panel.lut_full : panel.lut_partial;
+    if (want && lut != want) {
+	status = transmit_lut(want);
+	if (status)
+	    goto err;
+    }
 
 #ifdef DEBUG
-	printf("Framebuffer: src(%03d,%03d)[%03d]->dest(%03d,%03d)[%03d]\n",
-	       IDX_TO_XCOORD(OFFSET(img->bitmap, src), img->size.x),
-	       IDX_TO_YCOORD(OFFSET(img->bitmap, src), img->size.y),
-	       OFFSET(img->bitmap, src),
-	       IDX_TO_XCOORD(OFFSET(fbuf, dest), WIDTH),
-	       IDX_TO_YCOORD(OFFSET(fbuf, dest), WIDTH),
-	       OFFSET(fbuf, dest)
-	       );
+    printf("Refresh: %s, %lu px changed, %lu since full, %u partials\n",
+	   full ? "full" : "partial", diff, changed, partials);
 #endif
-	src  += PITCH(img->size.x);
-	dest += PITCH(WIDTH);
+
+    status = transmit_framebuffer(tx, pending);
+    if (status)
+	goto err;
+    if (pending && pending()) {
+	status = E_CANCELLED;
+	goto err;
     }
+    status = transmit_sequence(panel.refresh, panel.refresh_len);
+    if (status) {
+	dev_forget_ram();	/* banks may have swapped */
+	shown_valid = 0;
+	goto err;
+    }
+    bank = (bank+1) % RAM_BANKS;
+    memcpy(shown, tx, LEN(WIDTH, HEIGHT));
+    shown_valid = 1;
 
-    return SUCCESS; 
+    status = dev_wait_while_busy();	/* until the panel is idle */
+    if (status)
+	goto err;
+
+    ++stats.refreshes;
+    partials     = full ? 0 : partials+1;
+    changed      = full ? 0 : changed+diff;
+
+ err:
+    TRACE_END_N(TRACE_REFRESH, status);
+    return status;
 }
 
+/* Sets when partial refreshes may be used, see struct RefreshPolicy.
+   A zero partials count means full refreshes only. */
+void
+epd_refresh_policy(const struct RefreshPolicy *newpolicy)
+{
+    policy = *newpolicy;
+}
+
+/* Puts the controller in deep sleep, where it draws next to nothing
+   and the image stays on the panel. The next refresh wakes it. Does
+   nothing if it is already asleep. */
 ErrCode
-epd_refresh(void)
+epd_sleep(void)
 {
     ErrCode status;
 
-    assert(fbuf && "Frame buffer not initialised");
+    if (!epdon)
+	return SUCCESS;
 
-    status = transmit_framebuffer();
-    if (status)
-	goto err;
-    status = transmit_command(DISPLAY_UPDATE_CONTROL_2);
-    if (status)
-	goto err;
-    status = transmit_data(display_update_control_2, sizeof display_update_control_2);
-    if (status)
-	goto err;
-    status = transmit_command(MASTER_ACTIVATION);
-    if (status)
-	goto err;
-    status = transmit_command(TERMINATE_FRAME_READ_WRITE);
+    status = dev_poweroff();
     if (status)
-	goto err;
+	return status;
+    lut = NULL;			/* registers are lost */
+    ++stats.sleeps;
+    stats.awake_ms += elapsed_us(&since) / 1000;
 
-    status = dev_wait_while_busy();
+#ifdef DEBUG
+    printf("EPD: asleep\n");
+#endif
 
-    /* After device leaves busy, screen will be refreshed and device
-       idle after 500s */
-    delay(REFRESH_DELAY); 		
+    return SUCCESS;
+}
 
- err:
-    return status;
+/* Copies the framebuffer transfer and power statistics since
+   epd_start(), counting the time in the present power state */
+void
+epd_stats(struct EpdStats *out)
+{
+    struct timespec now = since;
+
+    *out = stats;
+    if (shadow[0]) {
+	if (epdon)
+	    out->awake_ms  += elapsed_us(&now) / 1000;
+	else
+	    out->asleep_ms += elapsed_us(&now) / 1000;
+    }
 }
 
 ErrCode
 epd_stop(void)
 {
     ErrCode status = SUCCESS;
+    int     i;
 
+    epd_stats(&stats);		/* counts the time in the last state */
     if (epdon)
 	status = dev_poweroff();
     if (fbuf)
 	free(fbuf);
+    free(tbuf);
+    free(shown);
+    tbuf = shown = NULL;
+    shown_valid = 0;
+    for (i=0; i<RAM_BANKS; ++i) {
+	free(shadow[i]);
+	shadow[i] = NULL;
+    }
+    dev_forget_ram();
+
+#ifdef DEBUG
+    printf("EPD: %lu refreshes sent %luB in %lu windows, saved %luB\n",
+	   stats.refreshes, stats.sent, stats.bands, stats.saved);
+    printf("EPD: %lu sleeps, %lu wakes %.1fms on average %.1fms at most, "
+	   "awake %lus asleep %lus\n", stats.sleeps, stats.wakes,
+	   stats.wakes ? stats.wake_us / 1000.0 / stats.wakes : 0.0,
+	   stats.wake_max_us / 1000.0, stats.awake_ms / 1000,
+	   stats.asleep_ms / 1000);
+#endif
     GPIO_stop();
     SPI_stop();
 
@@ -310,24 +498,23 @@ init_gpio(void)
     if (status)
 	goto err; 
 
-    status = GPIO_reserve_input(BCM_PIN_Busy);
+    status = GPIO_reserve_input_falling(BCM_PIN_Busy);
     if (status)
 	goto err;
-    status = GPIO_reserve_output(BCM_PIN_ChipSelect, GPIO_LEVEL_High);
+    status = GPIO_reserve_output_bulk(spi_lines, deselect,
+				      sizeof spi_lines / sizeof *spi_lines);
     if (status)
 	goto err;
     status = GPIO_reserve_output(BCM_PIN_Reset, GPIO_LEVEL_High);
-    if (status)
-	goto err;
-    status = GPIO_reserve_output(BCM_PIN_DataCommand, GPIO_LEVEL_High);
     if (status)
 	goto err;
     
     /* there is a problem with cs changing itself, maybe setting
        manually here will help. */
-    status = GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_High);
+    status = GPIO_write_default(BCM_PIN_ChipSelect);
     if (status)
 	goto err;
+    GPIO_dump();
 
  err:
     return status;
@@ -350,84 +537,36 @@ dev_reset(void)
     if (status) 
 	goto err;
 
-    status = delay(GPIO_DELAY);
-    if (status) 
-	goto err;
-    
-    status = GPIO_write(BCM_PIN_Reset, GPIO_LEVEL_Low);
-    if (status) 
-	goto err;
-
-    status = delay(GPIO_DELAY);
-    if (status) 
-	goto err;
+    status = delay(RESET_PULSE);
 
  err:
     status_cleanup = GPIO_write_default(BCM_PIN_Reset);
+    if (!status)
+	status = status_cleanup;
+    if (!status)
+	status = dev_wait_while_busy(); /* ready once busy falls */
 
-    status = delay(GPIO_DELAY);
-    if (status) 
-	goto err;
-
-    return status ? status : status_cleanup;
+    return status;
 }
 
 /* Send initialisation sequence to epd */
 static ErrCode
 dev_init(void)
 {
+    static const byte soft_reset[] = { SW_RESET, 0 };
     ErrCode status;
 
     epdon = 1;
 
-    status = transmit_command(DRIVER_OUTPUT_CONTROL);
-    if (status)
-	goto err;
-    status = transmit_data(driver_output_control, sizeof driver_output_control);
-    if (status)
-	goto err;
-
-    status = transmit_command(BOOSTER_SOFT_START_CONTROL);
-    if (status)
-	goto err;
-    status = transmit_data(booster_soft_start_control, sizeof booster_soft_start_control);
-    if (status)
-	goto err;
-
-    status = transmit_command(WRITE_VCOM_REGISTER);
-    if (status)
-	goto err;
-    status = transmit_data(write_vcom_register, sizeof write_vcom_register);
-    if (status)
-	goto err;
-
-    status = transmit_command(SET_DUMMY_LINE_PERIOD);
-    if (status)
-	goto err;
-    status = transmit_data(set_dummy_line_period, sizeof set_dummy_line_period);
-    if (status)
-	goto err;
-
-    status = transmit_command(SET_GATE_TIME);
-    if (status)
-	goto err;
-    status = transmit_data(set_gate_time, sizeof set_gate_time);
-    if (status)
-	goto err;
-
-    status = transmit_command(BORDER_WAVEFORM_CONTROL);
-    if (status)
-	goto err;
-    status = transmit_data(border_waveform_control, sizeof border_waveform_control);
-    if (status)
-	goto err;
-
-    status = transmit_command(DATA_ENTRY_MODE_SETTING);
-    if (status)
-	goto err;
-    status = transmit_data(data_entry_mode_setting, sizeof data_entry_mode_setting);
-    if (status)
-	goto err;
+    if (panel.soft_reset) {	/* registers to defaults, OTP loaded */
+	status = transmit_sequence(soft_reset, sizeof soft_reset);
+	if (status)
+	    goto err;
+	status = dev_wait_while_busy();
+	if (status)
+	    goto err;
+    }
+    status = transmit_sequence(panel.init, panel.init_len);
 
  err:
     return status;
@@ -440,9 +579,17 @@ dev_set_ram_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1)
 {
     ErrCode status;
 
+#if RAM_X_PX
+    const byte ram_x_window[] = {
+	x0        & 0xFF,	/* px, 2 bytes as WIDTH > 255px */
+	(x0 >> 8) & 0xFF,
+	x1        & 0xFF,
+	(x1 >> 8) & 0xFF  };
+#else
     const byte ram_x_window[] = {
 	(x0 >> 3) & 0xFF,	/* divide by 8 for pitch */
 	(x1 >> 3) & 0xFF  };
+#endif
     const byte ram_y_window[] = {
 	y0        & 0xFF,	/* send in 2 bytes as HEIGHT > 255px */
 	(y0 >> 8) & 0xFF,
@@ -471,7 +618,11 @@ dev_set_ram_cursor(uint16_t x, uint16_t y)
 {
     ErrCode status;
 
+#if RAM_X_PX
+    const byte x_cur[] = { x & 0xFF, (x >> 8) & 0xFF }; /* px */
+#else
     const byte x_cur[] = { (x >> 3) & 0xFF }; /* packed 8bits per byte */
+#endif
     const byte y_cur[] = { y & 0xFF, (y >> 8) & 0xFF }; /* can be >255 so 2B req. */
 
     status = transmit_command(SET_RAM_X_ADDRESS_COUNTER);
@@ -492,25 +643,22 @@ dev_set_ram_cursor(uint16_t x, uint16_t y)
     return status; 
 }
 
-/* Wait until busy line is low or tries expired. Returns E_BUSY if
-   tries expired. */
+/* Wait until busy line is low, sleeping until its falling edge.
+   Returns E_BUSY if it stays high for BUSY_TIMEOUT. */
 static ErrCode
 dev_wait_while_busy(void)
 {
     ErrCode status;
-    enum GPIO_LEVEL busy;
-    unsigned tries = 300; 	/* ~30s if BUSY_DELAY is 100ms  */
 
-    do {
-	status = delay(BUSY_DELAY);
-	if (status)
-	    break;
-	status = GPIO_read(BCM_PIN_Busy, &busy);
-	if (status)
-	    break;
-    } while (busy==GPIO_LEVEL_High && tries--); 
+    TRACE_BEGIN(TRACE_BUSY);
+    status = delay(BUSY_SETTLE); /* busy may not have risen yet */
+    if (status)
+	goto err;
+    status = GPIO_wait_low(BCM_PIN_Busy, BUSY_TIMEOUT);
 
-    return tries ? status : E_BUSY;
+ err:
+    TRACE_END(TRACE_BUSY);
+    return status;
 }
 
 /* Attempts to power off the device, failure can result in device
@@ -522,14 +670,86 @@ dev_poweroff(void)
 {
     ErrCode status;
 
-    status = transmit_command(DEEP_SLEEP_MODE);
+    status = transmit_sequence(sleep_sequence, sizeof sleep_sequence);
+
+    return status ? E_SLEEP : (epdon=0, SUCCESS);
+}
+
+/* Wakes the controller from deep sleep. Only a hardware reset does,
+   and it resets the registers, so the init table is sent again. The
+   RAM is rewritten from the shadow, so the next refresh still only
+   sends the rows that changed and may be partial; the LUT it needs is
+   loaded by epd_refresh_frame(). With two banks it can't be known
+   which the reset left to be written, so both are forgotten and sent
+   whole by the next two refreshes, the first a full one. Nothing is
+   shown, the panel is not refreshed. */
+static ErrCode
+dev_wake(void)
+{
+    ErrCode       status;
+    unsigned long us;
+
+    stats.asleep_ms += elapsed_us(&since) / 1000;
+
+    status = dev_reset();
     if (status)
 	goto err;
+    status = dev_init();
+    if (status)
+	goto err;
+    if (RAM_BANKS > 1)
+	dev_forget_ram();
+    else if (shadow_valid[0]) {
+	status = dev_restore_ram();
+	if (status)
+	    goto err;
+    }
 
-    status = transmit_data(deep_sleep_mode, sizeof deep_sleep_mode);
+    us = elapsed_us(&since);
+    ++stats.wakes;
+    stats.wake_us += us;
+    if (us > stats.wake_max_us)
+	stats.wake_max_us = us;
+
+#ifdef DEBUG
+    printf("EPD: awake in %luus\n", us);
+#endif
 
  err:
-    return status ? E_SLEEP : (epdon=0, SUCCESS);
+    if (status)
+	dev_forget_ram();	/* RAM content unknown */
+    return status;
+}
+
+/* Writes the whole shadow back to the epd's RAM, one bank only */
+static ErrCode
+dev_restore_ram(void)
+{
+    ErrCode status;
+
+    status = dev_set_ram_window(0, 0, WIDTH-1, HEIGHT-1);
+    if (status)
+	goto err;
+    status = dev_set_ram_cursor(0, 0);
+    if (status)
+	goto err;
+    status = transmit_command(WRITE_RAM);
+    if (status)
+	goto err;
+    status = transmit_data(shadow[0], LEN(WIDTH, HEIGHT));
+
+ err:
+    return status;
+}
+
+/* Marks every bank's shadow stale, so each is next sent whole */
+static void
+dev_forget_ram(void)
+{
+    int i;
+
+    for (i=0; i<RAM_BANKS; ++i)
+	shadow_valid[i] = 0;
 }
 
 /* Transmits a command byte to the epd.
@@ -537,6 +757,7 @@ dev_poweroff(void)
   For command transfer:
        DC pin low (command)
        CS pin low (epd selected)
+  both in one bulk write.
 
   After spi transmission chip must be deselected (CS high) chip to
   complete transfer */
@@ -545,14 +766,10 @@ transmit_command(const byte tx)
 {
     ErrCode status;
 
-    status = GPIO_write(BCM_PIN_DataCommand, GPIO_LEVEL_Low);
-    if (status)
-	goto err;
-    status = GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_Low);
+    status = GPIO_write_bulk(select_command);
     if (status)
 	goto err;
 
-    GPIO_dump();
     status = SPI_write_byte(tx);
     if (status)
 	goto err;
@@ -563,92 +780,317 @@ transmit_command(const byte tx)
     return status; 
 }
 
-/* Transmit data byte to epd
+/* Transmit data bytes to epd
 
    For data transmission:
         DC pin high (data)
         CS pin low (epd selected)
 
-  After spi transmission chip must be deselected (CS high) to complete
-  transfer */
+  The whole buffer is sent with the chip selected once, the epd takes
+  consecutive bytes as long as CS stays low. After spi transmission
+  chip must be deselected (CS high) to complete transfer */
 static ErrCode
 transmit_data(const byte *tx, size_t len)
 {
-    ErrCode status;
-    size_t i;
+    ErrCode status, status_cs;
 
-    status = GPIO_write(BCM_PIN_DataCommand, GPIO_LEVEL_High);
+    status = GPIO_write_bulk(select_data);
     if (status)
 	goto err;
 
-    for (i=0; i<len && status==SUCCESS; ++i) {   
-	GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_Low);
-	GPIO_dump();
-	status = SPI_write_byte(tx[i]);
-	GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_High);
-    }
+    status = SPI_write(tx, len);
+
+    status_cs = GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_High);
+    if (!status)
+	status = status_cs;
 
  err:
     return status;
 }
 
+/* Sends a command table: each command byte, then its data length and
+   data. The chip is selected once for the whole table, only DC
+   changes between a command and its data, so a table costs one SPI
+   transfer per command and per block of data. DC writes that change
+   nothing, e.g. between two commands without data, are elided by
+   gpio.c. */
 static ErrCode
-transmit_lut(const byte *lut)
+transmit_sequence(const byte *seq, size_t len)
 {
-    ErrCode status;
+    ErrCode status, status_cs;
+    size_t  i, n;
 
-    status = transmit_command(WRITE_LUT_REGISTER);
+    status = GPIO_write_bulk(select_command);
     if (status)
 	goto err;
 
-    status = transmit_data(lut, LUT_LEN);
-    if (status)
-	goto err;
+    for (i=0; i<len; i+=2+n) {
+	n = seq[i+1];
+	assert(i+2+n <= len && "Command table overrun");
+
+	status = GPIO_write(BCM_PIN_DataCommand, GPIO_LEVEL_Low);
+	if (status)
+	    break;
+	status = SPI_write_byte(seq[i]);
+	if (status)
+	    break;
+	if (!n)
+	    continue;
+
+	status = GPIO_write(BCM_PIN_DataCommand, GPIO_LEVEL_High);
+	if (status)
+	    break;
+	status = SPI_write(seq+i+2, n);
+	if (status)
+	    break;
+    }
+
+    status_cs = GPIO_write(BCM_PIN_ChipSelect, GPIO_LEVEL_High);
+    if (!status)
+	status = status_cs;
 
  err:
     return status;
 }
 
-/* Framebuffer is transfered row by row */
 static ErrCode
-transmit_framebuffer(void)
+transmit_lut(const byte *newlut)
 {
     ErrCode status;
-    coordinate y;
-    byte *tx;
 
-    status = dev_set_ram_window(0, 0, WIDTH, HEIGHT);
-    if (status)
-	goto err;
+    lut = NULL;			/* unknown if interrupted */
+    status = transmit_sequence(newlut, LUT_SEQ_LEN);
+    if (!status)
+	lut = newlut;
 
-    for (y=0, tx=fbuf; y<HEIGHT; y++, tx+=PITCH(WIDTH)) {
-	status = dev_set_ram_cursor(0, y);
-	if ( status)
-	    goto err; 
-	status = transmit_command(WRITE_RAM);
-	if (status)
+    return status;
+}
+
+/* Sends the rows of tx that differ from the shadow of the bank being
+   written, or the whole frame when that shadow isn't valid. Changed
+   rows are gathered into bands, each sent through its own RAM window,
+   so a new page number or a line of text costs a few hundred bytes
+   rather than the whole frame. pending() returning non zero can stop
+   it between bands with E_CANCELLED; bands already sent stay in the
+   shadow. */
+static ErrCode
+transmit_framebuffer(const byte *tx, int (*pending)(void))
+{
+    ErrCode       status = SUCCESS;
+    struct Band   band;
+    unsigned long sent;
+    coordinate    y;
+
+    TRACE_BEGIN(TRACE_SEND);
+    sent = stats.sent;
+    for (y=0; next_band(tx, y, &band); y=band.y1+1) {
+	if (pending && pending()) {
+	    status = E_CANCELLED;
 	    goto err;
-	status = transmit_data(tx, PITCH(WIDTH));
+	}
+	status = transmit_band(tx, &band);
 	if (status)
 	    goto err;
     }
+    shadow_valid[bank] = 1;
+    sent               = stats.sent - sent;
+    stats.saved       += LEN(WIDTH, HEIGHT) - sent;
+
+#ifdef DEBUG
+    printf("Framebuffer: sent %luB of %dB\n", sent, LEN(WIDTH, HEIGHT));
+#endif
+
+ err:
+    TRACE_END_N(TRACE_SEND, status ? 0 : sent);
+    return status;
+}
+
+/* Writes the bytes of tx inside band to the epd's RAM. The data entry
+   mode increments the address counter along x then y within the
+   window, so band rows narrower than the frame are packed together
+   first. */
+static ErrCode
+transmit_band(const byte *tx, const struct Band *band)
+{
+    static byte pack[LEN(WIDTH, BAND_ROWS)];
+    ErrCode     status;
+    const byte *data;
+    size_t      w, h, y;
+
+    w = band->x1 - band->x0 + 1;
+    h = band->y1 - band->y0 + 1;
+    data = tx + band->y0*PITCH(WIDTH);
+    if (w < PITCH(WIDTH)) {
+	for (y=0; y<h; ++y)
+	    memcpy(pack + y*w, data + y*PITCH(WIDTH) + band->x0, w);
+	data = pack;
+    }
+
+    status = dev_set_ram_window(band->x0*8, band->y0, band->x1*8+7, band->y1);
+    if (status)
+	goto err;
+    status = dev_set_ram_cursor(band->x0*8, band->y0);
+    if (status)
+	goto err;
+    status = transmit_command(WRITE_RAM);
+    if (status)
+	goto err;
+    status = transmit_data(data, w*h);
+    if (status)
+	goto err;
+
+    for (y=band->y0; y<=band->y1; ++y)
+	memcpy(shadow[bank] + y*PITCH(WIDTH) + band->x0,
+	       tx + y*PITCH(WIDTH) + band->x0, w);
+    stats.sent += w*h;
+    ++stats.bands;
 
-err:
+ err:
+    if (status)
+	shadow_valid[bank] = 0;	/* RAM left half written */
     return status;
 }
 
+/* Finds the first band of changed rows at or after row from. Changed
+   rows less than BAND_GAP apart share a band, at most BAND_ROWS high,
+   trimmed to the columns of bytes that changed. Rows are compared
+   with the bank being written, on two bank panels the frame before
+   last. Every row is changed while its shadow isn't valid. Returns 0
+   if there are none. */
+static int
+next_band(const byte *tx, coordinate from, struct Band *band)
+{
+    const byte *ram = shadow[bank];
+    const byte *a, *b;
+    coordinate  y, x;
+
+    if (!shadow_valid[bank]) {
+	if (from >= HEIGHT)
+	    return 0;
+	band->y0 = from;
+	band->y1 = from+BAND_ROWS < HEIGHT ? from+BAND_ROWS-1 : HEIGHT-1;
+	band->x0 = 0;
+	band->x1 = PITCH(WIDTH)-1;
+	return 1;
+    }
+
+    for (y=from; y<HEIGHT; ++y)
+	if (row_dirty(tx + y*PITCH(WIDTH), ram + y*PITCH(WIDTH)))
+	    break;
+    if (y == HEIGHT)
+	return 0;
+
+    band->y0 = band->y1 = y;
+    band->x0 = PITCH(WIDTH)-1;
+    band->x1 = 0;
+    for (; y<HEIGHT && y-band->y0 < BAND_ROWS && y-band->y1 <= BAND_GAP; ++y) {
+	a = tx + y*PITCH(WIDTH);
+	b = ram + y*PITCH(WIDTH);
+	if (!row_dirty(a, b))
+	    continue;
+	band->y1 = y;
+	for (x=0; x<band->x0 && a[x] == b[x]; ++x)
+	    ;
+	band->x0 = x;
+	for (x=PITCH(WIDTH)-1; x>band->x1 && a[x] == b[x]; --x)
+	    ;
+	band->x1 = x;
+    }
+
+    return 1;
+}
+
+/* Non zero if a row of two frames differ, compared a word at a time */
+static int
+row_dirty(const byte *a, const byte *b)
+{
+    uint64_t x, y, d = 0;
+    size_t   i;
+
+    for (i=0; i+8<=PITCH(WIDTH); i+=8) {
+	memcpy(&x, a+i, 8);
+	memcpy(&y, b+i, 8);
+	d |= x ^ y;
+    }
+    for (; i<PITCH(WIDTH); ++i)
+	d |= a[i] ^ b[i];
+
+    return d != 0;
+}
+
+/* Number of pixels that differ between two frames, a word at a time */
+static unsigned long
+count_changed(const byte *a, const byte *b)
+{
+    unsigned long n = 0;
+    uint64_t      x, y;
+    size_t        i;
+
+    for (i=0; i+8<=LEN(WIDTH, HEIGHT); i+=8) {
+	memcpy(&x, a+i, 8);
+	memcpy(&y, b+i, 8);
+	n += __builtin_popcountll(x ^ y);
+    }
+    for (; i<LEN(WIDTH, HEIGHT); ++i)
+	n += __builtin_popcount(a[i] ^ b[i]);
+
+    return n;
+}
+
+/* Non zero if the next refresh, changing diff pixels, should be a
+   full one: partial refreshes are off, the panel content or the RAM
+   bank the partial waveform starts from is unknown, or enough
+   partials or changed pixels have built up ghosting. */
+static int
+schedule_full(unsigned long diff)
+{
+    if (!policy.partials || !shown_valid || !shadow_valid[FRONT]
+	|| !panel.lut_partial)
+	return 1;
+    if (partials >= policy.partials)
+	return 1;
+    if (policy.changed_pct
+	&& (changed + diff) * 100 > (unsigned long)policy.changed_pct * WIDTH*HEIGHT)
+	return 1;
+
+    return 0;
+}
+
 /* sleeps process (milli seconds) */
 static ErrCode
 delay(unsigned ms)
 {
-    int res;
-    unsigned i;
+    struct timespec end;
 
     if (ms == 0)
 	return E_ARG;
 
-    for (i=0, res=0; i<ms && !res; ++i) /* loop prevents integer overflow */
-	res = usleep(1000);
+    /* an absolute deadline on the monotonic clock isn't stretched by
+       time spent setting up the sleep */
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec  += ms / 1000;
+    end.tv_nsec += ms % 1000 * 1000000L;
+    if (end.tv_nsec >= 1000000000L) {
+	++end.tv_sec;
+	end.tv_nsec -= 1000000000L;
+    }
+
+    return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL)
+	? E_SIG : SUCCESS;
+}
+
+/* Microseconds on the monotonic clock since from, which is moved on
+   to now */
+static unsigned long
+elapsed_us(struct timespec *from)
+{
+    struct timespec now;
+    unsigned long   us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - from->tv_sec) * 1000000L
+	+ (now.tv_nsec - from->tv_nsec) / 1000;
+    *from = now;
 
-    return res ? E_SIG : SUCCESS;
+    return us;
 }
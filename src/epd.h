@@ -2,18 +2,37 @@
    Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
    See COPYING for licence details. */
 
-/* epd.h - EPD hardware interface */
+/* epd.h - EPD hardware interface. The framebuffer functions are in
+   framebuffer.c, the rest in the display backend built: epd.c for
+   the panel or virtual.c for image files. */
 
 #ifndef EPD_H
 #define EPD_H
 
 #include "oku.h"
 #include "err.h"
+#include "blit.h"
 
 ErrCode epd_start(struct Point *px_out);
+ErrCode epd_landscape(struct Point *px_out);
 ErrCode epd_clear(void);
 ErrCode epd_refresh(void);
+ErrCode epd_refresh_cancellable(int (*pending)(void));
+ErrCode epd_refresh_frame(const byte *frame, int (*pending)(void));
+void    epd_refresh_policy(const struct RefreshPolicy *policy);
+void    epd_stats(struct EpdStats *out);
+ErrCode epd_sleep(void);
 ErrCode epd_write(const struct Raster *img, struct Point origin);
 ErrCode epd_stop(void);
 
+/* Framebuffers other than the one on screen */
+byte   *epd_buffer_new(void);
+byte   *epd_buffer(void);
+size_t  epd_buffer_len(void);
+byte   *epd_buffer_swap(byte *buf);
+ErrCode epd_buffer_clear(byte *buf);
+ErrCode epd_buffer_write(byte *buf, const struct Raster *img, struct Point origin);
+ErrCode epd_buffer_blit(byte *buf, const struct Raster *img, struct Point origin,
+			enum BLIT_MODE mode);
+
 #endif /* OKU_TYPES_H */
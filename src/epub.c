@@ -0,0 +1,949 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* epub.c - reads the text of EPUB books one chapter at a time.
+
+   An EPUB is a zip archive of XHTML chapters. The zip central
+   directory (at the end of the file) is read once when the book is
+   opened, followed by META-INF/container.xml, which names the OPF
+   package file, whose spine lists the chapters in reading order.
+
+   Chapters are then inflated lazily, one at a time, as the reader
+   reaches them. Inflated XHTML is stripped to plain UTF-8 text as it
+   streams out of zlib, so the only large allocation is the text of
+   the chapter being read. Its upper bound is the chapter's
+   uncompressed size, which is what peak memory is bounded by.
+
+   Markup is reduced as follows:
+
+   | XHTML                           | Text                        |
+   |---------------------------------+-----------------------------|
+   | <head>, <script>, <style>       | removed with their contents |
+   | <p>, <div>, <h1>, <li>, <br>... | line break                  |
+   | runs of whitespace              | one space                   |
+   | &amp; &#233; &#x2014; ...       | the character               |
+   | comments, any other tag         | removed                     |
+
+   Zip64 archives and encryption are not supported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "epub.h"
+
+#define SIG_LOCAL         0x04034B50 /* zip record signatures */
+#define SIG_CDIR          0x02014B50
+#define SIG_EOCD          0x06054B50
+#define LOCAL_LEN         30	     /* fixed record lengths */
+#define CDIR_LEN          46
+#define EOCD_LEN          22
+#define EOCD_SEARCH       (0xFFFF + EOCD_LEN) /* eocd + max comment */
+
+#define METHOD_STORED     0
+#define METHOD_DEFLATED   8
+#define INFLATE_CHUNK     16384	/* zlib in/out buffer size */
+
+#define CONTAINER_PATH    "META-INF/container.xml"
+#define PATH_MAX_         512	/* longest path within archive */
+#define TAG_MAX           16	/* longest element name recognised */
+#define ENTITY_MAX        10	/* longest entity recognised */
+
+/* Receives inflated data as it is produced */
+typedef ErrCode (*Sink)(void *ctx, const byte *buf, size_t len);
+
+/* Growable buffer for small files (container and package) */
+struct Buffer {
+    byte     *buf;
+    size_t    len, cap;
+};
+
+/* XHTML to text stripper state, kept between inflated chunks */
+enum STRIP_STATE { STRIP_TEXT, STRIP_TAG, STRIP_COMMENT, STRIP_ENTITY };
+
+struct Strip {
+    struct Epub      *out;
+    enum STRIP_STATE  state;
+    char              tag[TAG_MAX+1];  /* element name, lower case */
+    size_t            taglen;
+    int               named;	       /* element name complete */
+    int               closing;	       /* </tag> */
+    int               selfclosing;     /* <tag/> */
+    char              quote;	       /* open attribute quote or 0 */
+    char              ent[ENTITY_MAX+1];
+    size_t            entlen;
+    unsigned          dashes;	       /* consecutive '-' in comment */
+    char              skip[TAG_MAX+1]; /* skipped element we are inside */
+    int               space;	       /* whitespace pending */
+};
+
+/* zip */
+static ErrCode   read_cdir(struct Epub *ep);
+static ErrCode   inflate_entry(struct Epub *ep, size_t idx, Sink sink, void *ctx);
+static long      find_entry(const struct Epub *ep, const char *name);
+static uint16_t  rd16(const byte *p);
+static uint32_t  rd32(const byte *p);
+
+/* package */
+static ErrCode   read_spine(struct Epub *ep);
+static ErrCode   load_file(struct Epub *ep, const char *name, struct Buffer *out);
+static ErrCode   sink_buffer(void *ctx, const byte *buf, size_t len);
+static int       next_tag(const char **cur, const char *end,
+			  const char **tag, const char **tagend);
+static int       tag_is(const char *tag, const char *tagend, const char *name);
+static int       tag_attr(const char *tag, const char *tagend, const char *name,
+			  char *out, size_t outlen);
+static void      resolve_path(const char *base, const char *href,
+			      char *out, size_t outlen);
+
+/* chapters */
+static ErrCode   load_chapter(struct Epub *ep, size_t chapter);
+static ErrCode   sink_strip(void *ctx, const byte *buf, size_t len);
+static ErrCode   strip_tag(struct Strip *st);
+static ErrCode   strip_entity(struct Strip *st);
+static ErrCode   emit(struct Strip *st, byte b);
+static ErrCode   emit_text(struct Strip *st, byte b);
+static ErrCode   emit_break(struct Strip *st);
+static ErrCode   emit_codepoint(struct Strip *st, unicode cp);
+
+/* Returns non zero if fh is a zip archive. The file position is set
+   to the beginning of the file. */
+int
+epub_detect(FILE *fh)
+{
+    byte sig[4];
+    int  found;
+
+    rewind(fh);
+    found = fread(sig, sizeof sig, 1, fh) == 1 && rd32(sig) == SIG_LOCAL;
+    rewind(fh);
+
+    return found;
+}
+
+/* Reads the central directory and spine of the EPUB in fh, then
+   loads the first chapter. fh remains owned by the caller.
+
+   Returns: SUCCESS    new populated (free with epub_close)
+            E_FFORMAT  not a readable EPUB
+            E_IO       file read error
+            E_MEM      malloc error                                    */
+ErrCode
+epub_open(FILE *fh, struct Epub **new)
+{
+    ErrCode      status;
+    struct Epub *ep;
+
+    ep = calloc(1, sizeof *ep);
+    if (!ep)
+	return E_MEM;
+    ep->fh = fh;
+
+    status = read_cdir(ep);
+    if (status)
+	goto err;
+    status = read_spine(ep);
+    if (status)
+	goto err;
+    if (ep->nspine == 0) {
+	status = E_MT;
+	goto err;
+    }
+    if (ep->nspine > (size_t)(LONG_MAX >> EPUB_OFFSET_BITS)) {
+	status = E_OVERFLOW;	/* can't be bookmarked */
+	goto err;
+    }
+
+    ep->chapter = ep->nspine;	/* nothing loaded */
+    status = load_chapter(ep, 0);
+    if (status)
+	goto err;
+
+#ifdef DEBUG
+    printf("EPUB: %zu entries, %zu chapters\n", ep->nentry, ep->nspine);
+#endif
+
+    *new = ep;
+    return SUCCESS;
+ err:
+    epub_close(ep);
+    return status;
+}
+
+void
+epub_close(struct Epub *toclose)
+{
+    size_t i;
+
+    if (!toclose)
+	return;
+
+    for (i=0; toclose->entry && i<toclose->nentry; ++i)
+	free(toclose->entry[i].name);
+    free(toclose->entry);
+    free(toclose->spine);
+    free(toclose->text);
+    free(toclose);
+}
+
+/* Reads the next byte of text, moving on to the next chapter at the
+   end of the current one. Returns E_EOF after the last chapter. */
+ErrCode
+epub_getc(struct Epub *toread, byte *out)
+{
+    ErrCode status;
+
+    while (toread->cursor == toread->len) {
+	if (toread->chapter+1 >= toread->nspine)
+	    return E_EOF;
+	status = load_chapter(toread, toread->chapter+1);
+	if (status)
+	    return status;
+    }
+
+    *out = toread->text[toread->cursor++];
+    return SUCCESS;
+}
+
+/* Current read position, see EPUB_POS() */
+long
+epub_tell(const struct Epub *toread)
+{
+    return EPUB_POS(toread->chapter, toread->cursor);
+}
+
+/* Moves to a position returned by epub_tell(), inflating the chapter
+   it lies in if that is not the one loaded. */
+ErrCode
+epub_seek(struct Epub *toseek, long position)
+{
+    ErrCode status;
+    size_t  chapter, offset;
+
+    if (position < 0)
+	return E_ARG;
+
+    chapter = EPUB_POS_CHAPTER(position);
+    offset  = EPUB_POS_OFFSET(position);
+    if (chapter >= toseek->nspine)
+	return E_ARG;
+
+    status = load_chapter(toseek, chapter);
+    if (status)
+	return status;
+    if (offset > toseek->len)
+	return E_ARG;
+
+    toseek->cursor = offset;
+    return SUCCESS;
+}
+
+/* STATIC FUNCTIONS */
+
+/* ZIP ARCHIVE */
+
+/* Locates the end of central directory record and reads every entry
+   of the central directory. */
+static ErrCode
+read_cdir(struct Epub *ep)
+{
+    ErrCode   status;
+    byte     *buf, *cur, *end;
+    long      flen, tail, i;
+    uint32_t  cdsize, cdoff;
+    uint16_t  namelen;
+    size_t    n;
+
+    if (fseek(ep->fh, 0, SEEK_END) || (flen=ftell(ep->fh)) == -1)
+	return E_IO;
+    tail = flen < EOCD_SEARCH ? flen : EOCD_SEARCH;
+    if (tail < EOCD_LEN)
+	return E_FFORMAT;
+
+    buf = malloc(tail);
+    if (!buf)
+	return E_MEM;
+    if (fseek(ep->fh, flen-tail, SEEK_SET) || fread(buf, tail, 1, ep->fh) != 1) {
+	status = E_IO;
+	goto err;
+    }
+
+    /* The record is followed by a comment, so search backwards */
+    for (i=tail-EOCD_LEN; i>=0 && rd32(buf+i) != SIG_EOCD; --i)
+	;
+    if (i < 0) {
+	status = E_FFORMAT;
+	goto err;
+    }
+    n      = rd16(buf+i+10);
+    cdsize = rd32(buf+i+12);
+    cdoff  = rd32(buf+i+16);
+    free(buf);
+    if (n == 0xFFFF || cdoff == 0xFFFFFFFF)
+	return E_FFORMAT;	/* zip64 */
+    if (n == 0)
+	return E_FFORMAT;	/* nothing in it */
+
+    /* Read the whole central directory in one go */
+    buf = malloc(cdsize);
+    ep->entry = calloc(n, sizeof *ep->entry);
+    if (!buf || !ep->entry) {
+	status = E_MEM;
+	goto err;
+    }
+    if (fseek(ep->fh, cdoff, SEEK_SET) || fread(buf, cdsize, 1, ep->fh) != 1) {
+	status = E_IO;
+	goto err;
+    }
+
+    for (cur=buf, end=buf+cdsize; ep->nentry<n; ++ep->nentry) {
+	struct ZipEntry *e = ep->entry + ep->nentry;
+
+	if (cur+CDIR_LEN > end || rd32(cur) != SIG_CDIR) {
+	    status = E_FFORMAT;
+	    goto err;
+	}
+	namelen   = rd16(cur+28);
+	e->method = rd16(cur+10);
+	e->csize  = rd32(cur+20);
+	e->usize  = rd32(cur+24);
+	e->offset = rd32(cur+42);
+	if (cur+CDIR_LEN+namelen > end) {
+	    status = E_FFORMAT;
+	    goto err;
+	}
+	e->name = malloc(namelen+1);
+	if (!e->name) {
+	    status = E_MEM;
+	    goto err;
+	}
+	memcpy(e->name, cur+CDIR_LEN, namelen);
+	e->name[namelen] = '\0';
+
+	cur += CDIR_LEN + namelen + rd16(cur+30) + rd16(cur+32);
+    }
+
+    status = SUCCESS;
+ err:
+    free(buf);
+    return status;
+}
+
+/* Streams the uncompressed contents of an entry through sink */
+static ErrCode
+inflate_entry(struct Epub *ep, size_t idx, Sink sink, void *ctx)
+{
+    ErrCode          status;
+    struct ZipEntry *e = ep->entry + idx;
+    byte             local[LOCAL_LEN];
+    byte             in[INFLATE_CHUNK], out[INFLATE_CHUNK];
+    uint32_t         remaining;
+    z_stream         zs;
+    size_t           n;
+    int              zret = Z_OK;
+
+    if (fseek(ep->fh, e->offset, SEEK_SET) || fread(local, LOCAL_LEN, 1, ep->fh) != 1)
+	return E_IO;
+    if (rd32(local) != SIG_LOCAL)
+	return E_FFORMAT;
+    if (fseek(ep->fh, rd16(local+26) + rd16(local+28), SEEK_CUR))
+	return E_IO;
+
+    remaining = e->csize;
+    if (e->method == METHOD_STORED) {
+	while (remaining) {
+	    n = remaining < sizeof in ? remaining : sizeof in;
+	    if (fread(in, n, 1, ep->fh) != 1)
+		return E_IO;
+	    status = sink(ctx, in, n);
+	    if (status)
+		return status;
+	    remaining -= n;
+	}
+	return SUCCESS;
+    } else if (e->method != METHOD_DEFLATED) {
+	return E_FFORMAT;
+    }
+
+    memset(&zs, 0, sizeof zs);
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) /* raw deflate */
+	return E_MEM;
+
+    status = SUCCESS;
+    do {
+	n = remaining < sizeof in ? remaining : sizeof in;
+	if (n && fread(in, n, 1, ep->fh) != 1) {
+	    status = E_IO;
+	    break;
+	}
+	remaining   -= n;
+	zs.next_in   = in;
+	zs.avail_in  = n;
+	do {
+	    zs.next_out  = out;
+	    zs.avail_out = sizeof out;
+	    zret = inflate(&zs, Z_NO_FLUSH);
+	    if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+		status = E_FFORMAT;
+		break;
+	    }
+	    status = sink(ctx, out, sizeof out - zs.avail_out);
+	} while (!status && zs.avail_out == 0);
+    } while (!status && zret != Z_STREAM_END && remaining);
+
+    if (!status && zret != Z_STREAM_END)
+	status = E_FFORMAT;	/* truncated */
+
+    inflateEnd(&zs);
+    return status;
+}
+
+/* Index of the entry with the given path, or -1 */
+static long
+find_entry(const struct Epub *ep, const char *name)
+{
+    size_t i;
+
+    for (i=0; i<ep->nentry; ++i)
+	if (!strcmp(ep->entry[i].name, name))
+	    return i;
+
+    return -1;
+}
+
+/* zip fields are little endian */
+static uint16_t
+rd16(const byte *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t
+rd32(const byte *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8
+	| (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* PACKAGE */
+
+/* Follows the container to the OPF package and builds the spine from
+   its manifest items and itemrefs. */
+static ErrCode
+read_spine(struct Epub *ep)
+{
+    ErrCode        status;
+    struct Buffer  file = { NULL, 0, 0 };
+    const char    *cur, *end, *tag, *tagend;
+    char           opf[PATH_MAX_], path[PATH_MAX_], attr[PATH_MAX_];
+    char         **ids, **hrefs;
+    size_t         nitem, i;
+    long           idx;
+
+    ids = hrefs = NULL;
+    nitem = 0;
+
+    /* container.xml: <rootfile full-path="..."/> */
+    status = load_file(ep, CONTAINER_PATH, &file);
+    if (status)
+	return status;
+    cur = (char *)file.buf;
+    end = cur + file.len;
+    opf[0] = '\0';
+    while (next_tag(&cur, end, &tag, &tagend))
+	if (tag_is(tag, tagend, "rootfile")
+	    && tag_attr(tag, tagend, "full-path", opf, sizeof opf))
+	    break;
+    free(file.buf);
+    if (!opf[0])
+	return E_FFORMAT;
+
+    /* package: manifest <item id href/> then spine <itemref idref/> */
+    file.buf = NULL;
+    file.len = file.cap = 0;
+    status = load_file(ep, opf, &file);
+    if (status)
+	return status;
+    cur = (char *)file.buf;
+    end = cur + file.len;
+
+    ids   = calloc(ep->nentry, sizeof *ids);
+    hrefs = calloc(ep->nentry, sizeof *hrefs);
+    ep->spine = calloc(ep->nentry, sizeof *ep->spine);
+    if (!ids || !hrefs || !ep->spine) {
+	status = E_MEM;
+	goto err;
+    }
+
+    while (next_tag(&cur, end, &tag, &tagend)) {
+	if (tag_is(tag, tagend, "item") && nitem < ep->nentry) {
+	    if (!tag_attr(tag, tagend, "id", attr, sizeof attr))
+		continue;
+	    ids[nitem] = strdup(attr);
+	    if (!tag_attr(tag, tagend, "href", attr, sizeof attr))
+		attr[0] = '\0';
+	    hrefs[nitem] = strdup(attr);
+	    ++nitem;		/* freed by err even if one failed */
+	    if (!ids[nitem-1] || !hrefs[nitem-1]) {
+		status = E_MEM;
+		goto err;
+	    }
+	} else if (tag_is(tag, tagend, "itemref") && ep->nspine < ep->nentry) {
+	    if (!tag_attr(tag, tagend, "idref", attr, sizeof attr))
+		continue;
+	    for (i=0; i<nitem && strcmp(ids[i], attr); ++i)
+		;
+	    if (i == nitem)
+		continue;	/* dangling reference */
+	    resolve_path(opf, hrefs[i], path, sizeof path);
+	    idx = find_entry(ep, path);
+	    if (idx != -1)
+		ep->spine[ep->nspine++] = idx;
+	}
+    }
+
+    status = SUCCESS;
+ err:
+    for (i=0; i<nitem; ++i) {
+	free(ids[i]);
+	free(hrefs[i]);
+    }
+    free(ids);
+    free(hrefs);
+    free(file.buf);
+    return status;
+}
+
+/* Inflates a whole (small) file from the archive into out, null
+   terminated. */
+static ErrCode
+load_file(struct Epub *ep, const char *name, struct Buffer *out)
+{
+    ErrCode status;
+    long    idx;
+
+    idx = find_entry(ep, name);
+    if (idx == -1)
+	return E_FFORMAT;
+
+    out->cap = ep->entry[idx].usize + 1;
+    out->len = 0;
+    out->buf = malloc(out->cap);
+    if (!out->buf)
+	return E_MEM;
+
+    status = inflate_entry(ep, idx, sink_buffer, out);
+    out->buf[out->len] = '\0';
+
+    return status;
+}
+
+static ErrCode
+sink_buffer(void *ctx, const byte *buf, size_t len)
+{
+    struct Buffer *out = ctx;
+
+    if (out->len + len >= out->cap)
+	return E_OVERFLOW;	/* larger than directory claimed */
+
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+
+    return SUCCESS;
+}
+
+/* Finds the next <tag ...> from cur, setting tag to the character
+   after '<' and tagend to the closing '>'. Returns 0 if none. */
+static int
+next_tag(const char **cur, const char *end, const char **tag, const char **tagend)
+{
+    const char *lt, *gt;
+
+    lt = memchr(*cur, '<', end - *cur);
+    if (!lt)
+	return 0;
+    gt = memchr(lt, '>', end - lt);
+    if (!gt)
+	return 0;
+
+    *tag    = lt + 1;
+    *tagend = gt;
+    *cur    = gt + 1;
+
+    return 1;
+}
+
+/* Compares the element name, ignoring any namespace prefix */
+static int
+tag_is(const char *tag, const char *tagend, const char *name)
+{
+    const char *colon, *nend;
+    size_t      len = strlen(name);
+
+    for (nend=tag; nend<tagend && !isspace((byte)*nend) && *nend!='/'; ++nend)
+	;
+    colon = memchr(tag, ':', nend - tag);
+    if (colon)
+	tag = colon + 1;
+
+    return (size_t)(nend - tag) == len && !strncmp(tag, name, len);
+}
+
+/* Copies the value of attribute name within a tag to out */
+static int
+tag_attr(const char *tag, const char *tagend, const char *name, char *out, size_t outlen)
+{
+    const char *cur, *val, *vend;
+    size_t      len = strlen(name);
+    char        quote;
+
+    for (cur=tag; cur+len+2 < tagend; ++cur) {
+	if (!isspace((byte)cur[0]) || strncmp(cur+1, name, len) || cur[len+1] != '=')
+	    continue;
+	quote = cur[len+2];
+	if (quote != '"' && quote != '\'')
+	    continue;
+	val  = cur + len + 3;
+	vend = memchr(val, quote, tagend - val);
+	if (!vend || (size_t)(vend - val) >= outlen)
+	    return 0;
+	memcpy(out, val, vend - val);
+	out[vend - val] = '\0';
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Resolves an href relative to the directory of base, decoding %XX
+   escapes, dropping any #fragment and collapsing . and .. segments */
+static void
+resolve_path(const char *base, const char *href, char *out, size_t outlen)
+{
+    char        joined[PATH_MAX_];
+    const char *slash, *seg, *next;
+    size_t      n, len;
+    unsigned    hex;
+
+    /* directory of base followed by the decoded href */
+    slash = strrchr(base, '/');
+    n = slash ? (size_t)(slash - base + 1) : 0;
+    if (n >= sizeof joined)
+	n = 0;
+    memcpy(joined, base, n);
+    for (; *href && *href != '#' && n+1 < sizeof joined; ++href) {
+	if (*href == '%' && sscanf(href+1, "%2x", &hex) == 1) {
+	    joined[n++] = hex;
+	    href += 2;
+	} else {
+	    joined[n++] = *href;
+	}
+    }
+    joined[n] = '\0';
+
+    /* rebuild in out one segment at a time */
+    for (n=0, seg=joined; *seg; seg = *next ? next+1 : next) {
+	next = strchr(seg, '/');
+	if (!next)
+	    next = seg + strlen(seg);
+	len = next - seg;
+
+	if (len == 0 || (len == 1 && seg[0] == '.'))
+	    continue;
+	if (len == 2 && !strncmp(seg, "..", 2)) {
+	    while (n && out[--n] != '/')
+		;
+	    continue;
+	}
+	if (n + 1 + len >= outlen)
+	    break;
+	if (n)
+	    out[n++] = '/';
+	memcpy(out+n, seg, len);
+	n += len;
+    }
+    out[n] = '\0';
+}
+
+/* CHAPTERS */
+
+/* Inflates a chapter of the spine, stripping it to text. The text
+   buffer is reused between chapters and only grows, sized at first
+   for the chapter's markup; the few entities longer as UTF-8 than
+   spelt out, e.g. "&;", grow it further in emit(). */
+static ErrCode
+load_chapter(struct Epub *ep, size_t chapter)
+{
+    ErrCode       status;
+    struct Strip  st;
+    size_t        need;
+    byte         *grown;
+
+    if (chapter == ep->chapter)
+	return SUCCESS;
+
+    need = ep->entry[ep->spine[chapter]].usize;
+    if (need > ep->cap) {
+	grown = realloc(ep->text, need);
+	if (!grown)
+	    return E_MEM;
+	ep->text = grown;
+	ep->cap  = need;
+    }
+
+    memset(&st, 0, sizeof st);
+    st.out      = ep;
+    ep->len     = 0;
+    ep->cursor  = 0;
+    ep->chapter = ep->nspine;	/* invalid until loaded */
+
+    status = inflate_entry(ep, ep->spine[chapter], sink_strip, &st);
+    if (status)
+	return status;
+    if (ep->len > EPUB_POS_OFFSET(-1L))
+	return E_OVERFLOW;	/* can't be bookmarked */
+
+#ifdef DEBUG
+    printf("EPUB: chapter %zu/%zu %s %uB -> %zuB text\n",
+	   chapter+1, ep->nspine, ep->entry[ep->spine[chapter]].name,
+	   ep->entry[ep->spine[chapter]].usize, ep->len);
+#endif
+
+    ep->chapter = chapter;
+    return SUCCESS;
+}
+
+/* Feeds inflated XHTML through the stripper state machine */
+static ErrCode
+sink_strip(void *ctx, const byte *buf, size_t len)
+{
+    ErrCode       status = SUCCESS;
+    struct Strip *st = ctx;
+    size_t        i;
+    byte          c;
+
+    for (i=0; i<len && !status; ++i) {
+	c = buf[i];
+	switch (st->state) {
+	case STRIP_TEXT:
+	    if (c == '<') {
+		st->state       = STRIP_TAG;
+		st->taglen      = 0;
+		st->named       = 0;
+		st->closing     = 0;
+		st->selfclosing = 0;
+		st->quote       = 0;
+	    } else if (c == '&' && !st->skip[0]) {
+		st->state  = STRIP_ENTITY;
+		st->entlen = 0;
+	    } else if (isspace(c)) {
+		st->space = 1;
+	    } else if (!st->skip[0]) {
+		status = emit_text(st, c);
+	    }
+	    break;
+	case STRIP_TAG:
+	    if (st->quote) {
+		if (c == st->quote)
+		    st->quote = 0;
+	    } else if (c == '"' || c == '\'') {
+		st->quote = c;
+	    } else if (c == '>') {
+		st->state = STRIP_TEXT;
+		status = strip_tag(st);
+	    } else if (c == '/') {
+		if (st->taglen == 0)
+		    st->closing = 1;
+		else
+		    st->selfclosing = 1;
+	    } else if (!st->named && st->taglen < TAG_MAX
+		       && (isalnum(c) || c == '!' || c == '-')) {
+		st->tag[st->taglen++] = tolower(c);
+		st->tag[st->taglen]   = '\0';
+		if (st->taglen == 3 && !strcmp(st->tag, "!--")) {
+		    st->state  = STRIP_COMMENT;
+		    st->dashes = 0;
+		}
+	    } else if (st->taglen) {
+		st->named       = 1;
+		st->selfclosing = 0; /* '/' only counts at the end */
+	    }
+	    break;
+	case STRIP_COMMENT:
+	    if (c == '>' && st->dashes >= 2)
+		st->state = STRIP_TEXT;
+	    st->dashes = c == '-' ? st->dashes+1 : 0;
+	    break;
+	case STRIP_ENTITY:
+	    if (c == ';') {
+		st->state = STRIP_TEXT;
+		status = strip_entity(st);
+	    } else if ((isalnum(c) || c == '#') && st->entlen < ENTITY_MAX) {
+		st->ent[st->entlen++] = c;
+	    } else {		/* not an entity: emit it as text */
+		st->state = STRIP_TEXT;
+		st->ent[st->entlen] = '\0';
+		status = emit_text(st, '&');
+		for (size_t j=0; j<st->entlen && !status; ++j)
+		    status = emit_text(st, st->ent[j]);
+		--i;		/* reprocess c as text */
+	    }
+	    break;
+	}
+    }
+
+    return status;
+}
+
+/* Acts on a complete tag: skipped sections and line breaks */
+static ErrCode
+strip_tag(struct Strip *st)
+{
+    static const char *skipped[] = { "head", "script", "style", NULL };
+    static const char *blocks[]  =
+	{ "p", "div", "br", "li", "tr", "dt", "dd", "hr", "pre",
+	  "h1", "h2", "h3", "h4", "h5", "h6", "blockquote", "section",
+	  "article", "header", "footer", "aside", "figure", "figcaption",
+	  "table", "ul", "ol", "dl", NULL };
+    const char **name;
+
+    if (st->skip[0]) {		/* only look for the end of the section */
+	if (st->closing && !strcmp(st->tag, st->skip))
+	    st->skip[0] = '\0';
+	return SUCCESS;
+    }
+
+    for (name=skipped; *name; ++name)
+	if (!strcmp(st->tag, *name)) {
+	    if (!st->closing && !st->selfclosing)
+		strcpy(st->skip, st->tag);
+	    return SUCCESS;
+	}
+
+    for (name=blocks; *name; ++name)
+	if (!strcmp(st->tag, *name))
+	    return strcmp(st->tag, "br") ? emit_break(st) : emit(st, '\n');
+
+    return SUCCESS;
+}
+
+/* Decodes a complete &entity; */
+static ErrCode
+strip_entity(struct Strip *st)
+{
+    static const struct { const char *name; unicode cp; } named[] =
+	{ { "amp", '&' },      { "lt", '<' },         { "gt", '>' },
+	  { "quot", '"' },     { "apos", '\'' },      { "nbsp", ' ' },
+	  { "ndash", 0x2013 }, { "mdash", 0x2014 },   { "hellip", 0x2026 },
+	  { "lsquo", 0x2018 }, { "rsquo", 0x2019 },   { "ldquo", 0x201C },
+	  { "rdquo", 0x201D }, { "copy", 0x00A9 },    { NULL, 0 } };
+    unsigned long cp;
+    const char   *digits;
+    char         *end;
+    size_t        i;
+
+    st->ent[st->entlen] = '\0';
+
+    if (st->ent[0] == '#') {
+	digits = st->ent + (st->ent[1] == 'x' || st->ent[1] == 'X' ? 2 : 1);
+	cp = strtoul(digits, &end, digits == st->ent+1 ? 10 : 16);
+	if (end == digits || *end || !cp || cp > 0x10FFFF
+	    || (cp >= 0xD800 && cp <= 0xDFFF)) /* surrogates */
+	    cp = CODEPOINT_INVALID_CHAR;
+	return emit_codepoint(st, cp);
+    }
+
+    for (i=0; named[i].name; ++i)
+	if (!strcmp(st->ent, named[i].name))
+	    return emit_codepoint(st, named[i].cp);
+
+    return emit_codepoint(st, CODEPOINT_INVALID_CHAR);
+}
+
+/* Appends a byte of text to the chapter, growing the buffer by half
+   again when full */
+static ErrCode
+emit(struct Strip *st, byte b)
+{
+    struct Epub *ep = st->out;
+    byte        *grown;
+    size_t       cap;
+
+    if (ep->len == ep->cap) {
+	cap   = ep->cap + ep->cap/2 + 64;
+	grown = realloc(ep->text, cap);
+	if (!grown)
+	    return E_MEM;
+	ep->text = grown;
+	ep->cap  = cap;
+    }
+
+    ep->text[ep->len++] = b;
+    return SUCCESS;
+}
+
+/* Appends text, preceded by a single space if whitespace was skipped
+   since the last character (and the line isn't empty). */
+static ErrCode
+emit_text(struct Strip *st, byte b)
+{
+    ErrCode      status;
+    struct Epub *ep = st->out;
+
+    if (st->space && ep->len && ep->text[ep->len-1] != '\n') {
+	status = emit(st, ' ');
+	if (status)
+	    return status;
+    }
+    st->space = 0;
+
+    return emit(st, b);
+}
+
+/* Ends the current line unless it is already empty */
+static ErrCode
+emit_break(struct Strip *st)
+{
+    struct Epub *ep = st->out;
+
+    st->space = 0;
+    if (!ep->len || ep->text[ep->len-1] == '\n')
+	return SUCCESS;
+
+    return emit(st, '\n');
+}
+
+/* Appends a codepoint as UTF-8 */
+static ErrCode
+emit_codepoint(struct Strip *st, unicode cp)
+{
+    ErrCode status;
+
+    if (cp < 0x80)
+	return emit_text(st, cp);
+
+    if (cp < 0x800) {
+	status = emit_text(st, 0xC0 | cp >> 6);
+    } else {
+	if (cp < 0x10000) {
+	    status = emit_text(st, 0xE0 | cp >> 12);
+	} else {
+	    status = emit_text(st, 0xF0 | cp >> 18);
+	    if (!status)
+		status = emit(st, 0x80 | (cp >> 12 & 0x3F));
+	}
+	if (!status)
+	    status = emit(st, 0x80 | (cp >> 6 & 0x3F));
+    }
+    if (!status)
+	status = emit(st, 0x80 | (cp & 0x3F));
+
+    return status;
+}
@@ -0,0 +1,31 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* epub.h - reads the text of EPUB books one chapter at a time */
+
+#ifndef EPUB_H
+#define EPUB_H
+
+#include <stdio.h>
+
+#include "err.h"
+#include "oku.h"
+
+/* Positions within an EPUB are the spine index of a chapter and a
+   byte offset into that chapter's text, packed into a long so they
+   can be bookmarked like file positions. */
+#define EPUB_OFFSET_BITS      20
+#define EPUB_POS(C,O)         ( ((long)(C) << EPUB_OFFSET_BITS) | (long)(O) )
+#define EPUB_POS_CHAPTER(P)   ( (size_t)(P) >> EPUB_OFFSET_BITS )
+#define EPUB_POS_OFFSET(P)    ( (size_t)(P) & ((1UL<<EPUB_OFFSET_BITS)-1) )
+
+int     epub_detect(FILE *fh);
+ErrCode epub_open(FILE *fh, struct Epub **new);
+void    epub_close(struct Epub *toclose);
+
+ErrCode epub_getc(struct Epub *toread, byte *out);
+long    epub_tell(const struct Epub *toread);
+ErrCode epub_seek(struct Epub *toseek, long position);
+
+#endif	/* EPUB_H */
@@ -33,6 +33,7 @@ static const char *errcode_str[] =
       "File is empty",
       "Corrupt .oku file (manually delete)",
       "Buffer overflow prevented or detected",
+      "Cancelled by newer input",
       "Unreachable code reached"
     };
 
@@ -28,6 +28,7 @@ typedef enum err_code {
     E_MT,
     E_HASH,
     E_OVERFLOW,
+    E_CANCELLED,
     E_UNREACHABLE
 } ErrCode;
 
@@ -0,0 +1,149 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* framebuffer.c - the framebuffer half of epd.h, drawing pages into
+   memory. Shared by the display backends, epd.c for the panel and
+   virtual.c for image files, which implement the rest: starting,
+   refreshing and stopping the display. */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+
+#include "oku.h"
+#include "err.h"
+
+#include "epd.h"
+#include "panel.h"
+#include "framebuffer.h"
+#include "blit.h"
+
+/* see epd.c */
+#define PITCH(X)              ( X%8 ? 1+(X/8) : X/8  )
+#define LEN(X,Y)              ( PITCH(X) * Y         )
+
+/* Representation of pixel colour for this device */
+enum {BLACK = 0x00 , WHITE = 0xFF};
+
+byte *fbuf;			/* screen buffer */
+int landscape;			/* fbuf is HEIGHT px wide by WIDTH high */
+
+/* Turns the display on its side: framebuffers become a canvas
+   HEIGHT px wide by WIDTH px high, turned a quarter clockwise to the
+   panel's own layout when epd.c transmits them. px_out is set to the
+   canvas size. The canvas is the same number of bytes as the panel's
+   RAM as both sides must be multiples of 8, E_ARG otherwise. */
+ErrCode
+epd_landscape(struct Point *px_out)
+{
+    if (WIDTH % 8 || HEIGHT % 8)
+	return E_ARG;
+
+    landscape = 1;
+    px_out->x = HEIGHT;
+    px_out->y = WIDTH;
+
+    return SUCCESS;
+}
+
+/* Sets every bit in framebuffer to the defined value of WHITE. Does
+   not transmit any data to epd. */
+ErrCode
+epd_clear(void)
+{
+    return epd_buffer_clear(fbuf);
+}
+
+/* Copies a bitmap into the framebuffer starting at origin */
+ErrCode
+epd_write(const struct Raster *img, struct Point origin)
+{
+    return epd_buffer_write(fbuf, img, origin);
+}
+
+/* Allocates a framebuffer the size of the display, e.g. to render a
+   page into ahead of time. Free with free(). */
+byte *
+epd_buffer_new(void)
+{
+    return calloc(LEN(WIDTH, HEIGHT), sizeof *fbuf);
+}
+
+/* The framebuffer that is transmitted on refresh */
+byte *
+epd_buffer(void)
+{
+    return fbuf;
+}
+
+/* Bytes in a framebuffer */
+size_t
+epd_buffer_len(void)
+{
+    return LEN(WIDTH, HEIGHT);
+}
+
+/* Makes buf the framebuffer transmitted on refresh, returning the
+   previous one to the caller. */
+byte *
+epd_buffer_swap(byte *buf)
+{
+    byte *prev = fbuf;
+
+    assert(buf && "Dereferenced null pointer");
+    fbuf = buf;
+
+    return prev;
+}
+
+/* As epd_clear(), on any framebuffer */
+ErrCode
+epd_buffer_clear(byte *buf)
+{
+    assert(buf && "Dereferenced null pointer");
+
+    for (int i=0; i<LEN(WIDTH,HEIGHT); ++i)
+	buf[i] = WHITE;
+	
+    return SUCCESS;
+}
+
+/* As epd_write(), on any framebuffer */
+ErrCode
+epd_buffer_write(byte *buf, const struct Raster *img, struct Point origin)
+{
+    return epd_buffer_blit(buf, img, origin, BLIT_COPY);
+}
+
+/* Draws a bitmap on a framebuffer at any pixel, see blit.h for the
+   modes. Clipped to the display. */
+ErrCode
+epd_buffer_blit(byte *buf, const struct Raster *img, struct Point origin,
+		enum BLIT_MODE mode)
+{
+    static const struct Point portrait = { WIDTH, HEIGHT };
+    static const struct Point sideways = { HEIGHT, WIDTH };
+
+    return blit(buf, landscape ? sideways : portrait, img,
+		origin.x, origin.y, mode);
+}
+
+ErrCode
+epd_refresh(void)
+{
+    return epd_refresh_cancellable(NULL);
+}
+
+/* As epd_refresh(), but gives up with E_CANCELLED if pending()
+   returns non zero before the panel is told to update, e.g. because
+   the reader has already turned the page again. Once MASTER_ACTIVATION
+   is sent the refresh runs to completion. The panel's RAM may be left
+   part written, the next refresh sends whatever is still stale. */
+ErrCode
+epd_refresh_cancellable(int (*pending)(void))
+{
+    assert(fbuf && "Frame buffer not initialised");
+
+    return epd_refresh_frame(fbuf, pending);
+}
@@ -0,0 +1,15 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* framebuffer.h - framebuffer state shared by the display backends */
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "oku.h"
+
+extern byte *fbuf;		/* screen buffer, allocated by epd_start() */
+extern int   landscape;		/* fbuf is HEIGHT px wide by WIDTH high */
+
+#endif	/* FRAMEBUFFER_H */
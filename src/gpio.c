@@ -2,13 +2,24 @@
    Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
    See COPYING for licence details. */
 
-/* gpio.c - GPIO interface implemented using gpiod.h    */
+/* gpio.c - GPIO interface implemented using gpiod.h
+
+   Every libgpiod call on a line is a syscall. The level last written
+   to each output is kept, so writes that wouldn't change a line are
+   skipped. Lines that change together, e.g. an SPI device's chip
+   select and data/command lines, can be reserved as one bulk
+   request and set in a single call. A line in the bulk request is
+   always written through it, as setting one line of a request on
+   its own would set the others low. */
 
 #ifdef DEBUG
 #include <stdio.h>
 #endif
 
 #include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <gpiod.h>
 
 #include "oku.h"
@@ -16,10 +27,14 @@
 #include "gpio.h"
 
 #define LINE_MAX 50		/* maximum number of gpiolines in a chip */
+#define NS_PER_S 1000000000L
+#define BULK_MAX 4		/* lines in the bulk request */
 
 struct line {
     struct gpiod_line *handle;	   /* libgpiod gpio line handle */
     enum GPIO_LEVEL default_level; /* default level  */
+    int level;			   /* last written, -1 if unknown */
+    unsigned bulk;		   /* position in bulk request + 1 */
 };
 
 struct gpio {
@@ -27,10 +42,18 @@ struct gpio {
     const char *consumer;	/* identifying name for user */
     struct gpiod_chip *handle;	/* libgpiod gpio chip handle */
     struct line line[LINE_MAX];	/* array of lines on chip */
+
+    struct gpiod_line_bulk bulk;  /* outputs requested together */
+    unsigned bulk_line[BULK_MAX]; /* their line numbers */
+    unsigned nbulk;
+
+    struct GpioStats stats;
 };
 
 struct gpio gpio;
 
+static ErrCode set_bulk(const enum GPIO_LEVEL *in);
+
 ErrCode
 GPIO_start(const char *device, const char *consumer)
 {
@@ -51,9 +74,15 @@ void
 GPIO_stop(void)
 {
     if (gpio.handle)  {
+#ifdef DEBUG
+	printf("GPIO: %lu writes, %lu elided, %lu syscalls\n",
+	       gpio.stats.writes, gpio.stats.elided, gpio.stats.syscalls);
+#endif
 	gpiod_chip_close(gpio.handle);
 	gpio.handle = NULL;
     }
+    memset(gpio.line, 0, sizeof gpio.line);
+    gpio.nbulk = 0;
     
     return;
 }
@@ -73,6 +102,23 @@ GPIO_reserve_input(unsigned line)
 	? E_GPIO : SUCCESS;
 }
 
+/* Reserves an input that also reports falling edges, so
+   GPIO_wait_low() can sleep until the line drops rather than poll */
+ErrCode
+GPIO_reserve_input_falling(unsigned line)
+{
+    if (!gpio.handle || line >= LINE_MAX)
+	return E_INIT;
+
+    gpio.line[line].handle = gpiod_chip_get_line(gpio.handle, line);
+    if (!gpio.line[line].handle)
+	return E_IO;
+
+    return gpiod_line_request_falling_edge_events(gpio.line[line].handle,
+						  gpio.consumer) == -1
+	? E_GPIO : SUCCESS;
+}
+
 /* Select the gpio pin from a line number and set the output to the
    default level */
 ErrCode
@@ -86,6 +132,8 @@ GPIO_reserve_output(unsigned line, enum GPIO_LEVEL initial)
 	return E_IO;
 
     gpio.line[line].default_level = initial;
+    gpio.line[line].level = initial;
+    gpio.line[line].bulk  = 0;
 
     return gpiod_line_request_output(gpio.line[line].handle,
 				     gpio.consumer, 
@@ -93,25 +141,103 @@ GPIO_reserve_output(unsigned line, enum GPIO_LEVEL initial)
 	? E_GPIO : SUCCESS;
 }
 
+/* Reserves n outputs as one request, so GPIO_write_bulk() can set
+   them all in a single call. Only one bulk request can be made. */
+ErrCode
+GPIO_reserve_output_bulk(const unsigned *line, const enum GPIO_LEVEL *initial,
+			 unsigned n)
+{
+    struct line *l;
+    int          value[BULK_MAX];
+    unsigned     i;
+
+    if (!gpio.handle || gpio.nbulk || n > BULK_MAX)
+	return E_INIT;
+
+    gpiod_line_bulk_init(&gpio.bulk);
+    for (i=0; i<n; ++i) {
+	if (line[i] >= LINE_MAX)
+	    return E_INIT;
+	l = gpio.line + line[i];
+	l->handle = gpiod_chip_get_line(gpio.handle, line[i]);
+	if (!l->handle)
+	    return E_IO;
+	gpiod_line_bulk_add(&gpio.bulk, l->handle);
+
+	l->default_level = l->level = initial[i];
+	l->bulk          = i + 1;
+	gpio.bulk_line[i] = line[i];
+	value[i]          = initial[i] != GPIO_LEVEL_Low;
+    }
+    gpio.nbulk = n;
+
+    return gpiod_line_request_bulk_output(&gpio.bulk, gpio.consumer,
+					  value) == -1
+	? E_GPIO : SUCCESS;
+}
+
+/* Sets an output, unless it was already left at that level */
 ErrCode
 GPIO_write(unsigned line, enum GPIO_LEVEL in)
 {
+    enum GPIO_LEVEL level[BULK_MAX];
+    struct line    *l = gpio.line + line;
+    unsigned        i;
+
     if (!gpio.handle)
 	return E_INIT;
 
-    return gpiod_line_set_value(gpio.line[line].handle, in)
-	? E_GPIO : SUCCESS;
+    ++gpio.stats.writes;
+    if (l->level == (int)in) {
+	++gpio.stats.elided;
+	return SUCCESS;
+    }
+
+    if (l->bulk) {		/* others in the request keep their level */
+	for (i=0; i<gpio.nbulk; ++i)
+	    level[i] = gpio.line[gpio.bulk_line[i]].level;
+	level[l->bulk - 1] = in;
+	return set_bulk(level);
+    }
+
+    ++gpio.stats.syscalls;
+    if (gpiod_line_set_value(l->handle, in)) {
+	l->level = -1;
+	return E_GPIO;
+    }
+    l->level = in;
+
+    return SUCCESS;
 }
 
+/* Sets an output to its default level. Always written, to bring a
+   line back in step if something else may have changed it. */
 ErrCode
 GPIO_write_default(unsigned line)
 {
     if (!gpio.handle)
 	return E_INIT;
 
-   return gpiod_line_set_value(gpio.line[line].handle,
-			       gpio.line[line].default_level)
-	? E_GPIO : SUCCESS;
+    gpio.line[line].level = -1;
+
+    return GPIO_write(line, gpio.line[line].default_level);
+}
+
+ErrCode
+GPIO_write_bulk(const enum GPIO_LEVEL *in)
+{
+    unsigned i;
+
+    if (!gpio.handle || !gpio.nbulk)
+	return E_INIT;
+
+    ++gpio.stats.writes;
+    for (i=0; i<gpio.nbulk; ++i)
+	if (gpio.line[gpio.bulk_line[i]].level != (int)in[i])
+	    return set_bulk(in);
+
+    ++gpio.stats.elided;
+    return SUCCESS;
 }
 
 ErrCode
@@ -120,6 +246,7 @@ GPIO_read(unsigned line, enum GPIO_LEVEL *out)
     if (!gpio.handle)
 	return E_INIT;
 
+    ++gpio.stats.syscalls;
     int res = gpiod_line_get_value(gpio.line[line].handle);
     if (res == -1)
 	return E_GPIO;
@@ -129,6 +256,58 @@ GPIO_read(unsigned line, enum GPIO_LEVEL *out)
     return SUCCESS;
 }
 
+/* Waits up to timeout_ms for a line reserved with
+   GPIO_reserve_input_falling() to read low. Edges queued before the
+   call, e.g. from an earlier busy period, only cause the level to be
+   read again. Returns E_BUSY on timeout, E_SIG if interrupted. */
+ErrCode
+GPIO_wait_low(unsigned line, unsigned timeout_ms)
+{
+    struct gpiod_line_event event;
+    struct timespec         now, end, left;
+    int                     res;
+
+    if (!gpio.handle)
+	return E_INIT;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec  += timeout_ms / 1000;
+    end.tv_nsec += timeout_ms % 1000 * 1000000L;
+    if (end.tv_nsec >= NS_PER_S) {
+	++end.tv_sec;
+	end.tv_nsec -= NS_PER_S;
+    }
+
+    for (;;) {
+	++gpio.stats.syscalls;
+	res = gpiod_line_get_value(gpio.line[line].handle);
+	if (res == -1)
+	    return E_GPIO;
+	if (res == 0)
+	    return SUCCESS;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left.tv_sec  = end.tv_sec - now.tv_sec;
+	left.tv_nsec = end.tv_nsec - now.tv_nsec;
+	if (left.tv_nsec < 0) {
+	    --left.tv_sec;
+	    left.tv_nsec += NS_PER_S;
+	}
+	if (left.tv_sec < 0)
+	    return E_BUSY;
+
+	++gpio.stats.syscalls;
+	res = gpiod_line_event_wait(gpio.line[line].handle, &left);
+	if (res == -1)
+	    return errno == EINTR ? E_SIG : E_GPIO;
+	if (res == 1) {
+	    ++gpio.stats.syscalls;
+	    if (gpiod_line_event_read(gpio.line[line].handle, &event))
+		return E_GPIO;
+	}
+    }
+}
+
 void
 GPIO_dump(void)
 {
@@ -141,3 +320,33 @@ GPIO_dump(void)
 #endif
     return;
 }
+
+void
+GPIO_stats(struct GpioStats *out)
+{
+    *out = gpio.stats;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Writes every line of the bulk request in one call */
+static ErrCode
+set_bulk(const enum GPIO_LEVEL *in)
+{
+    int      value[BULK_MAX];
+    unsigned i;
+
+    for (i=0; i<gpio.nbulk; ++i)
+	value[i] = in[i] != GPIO_LEVEL_Low;
+
+    ++gpio.stats.syscalls;
+    if (gpiod_line_set_value_bulk(&gpio.bulk, value)) {
+	for (i=0; i<gpio.nbulk; ++i)
+	    gpio.line[gpio.bulk_line[i]].level = -1;
+	return E_GPIO;
+    }
+    for (i=0; i<gpio.nbulk; ++i)
+	gpio.line[gpio.bulk_line[i]].level = in[i];
+
+    return SUCCESS;
+}
@@ -18,11 +18,18 @@ ErrCode GPIO_start(const char *device, const char *consumer);
 void GPIO_stop(void);
 
 ErrCode GPIO_reserve_input(unsigned line);
+ErrCode GPIO_reserve_input_falling(unsigned line);
 ErrCode GPIO_reserve_output(unsigned line, enum GPIO_LEVEL initial);
+ErrCode GPIO_reserve_output_bulk(const unsigned *line,
+				 const enum GPIO_LEVEL *initial, unsigned n);
 
 ErrCode GPIO_write(unsigned line, enum GPIO_LEVEL in);
 ErrCode GPIO_write_default(unsigned line);
+/* Sets every line reserved by GPIO_reserve_output_bulk(), in order */
+ErrCode GPIO_write_bulk(const enum GPIO_LEVEL *in);
 ErrCode GPIO_read(unsigned line, enum GPIO_LEVEL *out);
+ErrCode GPIO_wait_low(unsigned line, unsigned timeout_ms);
 
 /* Prints active line information if DEBUG is defined */
 void GPIO_dump(void);
+void GPIO_stats(struct GpioStats *out);
@@ -0,0 +1,264 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* layout.c - lays out pages as display lists and renders them.
+
+   Laying out a page decodes text from the book, looks up glyphs and
+   wraps lines, producing a display list: the unique glyphs used on
+   the page and runs of glyph ids, each run starting at a pen
+   position and advancing along the line by glyph width. The book
+   positions of the start of the page and of the next page are
+   recorded with it.
+
+   Rendering only blits the display list into a framebuffer, so a
+   page can be laid out for pagination without drawing it, or laid
+   out once and drawn later, into any framebuffer.
+
+   A display list and its glyph bitmaps are carved from an arena
+   sized for the fullest possible page, one narrow glyph in every
+   cell, and reset when the next page is laid out. */
+
+#include <stdio.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "layout.h"
+#include "arena.h"
+#include "book.h"
+#include "unifont.h"
+#include "epd.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define LINE_HEIGHT       16	/* unifont glyphs are 16px high */
+#define GLYPH_MIN_WIDTH   8	/* narrowest unifont glyph */
+#define ARENA_SLACK       256	/* alignment padding */
+
+static ErrCode  reset_list(struct DisplayList *list, struct Point paper);
+static ErrCode  find_glyph(struct DisplayList *list, struct Unifont *font,
+			   unicode codepoint, uint16_t *id);
+static ErrCode  push_glyph(struct DisplayList *list, uint16_t id,
+			   struct Point pen, int newrun);
+
+/* Lays out a page from the book's current position, starting at the
+   top left, leaving the book positioned at the start of the next
+   page. Returns E_EOF if the book has no more text. */
+ErrCode
+layout_page(struct Book *book, struct Unifont *font, struct Point paper,
+	    struct DisplayList *out)
+{
+    ErrCode       status;
+    struct Point  pen = { 0, 0 };
+    struct Raster *r;
+    unicode       codepoint;
+    uint16_t      id;
+    int           newrun = 1;
+
+    TRACE_BEGIN(TRACE_LAYOUT);
+    status = reset_list(out, paper);
+    if (status)
+	goto err;
+    out->start = book_tell(book);
+    if (out->start == -1) {
+	status = E_IO;
+	goto err;
+    }
+
+    for (;;) {
+	status = book_get_codepoint(book, &codepoint);
+	if (status == E_EOF && out->start != book_tell(book)) {
+	    status = SUCCESS;
+	    break;		/* last page */
+	} else if (status) {
+	    goto err;
+	}
+
+	if (codepoint == '\n') {   /* line break */
+	    pen.x  = 0;
+	    pen.y += LINE_HEIGHT;
+	    newrun = 1;
+	    if (pen.y + LINE_HEIGHT > paper.y)
+		break;
+	    continue;
+	} else if (codepoint == '\r') {
+	    continue;
+	}
+
+	status = find_glyph(out, font, codepoint, &id);
+	if (status)
+	    goto err;
+	r = &out->glyph[id].render;
+
+	/*  Check space for glyph before writing */
+	if (pen.x + r->size.x > paper.x) { /* wrap */
+	    pen.y += r->size.y;
+	    pen.x  = 0;
+	    newrun = 1;
+	}
+	if (pen.y + r->size.y > paper.y) { /* page full */
+	    status = book_unget_codepoint(book, codepoint);
+	    if (status)
+		goto err;
+	    break;
+	}
+
+	status = push_glyph(out, id, pen, newrun);
+	if (status)
+	    goto err;
+	newrun = 0;
+	pen.x += r->size.x;
+    }
+
+    out->end = book_tell(book);
+    if (out->end == -1)
+	status = E_IO;
+
+ err:
+    TRACE_END_N(TRACE_LAYOUT, out->nid);
+    return status;
+}
+
+/* Frees every allocation held by a display list */
+void
+layout_free(struct DisplayList *tofree)
+{
+    arena_free(&tofree->arena);
+
+    tofree->glyph  = NULL;
+    tofree->id     = NULL;
+    tofree->run    = NULL;
+    tofree->cap    = 0;
+    tofree->nglyph = tofree->nid = tofree->nrun = 0;
+}
+
+/* Clears a framebuffer and draws every run of the display list.
+   Glyph bits are ink, so they are cleared from the white page. */
+ErrCode
+layout_render(const struct DisplayList *page, byte *fb)
+{
+    ErrCode             status;
+    const struct Run   *run;
+    const struct Glyph *g;
+    struct Point        pen;
+    size_t              i, j;
+
+    TRACE_BEGIN(TRACE_BLIT);
+    status = epd_buffer_clear(fb);
+    if (status)
+	goto err;
+
+    for (i=0, run=page->run; i<page->nrun; ++i, ++run) {
+	pen = run->origin;
+	for (j=0; j<run->n; ++j) {
+	    g = page->glyph + page->id[run->first + j];
+	    status = epd_buffer_blit(fb, &g->render, pen, BLIT_ANDNOT);
+	    if (status)
+		goto err;
+	    pen.x += g->render.size.x;
+	}
+    }
+
+ err:
+    TRACE_END(TRACE_BLIT);
+    return status;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Empties a display list and sizes it for a page of paper. The
+   arena is allocated the first time, or if the paper grows. A glyph
+   that doesn't fit is looked up before the page is found full, so
+   there is room for one more glyph than cells. */
+static ErrCode
+reset_list(struct DisplayList *list, struct Point paper)
+{
+    ErrCode status;
+    size_t  cells, need;
+
+    cells = (paper.x / GLYPH_MIN_WIDTH) * (paper.y / LINE_HEIGHT);
+    need  = (cells+1) * (sizeof *list->glyph + UNIFONT_BITMAP_LEN)
+	+ cells * (sizeof *list->id + sizeof *list->run) + ARENA_SLACK;
+
+    if (list->arena.cap < need) {
+	arena_free(&list->arena);
+	status = arena_init(&list->arena, need);
+	if (status)
+	    return status;
+    }
+    arena_reset(&list->arena);
+
+    list->cap   = cells;
+    list->glyph = arena_alloc(&list->arena, (cells+1) * sizeof *list->glyph);
+    list->id    = arena_alloc(&list->arena, cells * sizeof *list->id);
+    list->run   = arena_alloc(&list->arena, cells * sizeof *list->run);
+    if (!list->glyph || !list->id || !list->run)
+	return E_MEM;
+
+    list->nglyph = list->nid = list->nrun = 0;
+    list->start  = list->end = -1;
+    return SUCCESS;
+}
+
+/* Returns the id of a codepoint's glyph on this page, rendering it
+   from the font the first time it is used. Codepoints missing from
+   the font are drawn as the replacement character. */
+static ErrCode
+find_glyph(struct DisplayList *list, struct Unifont *font, unicode codepoint, uint16_t *id)
+{
+    ErrCode       status;
+    struct Glyph *g;
+    size_t        i;
+
+    for (i=0; i<list->nglyph; ++i)
+	if (list->glyph[i].codepoint == codepoint) {
+	    metrics_add(METRIC_GLYPH_HITS, 1);
+	    *id = i;
+	    return SUCCESS;
+	}
+
+    if (list->nglyph > list->cap)
+	return E_OVERFLOW;
+
+    g = list->glyph + list->nglyph;
+    g->codepoint = codepoint;
+    g->render.bitmap = arena_alloc(&list->arena, UNIFONT_BITMAP_LEN);
+    if (!g->render.bitmap)
+	return E_MEM;
+    metrics_add(METRIC_GLYPH_MISSES, 1);
+    TRACE_BEGIN(TRACE_GLYPH);
+    status = unifont_render(font, g);
+    if (status == E_MISSINGCHAR) {
+	metrics_add(METRIC_FONT_MISSING, 1);
+	g->codepoint = CODEPOINT_INVALID_CHAR;
+	status = unifont_render(font, g);
+	g->codepoint = codepoint;
+    }
+    TRACE_END_N(TRACE_GLYPH, codepoint);
+    if (status)
+	return status;
+
+    *id = list->nglyph++;
+    return SUCCESS;
+}
+
+/* Appends a glyph id to the current run, or to a new run at pen */
+static ErrCode
+push_glyph(struct DisplayList *list, uint16_t id, struct Point pen, int newrun)
+{
+    if (list->nid == list->cap)
+	return E_OVERFLOW;	/* more glyphs than cells */
+
+    if (newrun || list->nrun == 0) {
+	list->run[list->nrun].origin = pen;
+	list->run[list->nrun].first  = list->nid;
+	list->run[list->nrun].n      = 0;
+	++list->nrun;
+    }
+
+    list->id[list->nid++] = id;
+    ++list->run[list->nrun-1].n;
+
+    return SUCCESS;
+}
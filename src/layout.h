@@ -0,0 +1,21 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* layout.h - lays out pages as display lists and renders them */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "err.h"
+#include "oku.h"
+
+/* Layout: book text to glyph positions, no pixels touched */
+ErrCode layout_page(struct Book *book, struct Unifont *font,
+		    struct Point paper, struct DisplayList *out);
+void    layout_free(struct DisplayList *tofree);
+
+/* Render: glyph positions to an epd framebuffer */
+ErrCode layout_render(const struct DisplayList *page, byte *fb);
+
+#endif	/* LAYOUT_H */
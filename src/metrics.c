@@ -0,0 +1,345 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* metrics.c - per thread counters and the socket serving them.
+
+   Each thread counting is given a block of counters of its own, a
+   cache line apart from the others, the first time it counts. Only
+   that thread writes its block, with relaxed atomic stores, so a
+   snapshot can read every block while they are being counted into.
+   Threads past METRICS_THREADS share a last block, added to with
+   atomic read-modify-writes.
+
+   Latencies are histograms of counts of observations up to each of
+   bucket_ms, cumulative when written out as Prometheus expects, and
+   the sum of the observations.
+
+   The server thread waits on the listening socket, sends each client
+   a snapshot and closes the connection. Nothing is read from
+   clients. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "metrics.h"
+
+#define METRICS_THREADS   8	/* with blocks of their own */
+#define METRICS_BACKLOG   4
+#define CACHE_LINE        64
+
+static const char *metric_name[METRIC_N] = {
+    "page_turns", "pages_turned", "refreshes", "refreshes_cancelled",
+    "spi_bytes", "spi_transfers", "glyph_hits", "glyph_misses",
+    "font_missing", "bookmark_writes"
+};
+static const char *hist_name[METRIC_HIST_N] = { "turn_ms", "refresh_ms" };
+
+static const double bucket_ms[] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+#define NBUCKET           (sizeof bucket_ms / sizeof *bucket_ms)
+
+struct MetricBlock {
+    _Alignas(CACHE_LINE)
+    atomic_ulong      count[METRIC_N];
+    atomic_ulong      bucket[METRIC_HIST_N][NBUCKET+1]; /* last is +Inf */
+    atomic_ulong      sum_us[METRIC_HIST_N];
+};
+
+struct MetricServer {
+    pthread_t         thread;
+    int               running;
+    int               fd;	/* listening socket */
+    int               quit;	/* eventfd: stop serving */
+    char              path[sizeof ((struct sockaddr_un *)0)->sun_path];
+};
+
+static struct MetricBlock  block[METRICS_THREADS+1]; /* last is shared */
+static atomic_int          nblock;
+static atomic_size_t       heap_peak;
+static struct MetricServer server = { .fd = -1, .quit = -1 };
+
+static _Thread_local struct MetricBlock *mine;
+
+static void               *serve(void *arg);
+static void                send_snapshot(int fd);
+static struct MetricBlock *my_block(void);
+static void                bump(atomic_ulong *counter, unsigned long n);
+static size_t              heap_in_use(void);
+
+/* Listens on a Unix socket at path, replacing a socket left there
+   by an earlier run, and starts the thread serving it */
+ErrCode
+metrics_start(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat        st;
+    sigset_t           all, old;
+    int                res;
+
+    if (server.running)
+	return E_INIT;
+    if (strlen(path) >= sizeof addr.sun_path)
+	return E_ARG;
+    strcpy(addr.sun_path, path);
+
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+	unlink(path);
+    err_clear_errno();		/* ENOENT if there was nothing to replace */
+    server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.fd == -1)
+	return E_INIT;
+    if (bind(server.fd, (struct sockaddr *)&addr, sizeof addr))
+	return E_PATH;
+    strcpy(server.path, path);
+    if (listen(server.fd, METRICS_BACKLOG))
+	return E_INIT;
+
+    server.quit = eventfd(0, EFD_CLOEXEC);
+    if (server.quit == -1)
+	return E_INIT;
+
+    /* blocked in the server so a SIGINT can't land in its accept()
+       and is left to interrupt the main thread's wait for input */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&server.thread, NULL, serve, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res)
+	return E_INIT;
+    server.running = 1;
+
+    return SUCCESS;
+}
+
+/* Stops serving and removes the socket */
+void
+metrics_stop(void)
+{
+    uint64_t one = 1;
+
+    if (server.running) {
+	if (write(server.quit, &one, sizeof one) != sizeof one)
+	    err_print(E_IO);
+	pthread_join(server.thread, NULL);
+	server.running = 0;
+    }
+
+    if (server.fd != -1)
+	close(server.fd);
+    if (server.quit != -1)
+	close(server.quit);
+    if (server.path[0])
+	unlink(server.path);
+    server.fd = server.quit = -1;
+    server.path[0] = '\0';
+}
+
+void
+metrics_add(enum METRIC metric, unsigned long n)
+{
+    bump(&my_block()->count[metric], n);
+}
+
+void
+metrics_observe(enum METRIC_HIST hist, double ms)
+{
+    struct MetricBlock *b = my_block();
+    size_t              i;
+
+    for (i=0; i<NBUCKET && ms > bucket_ms[i]; ++i)
+	;
+    bump(&b->bucket[hist][i], 1);
+    bump(&b->sum_us[hist], ms > 0 ? ms * 1000 : 0);
+}
+
+double
+metrics_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void
+metrics_heap(void)
+{
+    size_t now = heap_in_use(), peak = atomic_load(&heap_peak);
+
+    while (now > peak && !atomic_compare_exchange_weak(&heap_peak, &peak, now))
+	;
+}
+
+/* Sums every block, the shared one too, and writes the totals.
+   Counters are read one at a time while threads count, so totals
+   may be a count or two apart from each other, never torn. */
+void
+metrics_write(FILE *out)
+{
+    unsigned long  count[METRIC_N] = { 0 };
+    unsigned long  bucket[METRIC_HIST_N][NBUCKET+1] = { { 0 } };
+    unsigned long  sum_us[METRIC_HIST_N] = { 0 }, n, lookups;
+    struct rusage  ru;
+    int            b, i;
+    size_t         j;
+
+    for (b=0; b<=METRICS_THREADS; ++b) { /* unclaimed blocks are 0 */
+	for (i=0; i<METRIC_N; ++i)
+	    count[i] += atomic_load_explicit(&block[b].count[i],
+					     memory_order_relaxed);
+	for (i=0; i<METRIC_HIST_N; ++i) {
+	    for (j=0; j<=NBUCKET; ++j)
+		bucket[i][j] += atomic_load_explicit(&block[b].bucket[i][j],
+						     memory_order_relaxed);
+	    sum_us[i] += atomic_load_explicit(&block[b].sum_us[i],
+					      memory_order_relaxed);
+	}
+    }
+
+    for (i=0; i<METRIC_N; ++i)
+	fprintf(out, "# TYPE oku_%s_total counter\noku_%s_total %lu\n",
+		metric_name[i], metric_name[i], count[i]);
+
+    lookups = count[METRIC_GLYPH_HITS] + count[METRIC_GLYPH_MISSES];
+    fprintf(out, "# TYPE oku_glyph_hit_ratio gauge\noku_glyph_hit_ratio %.4f\n",
+	    lookups ? (double)count[METRIC_GLYPH_HITS] / lookups : 0.0);
+
+    metrics_heap();
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "# TYPE oku_heap_bytes gauge\noku_heap_bytes %zu\n"
+	    "# TYPE oku_heap_peak_bytes gauge\noku_heap_peak_bytes %zu\n"
+	    "# TYPE oku_rss_peak_bytes gauge\noku_rss_peak_bytes %ld\n",
+	    heap_in_use(), atomic_load(&heap_peak), ru.ru_maxrss * 1024);
+
+    for (i=0; i<METRIC_HIST_N; ++i) {
+	fprintf(out, "# TYPE oku_%s histogram\n", hist_name[i]);
+	for (j=0, n=0; j<=NBUCKET; ++j) {
+	    n += bucket[i][j];
+	    if (j < NBUCKET)
+		fprintf(out, "oku_%s_bucket{le=\"%g\"} %lu\n", hist_name[i],
+			bucket_ms[j], n);
+	    else
+		fprintf(out, "oku_%s_bucket{le=\"+Inf\"} %lu\n", hist_name[i], n);
+	}
+	fprintf(out, "oku_%s_sum %.3f\noku_%s_count %lu\n", hist_name[i],
+		sum_us[i] / 1e3, hist_name[i], n);
+    }
+}
+
+/* STATIC FUNCTIONS */
+
+static void *
+serve(void *arg)
+{
+    struct pollfd fds[2] = {
+	{ .fd = server.fd,   .events = POLLIN },
+	{ .fd = server.quit, .events = POLLIN }
+    };
+    int           client;
+
+    (void)arg;
+
+    for (;;) {
+	if (poll(fds, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (fds[1].revents)
+	    break;
+
+	client = accept(server.fd, NULL, NULL);
+	if (client == -1)
+	    continue;
+	send_snapshot(client);
+	close(client);
+    }
+
+    return NULL;
+}
+
+/* Writes a snapshot to a client, giving up if it hangs up */
+static void
+send_snapshot(int fd)
+{
+    char   *text = NULL;
+    size_t  len = 0, off;
+    ssize_t n;
+    FILE   *out;
+
+    out = open_memstream(&text, &len);
+    if (!out)
+	return;
+    metrics_write(out);
+    if (fclose(out))
+	goto err;
+
+    for (off=0; off<len; off+=n) {
+	n = send(fd, text+off, len-off, MSG_NOSIGNAL);
+	if (n <= 0)
+	    break;
+    }
+
+ err:
+    free(text);
+}
+
+/* The calling thread's block, claimed the first time */
+static struct MetricBlock *
+my_block(void)
+{
+    int i;
+
+    if (!mine) {
+	i = atomic_fetch_add(&nblock, 1);
+	mine = block + (i < METRICS_THREADS ? i : METRICS_THREADS);
+    }
+
+    return mine;
+}
+
+/* Adds n to a counter of the calling thread's block */
+static void
+bump(atomic_ulong *counter, unsigned long n)
+{
+    if (mine == block + METRICS_THREADS)
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+    else
+	atomic_store_explicit(counter, n +
+			      atomic_load_explicit(counter, memory_order_relaxed),
+			      memory_order_relaxed);
+}
+
+/* Bytes malloc has handed out and not had back */
+static size_t
+heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;
+#else
+    struct mallinfo mi = mallinfo();	/* wraps past 2GiB */
+
+    return (unsigned)mi.uordblks + (unsigned)mi.hblkhd;
+#endif
+}
@@ -0,0 +1,59 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* metrics.h - running counters, served as text over a Unix socket.
+
+   Counters are kept per thread and only written by their thread, so
+   counting is a load and a store, no lock or atomic read-modify-
+   write. A snapshot adds up every thread's counters; each client
+   connecting to the socket is sent one, in the Prometheus text
+   format, e.g.
+
+       socat - UNIX-CONNECT:oku.metrics                              */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "err.h"
+
+/* names are in metrics.c */
+enum METRIC {
+    METRIC_PAGE_TURNS,		/* key presses turning pages */
+    METRIC_PAGES_TURNED,	/* pages moved, several for a burst */
+    METRIC_REFRESHES,		/* frames put on the panel */
+    METRIC_REFRESHES_CANCELLED,	/* overtaken by a newer frame */
+    METRIC_SPI_BYTES,
+    METRIC_SPI_TRANSFERS,	/* messages, i.e. ioctl()s on a Pi */
+    METRIC_GLYPH_HITS,		/* glyph already on the page */
+    METRIC_GLYPH_MISSES,	/* glyph looked up in the font */
+    METRIC_FONT_MISSING,	/* codepoints not in the font */
+    METRIC_BOOKMARK_WRITES,
+    METRIC_N
+};
+
+/* latencies, in ms */
+enum METRIC_HIST {
+    METRIC_TURN_MS,		/* key read to frame queued */
+    METRIC_REFRESH_MS,		/* epd_refresh_frame() */
+    METRIC_HIST_N
+};
+
+/* Serves snapshots on a socket at path, from a thread of its own */
+ErrCode metrics_start(const char *path);
+void    metrics_stop(void);
+
+void    metrics_add(enum METRIC metric, unsigned long n);
+void    metrics_observe(enum METRIC_HIST hist, double ms);
+/* Monotonic clock, in ms, for timing latencies */
+double  metrics_ms(void);
+/* Notes the heap in use, for its peak. Takes malloc's locks, so is
+   for once a page, not inner loops. */
+void    metrics_heap(void);
+
+/* Writes a snapshot of every counter to out */
+void    metrics_write(FILE *out);
+
+#endif	/* METRICS_H */
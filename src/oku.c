@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "oku.h"
 #include "err.h"
@@ -13,14 +14,26 @@
 #include "epd.h"
 #include "book.h"
 #include "unifont.h"
+#include "layout.h"
+#include "prerender.h"
+#include "pagecache.h"
+#include "display.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "metrics.h"
 
 #define DEFAULT_BOOK       "book.utf8"
 #define DEFAULT_FONT       "unifont.hex"
+#define DEFAULT_CHANGED    100	/* % of pixels changed before a full refresh */
+#define DEFAULT_IDLE       30	/* s without a refresh before deep sleep */
+#define DEFAULT_METRICS    "oku.metrics" /* socket, see metrics.h */
+#define TRACE_FILE         "oku.trace.json" /* written on exit, see trace.h */
+#define USAGE              "USAGE: oku [-l] [-p partials] [-c percent] [-s idle] [-m socket] [filename]"
 
 /*
   Powers down device safely on error (see err.h). 
 */
-#define ERR_CHECK(S) do { if(S) die(S); } while(0)
+#define ERR_CHECK(S) do { ErrCode s_ = (S); if(s_) die(s_); } while(0)
 /*
   Forward Declarations
 */
@@ -28,8 +41,14 @@ ErrCode   catch_sig(struct sigaction *h);
 void      handle_sig(int signum);
 void      die(ErrCode status);
 ErrCode   page_fward(void);
-ErrCode   page_bward(void);
-void      pen_print(void);
+ErrCode   page_ahead(int n);
+ErrCode   page_back(int n);
+ErrCode   page_measure(void);
+ErrCode   page_redraw(void);
+ErrCode   page_resume(long shown);
+void      page_prerender(int direction);
+int       input_read(int *turn);
+int       input_pending(void);
 /*
   Signal handler is event loop condition
 */
@@ -38,10 +57,12 @@ volatile sig_atomic_t sig;
   Interface objects
 */
 struct Book         book;	    /* text file */
-struct Point        pen, paper;     /* epd cursor, limits  */
+struct Point        paper;	    /* epd limits  */
 struct Unifont      font;	    /* unifont file and cache */
-struct Glyph        glyph;	    /* single rendered character */
+struct DisplayList  page;	    /* layout of the page on screen */
 struct Bookmarks    pages;	    /* file position log */
+struct PageCache    cache;	    /* recently rendered pages */
+int                 onscreen;	    /* framebuffer holds the page shown */
 
 /* Callback when SIGINT received, sigint  */
 void
@@ -67,9 +88,19 @@ catch_sig(struct sigaction *h)
 void
 die(ErrCode status)
 {
+    if (!status && onscreen && pages.n)
+	err_print(snapshot_save(book.fhash, paper,
+				pages.n > 1 ? pages.stack[pages.n-2] : 0,
+				epd_buffer(), epd_buffer_len()));
+    display_stop();
+    prerender_stop();
+    metrics_stop();
+    pagecache_free(&cache);
     err_print(epd_stop());
+    err_print(TRACE_DUMP(TRACE_FILE)); /* every thread stopped */
 
     bookmarks_close(&pages);
+    layout_free(&page);
     unifont_close(&font);
     book_close(&book);
 
@@ -77,62 +108,212 @@ die(ErrCode status)
     exit(status);
 }
 
-/* Display next page on epd  */
+/* Display next page on epd. Swaps in a page rendered in the
+   background if there is one, a framebuffer swap rather than a copy,
+   or unpacks it from the page cache, laying the page out if neither
+   has it. */
 ErrCode
 page_fward(void)
 {
+    ErrCode status;
+    long    start, end;
+
     puts("\nMoving forward one page");
-    while(!sig) {
+    start = book_tell(&book);
+    if (prerender_take(start, &end)
+	|| pagecache_get(&cache, book.fhash, start, &end,
+			 epd_buffer(), epd_buffer_len()))
+	return book_seek(&book, end);
 
-	/* Load the bitmap of the next character in the book*/
-	ERR_CHECK( book_get_codepoint(&book, &glyph.codepoint));
-	ERR_CHECK( unifont_render(&font, &glyph));
+    status = layout_page(&book, &font, paper, &page);
+    if (status)
+	return status;
+    status = layout_render(&page, epd_buffer());
+    if (status)
+	return status;
 
-	/*  Check space for glyph before writing */
-	if (pen.x+glyph.render.size.x > paper.x) { /* newline */
-	    pen.y += glyph.render.size.y;
-	    pen.x  = 0;
-	}
-	if (pen.y+glyph.render.size.y > paper.y) { /* page full */
-	    free(glyph.render.bitmap); 
-	    ERR_CHECK( book_unget_codepoint(&book, glyph.codepoint));
-	    break;
-	}
-	pen_print();
+    return pagecache_put(&cache, book.fhash, page.start, page.end,
+			 epd_buffer(), epd_buffer_len());
+}
 
-	/* Write glyph to epd buffer */
-	ERR_CHECK( epd_write(&glyph.render, pen));
+/* Moves forward n pages and displays the last, laying out the pages
+   skipped over without drawing them. Stops early on the last page of
+   the book. Returns E_EOF if already there. */
+ErrCode
+page_ahead(int n)
+{
+    ErrCode status = SUCCESS;
+    int     i;
 
-	/* Increment pen */
-	pen.x += glyph.render.size.x;
-	free(glyph.render.bitmap);
+    printf("\nMoving forward %d page(s)\n", n);
+    for (i=0; i<n; ++i) {
+	status = i < n-1 ? page_measure() : page_fward();
+	if (status == E_EOF)
+	    break;
+	if (status)
+	    return status;
+	ERR_CHECK( bookmarks_push(&book, &pages));
     }
 
-    return SUCCESS;
+    if (i == n)
+	return SUCCESS;
+    if (i == 0)
+	return E_EOF;		/* last page */
+
+    return page_redraw();	/* ran out of book while skipping */
 }
 
-/* Display previous page on epd  */
+/* Moves back n pages and displays the page there, or the first page
+   if there are fewer than n before it. The top of the bookmark stack
+   is the end of the page on screen, the entry below it that page's
+   start. */
 ErrCode
-page_bward(void)
+page_back(int n)
 {
-    puts("\nMoving backwards one page");
-    die(E_TODO);
-    
-    return E_UNREACHABLE;
+    long end;
+    int  i;
+
+    printf("\nMoving backwards %d page(s)\n", n);
+    if (pages.n < 2)
+	return E_EOF;		/* first page */
+    if ((size_t)n > pages.n - 1)
+	n = pages.n - 1;
+
+    for (i=0; i<=n; ++i)
+	ERR_CHECK( bookmarks_pop(&pages, &end));
+    ERR_CHECK( book_seek(&book, pages.n ? pages.stack[pages.n-1] : 0));
+    ERR_CHECK( page_fward());
+
+    return bookmarks_push(&book, &pages);
+}
+
+/* Lays out the next page without drawing it, to find where the page
+   after it starts (see bookmarks_relayout()) */
+ErrCode
+page_measure(void)
+{
+    return layout_page(&book, &font, paper, &page);
+}
+
+/* Draws the page at the top of the bookmark stack again */
+ErrCode
+page_redraw(void)
+{
+    long end, start;
+
+    ERR_CHECK( bookmarks_pop(&pages, &end));
+    start = pages.n ? pages.stack[pages.n-1] : 0;
+
+    ERR_CHECK( book_seek(&book, start));
+    ERR_CHECK( page_fward());
+
+    return bookmarks_push(&book, &pages);
 }
 
-/* Prints epd cursor positions */
+/* Redisplays the page that was on screen when the book was closed.
+   If shown is that page's start its snapshot is on screen already,
+   so the page needn't be laid out again. */
+ErrCode
+page_resume(long shown)
+{
+    long start;
+
+    if (pages.n == 0)
+	return SUCCESS;		/* not read before */
+
+    start = pages.n > 1 ? pages.stack[pages.n-2] : 0;
+    printf("\nResuming from @%ldB", start);
+    if (shown == start) {
+	ERR_CHECK( book_seek(&book, pages.stack[pages.n-1]));
+	page_prerender(1);
+	return SUCCESS;
+    }
+
+    ERR_CHECK( page_redraw());
+    page_prerender(1);
+    onscreen = 1;
+
+    return display_submit(epd_buffer());
+}
+
+/* Asks for the pages either side of the one on screen to be rendered
+   in the background. The top of the bookmark stack is the start of
+   the next page, the third from top the start of the previous one. */
 void
-pen_print(void)
+page_prerender(int direction)
 {
-#ifdef DEBUG
-    printf("Pen: (%03u,%03u) "
-	   "Paper: (%03u,%03u) "
-	   "Glyph: (%03u,%03u)\n",
-	   pen.x, pen.y, paper.x, paper.y,
-	   glyph.render.size.x, glyph.render.size.y);
-#endif
-    return;
+    long prev, next;
+
+    next = pages.n ? pages.stack[pages.n-1] : -1;
+    if (pages.n >= 3)
+	prev = pages.stack[pages.n-3];
+    else
+	prev = pages.n == 2 ? 0 : -1;
+
+    prerender_request(prev, next, direction);
+}
+
+/* Reads keys from stdin, waiting for the first, and adds up the
+   pages they turn: +1 for each next (k), -1 for each previous (j).
+   Keys already queued behind the first are taken too, so a burst of
+   presses becomes one turn of several pages. Refreshes finishing
+   while waiting are collected, so display errors aren't held back
+   until the next key. Returns non zero if the reader quit (q) or
+   input ended. Pages already counted when input ends, or a signal
+   arrives, are returned to be turned first; the end is reported by
+   the next call. */
+int
+input_read(int *turn)
+{
+    struct pollfd in[2] = {
+	{ .fd = STDIN_FILENO,    .events = POLLIN },
+	{ .fd = display_fence(), .events = POLLIN }
+    };
+    static int ended;		/* a terminal's ^D is only read once */
+    char       keys[64];
+    ssize_t    n, i;
+    int        quit = 0;
+
+    *turn = 0;
+    if (ended)
+	return 1;
+    do {
+	if (poll(in, 2, -1) < 0)
+	    return sig != 0;	/* interrupted */
+	if (in[1].revents)
+	    ERR_CHECK( display_collect());
+    } while (!in[0].revents);
+
+    do {
+	n = read(STDIN_FILENO, keys, sizeof keys);
+	if (n == 0) {		/* end of input */
+	    ended = 1;
+	    return !*turn;
+	}
+	if (n < 0)
+	    return sig != 0 && !*turn; /* interrupted */
+
+	for (i=0; i<n; ++i) {
+	    switch (keys[i]) {
+	    case 'j': --*turn;                              break;
+	    case 'k': ++*turn;                              break;
+	    case 'q': quit = 1;                             break;
+	    case ' ': case '\n': case '\r': case '\t':        break;
+	    default:  puts("Unrecognised character.");     break;
+	    }
+	}
+    } while (!quit && input_pending());
+
+    return quit;
+}
+
+/* Non zero if there are keys waiting to be read */
+int
+input_pending(void)
+{
+    struct pollfd in = { .fd = STDIN_FILENO, .events = POLLIN };
+
+    return poll(&in, 1, 0) > 0;
 }
 
 int
@@ -140,41 +321,102 @@ main(int argc, char *argv[])
 {
     struct sigaction    sigint_action; /* signal handler */
     const char         *font_path, *book_path;
+    const char         *metrics_path = DEFAULT_METRICS; /* "" for none */
+    ErrCode             status;
+    int                 turn;	    /* pages to move, -ve backwards */
+    double              t0;	    /* turn started, ms */
+    int                 opt, landscape = 0;
+    int                 idle = DEFAULT_IDLE; /* s, 0 never sleeps */
+    struct RefreshPolicy policy = { 0, DEFAULT_CHANGED };
+    long                shown = -1; /* start of the page snapshot shown */
 
     setbuf(stdout, NULL);	/* disable buffering */
+    TRACE_THREAD("main");
+    pagecache_init(&cache, PAGECACHE_BUDGET);
+
+    while ((opt = getopt(argc, argv, "lp:c:s:m:")) != -1) {
+	switch (opt) {
+	case 'l': landscape = 1;                       break;
+	case 'p': policy.partials = atoi(optarg);      break;
+	case 'c': policy.changed_pct = atoi(optarg);   break;
+	case 's': idle = atoi(optarg);                 break;
+	case 'm': metrics_path = optarg;               break;
+	default:  puts(USAGE);                         return E_ARG;
+	}
+    }
 
-    switch (argc) {
-    case  1:  book_path = DEFAULT_BOOK;          break;
-    case  2:  book_path = argv[1];               break;
-    default:  puts("USAGE: oku [filename]");     return E_ARG;
+    switch (argc - optind) {
+    case  0:  book_path = DEFAULT_BOOK;            break;
+    case  1:  book_path = argv[optind];            break;
+    default:  puts(USAGE);                         return E_ARG;
     }
     
     font_path  = DEFAULT_FONT;
 
     ERR_CHECK( catch_sig(&sigint_action));
+    if (*metrics_path) {
+	status = metrics_start(metrics_path);
+	if (status) {		/* not worth giving up the book for */
+	    fprintf(stderr, "%s: metrics not served\n", metrics_path);
+	    err_print(status);
+	    metrics_stop();
+	}
+    }
     ERR_CHECK( book_open(book_path, &book)); 
-    ERR_CHECK( unifont_open(font_path, &font));
     ERR_CHECK( bookmarks_open(&book, &pages));
 
     ERR_CHECK( epd_start(&paper));
-    ERR_CHECK( epd_clear());
+    epd_refresh_policy(&policy);
+    if (landscape)
+	ERR_CHECK( epd_landscape(&paper));
+
+    /* the page last read goes up while the font loads */
+    onscreen = snapshot_load(book.fhash, paper, &shown,
+			     epd_buffer(), epd_buffer_len());
+    if (!onscreen) {
+	shown = -1;
+	ERR_CHECK( epd_clear());
+    }
+    ERR_CHECK( display_start(idle > 0 ? idle*1000 : 0));
+    if (onscreen)
+	ERR_CHECK( display_submit(epd_buffer()));
+
+    ERR_CHECK( unifont_open(font_path, &font));
+    ERR_CHECK( prerender_start(book_path, font_path, paper, &cache));
 
-    pen.x = pen.y = 0; 		/* start writing at origin top left */
+    ERR_CHECK( bookmarks_relayout(&book, &pages, page_measure));
+    ERR_CHECK( page_resume(shown));
 
     while (!sig) {
 	fputs("Input: next(k) previous(j) quit(q) then ^D... ", stdout);
 
-	switch (getchar()) {
-	case 'j': ERR_CHECK( page_bward());             break;
-	case 'k': ERR_CHECK( page_fward());             break;
-	case 'q': die(SUCCESS);                         break;
-	default:  puts("Unrecognised character.\n");    continue;
-	}
+	if (input_read(&turn))
+	    break;
 
-	ERR_CHECK( bookmarks_push(&book, &pages));
-	ERR_CHECK( epd_refresh()); /* updates epd */
+	if (!turn)
+	    continue;
+
+	TRACE_BEGIN(TRACE_PAGE);
+	t0 = metrics_ms();
+	status = turn > 0 ? page_ahead(turn) : page_back(-turn);
+	if (status == E_EOF) {	/* first or last page */
+	    TRACE_END_N(TRACE_PAGE, 0);
+	    puts("No more pages.");
+	    continue;
+	}
+	ERR_CHECK( status);
+	ERR_CHECK( display_submit(epd_buffer())); /* refreshes in background */
+	TRACE_END_N(TRACE_PAGE, turn > 0 ? turn : -turn);
+	metrics_add(METRIC_PAGE_TURNS, 1);
+	metrics_add(METRIC_PAGES_TURNED, turn > 0 ? turn : -turn);
+	metrics_observe(METRIC_TURN_MS, metrics_ms() - t0);
+	metrics_heap();
+	onscreen = 1;
+	page_prerender(turn);
     } 
 
+    if (!sig)
+	ERR_CHECK( display_sync()); /* last page on screen */
     die(SUCCESS);
     return E_UNREACHABLE;
 }
@@ -8,6 +8,8 @@
 #define OKU_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 /* Useful unicode codepoints */
 #define CODEPOINT_INVALID_CHAR  0x0000FFFD
@@ -32,14 +34,79 @@ struct Glyph {
     struct Raster     render;
 };
 
+struct Run {
+    struct Point      origin;	/* pen position of the first glyph */
+    uint16_t          first;	/* index of the first glyph id */
+    uint16_t          n;	/* glyphs in run, advancing along x */
+};
+
+struct Arena {
+    byte             *base;	/* one block for the whole page */
+    size_t            cap, used; /* bytes in and handed out of block */
+    size_t            high;	/* most bytes used by any page */
+    size_t            nalloc;	/* allocations since last reset */
+};
+
+struct DisplayList {
+    long              start;	/* book position of first character */
+    long              end;	/* book position of next page */
+
+    size_t            cap;	/* most glyphs, ids or runs on a page */
+    size_t            nglyph;	/* glyphs used on the page */
+    struct Glyph     *glyph;	/* indexed by glyph id */
+    size_t            nid;	/* glyph ids in drawing order */
+    uint16_t         *id;
+    size_t            nrun;	/* runs of glyph ids */
+    struct Run       *run;
+
+    struct Arena      arena;	/* all of the above, freed per page */
+};
+
 struct Unifont {
     FILE             *fh;	/* unifont hexfile */
 };
 
+struct Chunk {
+    long              offset;	/* file position of first byte */
+    uint32_t          len;	/* bytes in chunk */
+    uint32_t          hash;	/* content hash */
+};
+
+struct Chunks {
+    checksum          fhash;	/* hash of the chunked file */
+    size_t            n;	/* number of chunks */
+    struct Chunk     *chunk;	/* content defined chunks in file order */
+};
+
+struct ZipEntry {
+    char             *name;	/* path within archive */
+    uint16_t          method;	/* 0 stored, 8 deflated */
+    uint32_t          csize;	/* compressed bytes */
+    uint32_t          usize;	/* uncompressed bytes */
+    uint32_t          offset;	/* local header file position */
+};
+
+struct Epub {
+    FILE             *fh;	/* zip archive */
+    size_t            nentry;	/* central directory */
+    struct ZipEntry  *entry;
+    size_t            nspine;	/* reading order as entry indices */
+    size_t           *spine;
+
+    /* One chapter is held in memory at a time, stripped to text */
+    size_t            chapter;	/* spine index of loaded chapter */
+    byte             *text;	/* UTF-8 text of chapter */
+    size_t            len, cap;	/* text length and buffer size */
+    size_t            cursor;	/* read position in text */
+};
+
 struct Book {
     checksum          fhash;	/* book file hash */
+    checksum          phash;	/* book path hash */
     size_t            len;	/* file length in bytes  */
     FILE             *fh; 	/* file handle */
+    struct Chunks     chunks;	/* content defined chunks of fh */
+    struct Epub      *epub;	/* NULL unless fh is an EPUB */
 };
 
 struct Bookmarks {
@@ -49,6 +116,86 @@ struct Bookmarks {
     /* The following fields are recorded in fh above  */
     size_t            n, len;	/* entries and buffer length B  */
     long             *stack;	/* file position records */
+
+    size_t            stale;	/* first entry invalidated by an edit */
+};
+
+struct GpioStats {
+    unsigned long     writes;	/* GPIO_write() and _bulk() calls */
+    unsigned long     elided;	/* writes that changed nothing */
+    unsigned long     syscalls;	/* line reads, writes and waits */
+};
+
+struct Panel {			/* see panel.h and epd.c */
+    const char       *name;
+    struct Point      size;	/* px, as the controller scans */
+    int               ram_x_px;	/* RAM x addressed in px, not bytes */
+    int               soft_reset; /* SW_RESET before the init table */
+    const byte       *init;	/* command tables */
+    size_t            init_len;
+    const byte       *refresh;
+    size_t            refresh_len;
+    const byte       *lut_full;	/* NULL: waveform from OTP */
+    const byte       *lut_partial; /* NULL: full refreshes only */
+};
+
+struct RefreshPolicy {
+    unsigned          partials;	/* partial refreshes between full ones */
+    unsigned          changed_pct; /* or until this % of pixels changed */
+};
+
+struct Band {			/* rows y0..y1, bytes x0..x1 of a frame */
+    coordinate        y0, y1;
+    coordinate        x0, x1;
+};
+
+struct EpdStats {
+    unsigned long     refreshes;
+    unsigned long     bands;	/* RAM windows written */
+    unsigned long     sent;	/* framebuffer bytes transmitted */
+    unsigned long     saved;	/* bytes left out as unchanged */
+    unsigned long     sleeps;	/* deep sleeps after idling */
+    unsigned long     wakes;
+    unsigned long     wake_us;	/* total time spent waking */
+    unsigned long     wake_max_us;
+    unsigned long     awake_ms;	/* time powered up */
+    unsigned long     asleep_ms; /* time in deep sleep */
+};
+
+struct SimStats {		/* see sim.c */
+    unsigned long     refreshes;
+    unsigned long     commands;
+    unsigned long     bytes;	/* sent over SPI */
+    unsigned long     ram_bytes; /* written to the panel's RAM */
+    unsigned long     spi_syscalls;
+    unsigned long     errors;	/* bytes the controller would ignore */
+    double            wire_ms;	/* SPI clock time */
+    double            busy_ms;	/* refreshing */
+    double            wait_ms;	/* waiting for BUSY, of model_ms */
+    double            model_ms;	/* added to the real clock */
+    double            frame_ms;	/* first byte sent to end of refresh */
+    double            frame_max_ms;
+};
+
+struct CachedPage {
+    checksum          fhash;	/* book the page belongs to */
+    long              start;	/* book position of first character */
+    long              end;	/* book position of next page */
+    size_t            len;	/* bytes of packed framebuffer */
+    size_t            cap;	/* bytes at data */
+    byte             *data;	/* packbits framebuffer */
+    struct CachedPage *prev, *next; /* towards most, least recent */
+};
+
+struct PageCache {
+    pthread_mutex_t   lock;	/* shared with the prerender worker */
+    size_t            budget;	/* max bytes of page buffers */
+    size_t            used;	/* bytes of page buffers held */
+    struct CachedPage *head, *tail; /* most and least recently used */
+    struct CachedPage *spare;	/* evicted, kept for reuse */
+    byte             *scratch;	/* worst case packing of one page */
+    size_t            scratchlen;
+    size_t            hits, misses, nmalloc;
 };
 
 #endif	/* OKU_TYPES_H */
@@ -0,0 +1,346 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* pagecache.c - LRU cache of rendered pages, packbits compressed.
+
+   Pages that have been shown or pre-rendered are kept so flicking
+   back and forth, e.g. to a footnote, skips layout altogether. Pages
+   are mostly white so framebuffers are stored run length encoded
+   (packbits): margins and blank lines pack to almost nothing, a page
+   of dense text to about two thirds of its 4736 B. Pages are
+   unpacked straight into the framebuffer that is transmitted.
+
+   Entries are keyed by book hash and the page's start position and
+   kept in a list, most recently used first. The least recently used
+   are evicted when the budget is spent. Evicted entries are kept as
+   spares and their buffers, rounded up to a granule, reused for the
+   next pages, so once the cache is full turning pages doesn't call
+   malloc or free.
+
+   Packbits, one header byte per packet:
+
+   | Header h | Packet                                 |
+   |----------+----------------------------------------|
+   | 0..127   | h+1 literal bytes follow               |
+   | 129..255 | next byte repeated 257-h times         |
+   | 128      | no operation                           |                */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "pagecache.h"
+
+#define PACKET_MAX        128	/* bytes in a run or literal packet */
+#define RUN_MIN           3	/* shorter runs are left as literals */
+#define GRANULE           512	/* page buffers are multiples of this */
+#define ROUND_UP(N)       ( ((N) + GRANULE-1) / GRANULE * GRANULE )
+
+static struct CachedPage *find_page(struct PageCache *cache, checksum fhash,
+				    long start);
+static void               unlink_page(struct PageCache *cache,
+				      struct CachedPage *page);
+static void               push_page(struct PageCache *cache,
+				    struct CachedPage *page);
+static void               retire_page(struct PageCache *cache,
+				      struct CachedPage *page);
+static struct CachedPage *new_page(struct PageCache *cache, size_t len);
+static struct CachedPage *take_spare(struct PageCache *cache, size_t len);
+static void               free_spare(struct PageCache *cache);
+static size_t             run_len(const byte *src, size_t len);
+
+void
+pagecache_init(struct PageCache *cache, size_t budget)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->budget = budget;
+    cache->used   = 0;
+    cache->head   = cache->tail = cache->spare = NULL;
+    cache->scratch    = NULL;
+    cache->scratchlen = 0;
+    cache->hits   = cache->misses = cache->nmalloc = 0;
+}
+
+void
+pagecache_free(struct PageCache *cache)
+{
+    struct CachedPage *page;
+
+#ifdef DEBUG
+    printf("Page cache: %zu hits %zu misses %zuB of %zuB in %zu mallocs\n",
+	   cache->hits, cache->misses, cache->used, cache->budget,
+	   cache->nmalloc);
+#endif
+    while (cache->head)
+	retire_page(cache, cache->head);
+    while ((page=cache->spare)) {
+	cache->spare = page->next;
+	free(page);
+    }
+    free(cache->scratch);
+    cache->scratch = NULL;
+    cache->used    = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/* Packs the framebuffer and adds it as the most recently used page,
+   replacing any copy of the same page. */
+ErrCode
+pagecache_put(struct PageCache *cache, checksum fhash, long start, long end,
+	      const byte *fb, size_t len)
+{
+    struct CachedPage *page;
+    byte              *grown;
+    size_t             plen;
+    ErrCode            status = SUCCESS;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->scratchlen < PACKBITS_MAX(len)) { /* first page only */
+	grown = realloc(cache->scratch, PACKBITS_MAX(len));
+	if (!grown) {
+	    status = E_MEM;
+	    goto err;
+	}
+	cache->scratch    = grown;
+	cache->scratchlen = PACKBITS_MAX(len);
+    }
+    plen = packbits_encode(fb, len, cache->scratch);
+    if (ROUND_UP(plen) > cache->budget)
+	goto out;		/* never fits */
+
+    if ((page=find_page(cache, fhash, start)))
+	retire_page(cache, page);
+
+    /* a spare buffer, or the least recently used pages evicted until
+       one of their buffers is big enough or a new one is within
+       budget, freeing spares too small on the way */
+    page = take_spare(cache, plen);
+    while (!page && cache->used + ROUND_UP(plen) > cache->budget) {
+	if (cache->spare) {
+	    free_spare(cache);
+	} else {
+	    retire_page(cache, cache->tail);
+	    page = take_spare(cache, plen);
+	}
+    }
+    if (!page)
+	page = new_page(cache, plen);
+    if (!page) {
+	status = E_MEM;
+	goto err;
+    }
+
+    memcpy(page->data, cache->scratch, plen);
+    page->len   = plen;
+    page->fhash = fhash;
+    page->start = start;
+    page->end   = end;
+    push_page(cache, page);
+
+#ifdef DEBUG
+    printf("Page cache: @%ldB packed %zuB to %zuB\n", start, len, plen);
+#endif
+
+ out:
+ err:
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+/* Unpacks the page at start into fb and makes it the most recently
+   used. Sets end to the start of the page after it. */
+int
+pagecache_get(struct PageCache *cache, checksum fhash, long start, long *end,
+	      byte *fb, size_t len)
+{
+    struct CachedPage *page;
+    int                found = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    page = find_page(cache, fhash, start);
+    if (page && packbits_decode(page->data, page->len, fb, len) == SUCCESS) {
+	unlink_page(cache, page);
+	push_page(cache, page);
+	*end  = page->end;
+	found = 1;
+    }
+    found ? ++cache->hits : ++cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+/* Packs len bytes of src into dest, which must have room for
+   PACKBITS_MAX(len) bytes. Returns the packed length. */
+size_t
+packbits_encode(const byte *src, size_t len, byte *dest)
+{
+    size_t i, lit, run, out = 0;
+
+    for (i=0; i<len; ) {
+	run = run_len(src+i, len-i);
+	if (run >= RUN_MIN) {
+	    dest[out++] = 257 - run;
+	    dest[out++] = src[i];
+	    i += run;
+	    continue;
+	}
+
+	/* literal until the next run worth encoding */
+	for (lit=1; i+lit<len && lit<PACKET_MAX; ++lit)
+	    if (i+lit+2 < len && src[i+lit] == src[i+lit+1]
+		&& src[i+lit] == src[i+lit+2])
+		break;
+	dest[out++] = lit - 1;
+	memcpy(dest+out, src+i, lit);
+	out += lit;
+	i   += lit;
+    }
+
+    return out;
+}
+
+/* Unpacks len bytes of src into dest, which must come to exactly
+   dlen bytes. */
+ErrCode
+packbits_decode(const byte *src, size_t len, byte *dest, size_t dlen)
+{
+    size_t i, n, out = 0;
+    byte   h;
+
+    for (i=0; i<len; ) {
+	h = src[i++];
+	if (h < 128) {
+	    n = h + 1;
+	    if (i+n > len || out+n > dlen)
+		return E_FFORMAT;
+	    memcpy(dest+out, src+i, n);
+	    i += n;
+	} else if (h > 128) {
+	    n = 257 - h;
+	    if (i >= len || out+n > dlen)
+		return E_FFORMAT;
+	    memset(dest+out, src[i++], n);
+	} else {
+	    continue;
+	}
+	out += n;
+    }
+
+    return out == dlen ? SUCCESS : E_FFORMAT;
+}
+
+/* STATIC FUNCTIONS */
+
+static struct CachedPage *
+find_page(struct PageCache *cache, checksum fhash, long start)
+{
+    struct CachedPage *page;
+
+    for (page=cache->head; page; page=page->next)
+	if (page->start == start && page->fhash == fhash)
+	    return page;
+
+    return NULL;
+}
+
+static void
+unlink_page(struct PageCache *cache, struct CachedPage *page)
+{
+    if (page->prev)
+	page->prev->next = page->next;
+    else
+	cache->head = page->next;
+    if (page->next)
+	page->next->prev = page->prev;
+    else
+	cache->tail = page->prev;
+}
+
+static void
+push_page(struct PageCache *cache, struct CachedPage *page)
+{
+    page->prev = NULL;
+    page->next = cache->head;
+    if (cache->head)
+	cache->head->prev = page;
+    else
+	cache->tail = page;
+    cache->head = page;
+}
+
+/* Moves a page from the LRU list to the spares */
+static void
+retire_page(struct PageCache *cache, struct CachedPage *page)
+{
+    unlink_page(cache, page);
+    page->next   = cache->spare;
+    cache->spare = page;
+}
+
+/* Takes the first spare with room for len bytes */
+static struct CachedPage *
+take_spare(struct PageCache *cache, size_t len)
+{
+    struct CachedPage **link, *page;
+
+    for (link=&cache->spare; (page=*link); link=&page->next)
+	if (page->cap >= len) {
+	    *link = page->next;
+	    return page;
+	}
+
+    return NULL;
+}
+
+/* Frees the first spare and its buffer */
+static void
+free_spare(struct PageCache *cache)
+{
+    struct CachedPage *page = cache->spare;
+
+    cache->spare = page->next;
+    cache->used -= page->cap;
+    free(page);
+}
+
+/* Allocates a page and its buffer in one block, first freeing spares
+   if they would take the cache over budget */
+static struct CachedPage *
+new_page(struct PageCache *cache, size_t len)
+{
+    struct CachedPage *page;
+    size_t             cap = ROUND_UP(len);
+
+    while (cache->spare && cache->used + cap > cache->budget)
+	free_spare(cache);
+
+    page = malloc(sizeof *page + cap);
+    if (!page)
+	return NULL;
+
+    page->data   = (byte *)(page + 1);
+    page->cap    = cap;
+    cache->used += cap;
+    ++cache->nmalloc;
+
+    return page;
+}
+
+/* Length of the run of identical bytes at src, at most PACKET_MAX */
+static size_t
+run_len(const byte *src, size_t len)
+{
+    size_t n;
+
+    for (n=1; n<len && n<PACKET_MAX && src[n] == src[0]; ++n)
+	;
+
+    return n;
+}
@@ -0,0 +1,31 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* pagecache.h - LRU cache of rendered pages, packbits compressed */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "err.h"
+#include "oku.h"
+
+#define PAGECACHE_BUDGET      (64*1024) /* bytes of packed pages */
+
+void    pagecache_init(struct PageCache *cache, size_t budget);
+void    pagecache_free(struct PageCache *cache);
+
+/* Framebuffer fb of len bytes shows the page from start to end */
+ErrCode pagecache_put(struct PageCache *cache, checksum fhash, long start,
+		      long end, const byte *fb, size_t len);
+/* Unpacks the page at start into fb, returns 0 if not cached */
+int     pagecache_get(struct PageCache *cache, checksum fhash, long start,
+		      long *end, byte *fb, size_t len);
+
+size_t  packbits_encode(const byte *src, size_t len, byte *dest);
+ErrCode packbits_decode(const byte *src, size_t len, byte *dest, size_t dlen);
+
+/* Worst case size of len bytes once packed */
+#define PACKBITS_MAX(LEN)     ( (LEN) + ((LEN)+127)/128 )
+
+#endif	/* PAGECACHE_H */
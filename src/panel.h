@@ -0,0 +1,66 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* panel.h - geometry of the e-paper panels oku can drive.
+
+   The panel is chosen when building, e.g. make PANEL=4IN2. Its
+   geometry and RAM addressing are constants rather than fields read
+   at run time, so the pitch and index arithmetic in the framebuffer,
+   diff and transmit loops of epd.c folds away separately for each
+   panel. The rest of each panel's description, its command tables
+   and LUTs, is the struct Panel in epd.c.
+
+   | PANEL | Module            | Controller | px      | Waveform |
+   |-------+-------------------+------------+---------+----------|
+   | 2IN9  | Waveshare 2.9"    | IL3820     | 128x296 | LUT regs |
+   | 4IN2  | Waveshare 4.2" V2 | SSD1683    | 400x300 | OTP      |
+   | 7IN5  | Waveshare 7.5" HD | SSD1677    | 880x528 | OTP      |
+
+   Sizes are as the controller scans them, RAM x across. Landscape
+   needs both sides to be multiples of 8 px (see rotate.c).
+
+   The IL3820 has two banks of RAM and swaps the one written to at
+   each refresh, so a frame is written over the one before last, not
+   the last. The others are written to one bank.                    */
+
+#ifndef PANEL_H
+#define PANEL_H
+
+#define PANEL_2IN9        1
+#define PANEL_4IN2        2
+#define PANEL_7IN5        3
+
+#ifndef PANEL
+#define PANEL             PANEL_2IN9
+#endif
+
+#if PANEL == PANEL_2IN9
+#define PANEL_NAME        "Waveshare 2.9in"
+#define WIDTH             128
+#define HEIGHT            296
+#define RAM_X_PX          0	/* RAM x address is a byte, 8px units */
+#define OTP_WAVEFORM      0	/* LUT loaded by epd_start() */
+#define RAM_BANKS         2	/* swapped by each refresh */
+
+#elif PANEL == PANEL_4IN2
+#define PANEL_NAME        "Waveshare 4.2in V2"
+#define WIDTH             400
+#define HEIGHT            300
+#define RAM_X_PX          0
+#define OTP_WAVEFORM      1	/* controller loads its own LUT */
+#define RAM_BANKS         1
+
+#elif PANEL == PANEL_7IN5
+#define PANEL_NAME        "Waveshare 7.5in HD"
+#define WIDTH             880
+#define HEIGHT            528
+#define RAM_X_PX          1	/* RAM x address is 2 bytes, in px */
+#define OTP_WAVEFORM      1
+#define RAM_BANKS         1
+
+#else
+#error "Unknown PANEL, see panel.h"
+#endif
+
+#endif	/* PANEL_H */
@@ -0,0 +1,287 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* prerender.c - renders neighbouring pages in the background.
+
+   A worker thread lays out and renders the pages either side of the
+   one on screen into spare framebuffers, while the main thread waits
+   on the panel refresh or for input. Turning to a prepared page is
+   then only a framebuffer swap.
+
+   The worker has its own book and font handles and its own display
+   list, so it never shares reader state with the main thread. Only
+   the slots below are shared, under the lock. The page in the
+   direction the reader last moved is prepared first. Rendered pages
+   are also added to the page cache, which has its own lock.
+
+   Slot states:
+
+   | State  | Meaning                                   | Owner  |
+   |--------+-------------------------------------------+--------|
+   | EMPTY  | buffer free for reuse                     | -      |
+   | BUSY   | being rendered                            | worker |
+   | READY  | holds the page at 'start'                 | -      |
+   | FAILED | page at 'start' doesn't exist (e.g. EOF)  | -      |  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "prerender.h"
+#include "book.h"
+#include "unifont.h"
+#include "layout.h"
+#include "epd.h"
+#include "pagecache.h"
+#include "trace.h"
+
+#define NSLOT             2	/* previous and next page */
+
+enum SLOT_STATE { SLOT_EMPTY, SLOT_BUSY, SLOT_READY, SLOT_FAILED };
+
+struct Slot {
+    enum SLOT_STATE   state;
+    long              start, end; /* book positions of the page */
+    byte             *fb;	  /* rendered page */
+};
+
+struct Prerender {
+    pthread_t          thread;
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;	/* job or slot state changed */
+    int                running, quit;
+
+    long               want[NSLOT];  /* page starts in preference order */
+    struct Slot        slot[NSLOT];
+
+    /* Owned by the worker thread */
+    struct Book        book;
+    struct Unifont     font;
+    struct DisplayList list;
+    struct Point       paper;
+    struct PageCache  *cache;
+};
+
+static struct Prerender pre = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void            *worker(void *arg);
+static struct Slot     *find_slot(long start);
+static struct Slot     *claim_slot(long *start);
+static ErrCode          render(long start, struct Slot *into);
+
+/* Opens the worker's own book and font handles and starts it */
+ErrCode
+prerender_start(const char *book_path, const char *font_path,
+		struct Point paper, struct PageCache *cache)
+{
+    ErrCode status;
+    int     i;
+
+    if (pre.running)
+	return E_INIT;
+
+    for (i=0; i<NSLOT; ++i) {
+	pre.want[i]       = -1;
+	pre.slot[i].state = SLOT_EMPTY;
+	pre.slot[i].fb    = epd_buffer_new();
+	if (!pre.slot[i].fb)
+	    return E_MEM;
+    }
+    pre.paper = paper;
+    pre.cache = cache;
+
+    status = book_open(book_path, &pre.book);
+    if (status)
+	return status;
+    status = unifont_open(font_path, &pre.font);
+    if (status)
+	return status;
+
+    pre.quit = 0;
+    if (pthread_create(&pre.thread, NULL, worker, NULL))
+	return E_INIT;
+    pre.running = 1;
+
+    return SUCCESS;
+}
+
+/* Stops the worker and releases everything it holds */
+void
+prerender_stop(void)
+{
+    int i;
+
+    if (pre.running) {
+	pthread_mutex_lock(&pre.lock);
+	pre.quit = 1;
+	pthread_cond_broadcast(&pre.cond);
+	pthread_mutex_unlock(&pre.lock);
+	pthread_join(pre.thread, NULL);
+	pre.running = 0;
+    }
+
+    for (i=0; i<NSLOT; ++i) {
+	free(pre.slot[i].fb);
+	pre.slot[i].fb = NULL;
+    }
+    layout_free(&pre.list);
+    unifont_close(&pre.font);
+    book_close(&pre.book);
+}
+
+/* Tells the worker which pages neighbour the one on screen. The page
+   in the direction of travel (>= 0 forwards) is prepared first. */
+void
+prerender_request(long prev_start, long next_start, int direction)
+{
+    pthread_mutex_lock(&pre.lock);
+    pre.want[0] = direction >= 0 ? next_start : prev_start;
+    pre.want[1] = direction >= 0 ? prev_start : next_start;
+    pthread_cond_broadcast(&pre.cond);
+    pthread_mutex_unlock(&pre.lock);
+}
+
+/* If the page starting at start has been prepared, swaps it on to
+   the screen and sets end to the start of the page after it. Waits
+   if the worker is in the middle of rendering it. */
+int
+prerender_take(long start, long *end)
+{
+    struct Slot *s;
+    int          taken = 0;
+
+    if (!pre.running)
+	return 0;
+
+    pthread_mutex_lock(&pre.lock);
+    while ((s=find_slot(start)) && s->state == SLOT_BUSY)
+	pthread_cond_wait(&pre.cond, &pre.lock);
+
+    if (s && s->state == SLOT_READY) {
+	s->fb    = epd_buffer_swap(s->fb); /* old page becomes spare */
+	s->state = SLOT_EMPTY;
+	*end     = s->end;
+	taken    = 1;
+    }
+    pthread_mutex_unlock(&pre.lock);
+
+#ifdef DEBUG
+    printf("Prerender: @%ldB %s\n", start, taken ? "hit" : "miss");
+#endif
+
+    return taken;
+}
+
+/* STATIC FUNCTIONS */
+
+static void *
+worker(void *arg)
+{
+    struct Slot *s;
+    ErrCode      status;
+    long         start;
+
+    (void)arg;
+    TRACE_THREAD("prerender");
+
+    pthread_mutex_lock(&pre.lock);
+    while (!pre.quit) {
+	s = claim_slot(&start);
+	if (!s) {
+	    pthread_cond_wait(&pre.cond, &pre.lock);
+	    continue;
+	}
+
+	pthread_mutex_unlock(&pre.lock);
+	status = render(start, s);
+	pthread_mutex_lock(&pre.lock);
+
+	s->state = status ? SLOT_FAILED : SLOT_READY;
+	pthread_cond_broadcast(&pre.cond);
+
+#ifdef DEBUG
+	printf("Prerender: @%ldB..%ldB status %d\n", s->start, s->end, status);
+#endif
+    }
+    pthread_mutex_unlock(&pre.lock);
+
+    return NULL;
+}
+
+/* Slot holding or rendering the page at start (lock held) */
+static struct Slot *
+find_slot(long start)
+{
+    int i;
+
+    for (i=0; i<NSLOT; ++i)
+	if (pre.slot[i].state != SLOT_EMPTY && pre.slot[i].start == start)
+	    return pre.slot + i;
+
+    return NULL;
+}
+
+/* Picks the most wanted page not yet prepared and a slot to render
+   it into, one not holding a wanted page. Marks the slot BUSY and
+   returns it, or NULL if there's nothing to do (lock held). */
+static struct Slot *
+claim_slot(long *start)
+{
+    struct Slot *s;
+    int          i, j, k;
+
+    for (i=0; i<NSLOT; ++i) {
+	if (pre.want[i] == -1 || find_slot(pre.want[i]))
+	    continue;
+
+	for (j=0; j<NSLOT; ++j) {
+	    s = pre.slot + j;
+	    for (k=0; k<NSLOT && (s->state == SLOT_EMPTY
+				  || pre.want[k] != s->start); ++k)
+		;
+	    if (k < NSLOT)
+		continue;	/* holds a wanted page */
+
+	    s->state = SLOT_BUSY;
+	    s->start = *start = pre.want[i];
+	    s->end   = -1;
+	    return s;
+	}
+    }
+
+    return NULL;
+}
+
+/* Lays out and renders the page at start, or unpacks it from the
+   page cache (lock not held) */
+static ErrCode
+render(long start, struct Slot *into)
+{
+    ErrCode status;
+
+    if (pagecache_get(pre.cache, pre.book.fhash, start, &into->end,
+		      into->fb, epd_buffer_len()))
+	return SUCCESS;		/* shown or rendered before */
+
+    status = book_seek(&pre.book, start);
+    if (status)
+	return status;
+    status = layout_page(&pre.book, &pre.font, pre.paper, &pre.list);
+    if (status)
+	return status;
+    status = layout_render(&pre.list, into->fb);
+    if (status)
+	return status;
+
+    into->end = pre.list.end;	/* read under lock once READY */
+    return pagecache_put(pre.cache, pre.book.fhash, start, into->end,
+			 into->fb, epd_buffer_len());
+}
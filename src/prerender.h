@@ -0,0 +1,23 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* prerender.h - renders neighbouring pages in the background */
+
+#ifndef PRERENDER_H
+#define PRERENDER_H
+
+#include "err.h"
+#include "oku.h"
+
+ErrCode prerender_start(const char *book_path, const char *font_path,
+			struct Point paper, struct PageCache *cache);
+void    prerender_stop(void);
+
+/* Pages to prepare next: book positions, or -1 for none */
+void    prerender_request(long prev_start, long next_start, int direction);
+
+/* Puts a prepared page on screen, returns 0 if it wasn't prepared */
+int     prerender_take(long start, long *end);
+
+#endif	/* PRERENDER_H */
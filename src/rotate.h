@@ -0,0 +1,15 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* rotate.h - quarter turns of packed bitmaps by 8x8 bit transposes */
+
+#ifndef ROTATE_H
+#define ROTATE_H
+
+#include "err.h"
+#include "oku.h"
+
+ErrCode rotate_cw(const byte *src, struct Point size, byte *dest);
+
+#endif	/* ROTATE_H */
@@ -0,0 +1,632 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* sim.c - an in-process panel controller behind spi.h and gpio.h.
+
+   Built instead of spi.c and gpio.c with make BACKEND=sim, so the
+   whole of epd.c runs, byte for byte as on a Pi, against a model of
+   the controller rather than a HAT. The command stream is decoded as
+   the controller would: RAM window and cursor, WRITE_RAM into the
+   panel's RAM, the LUT, SW_RESET, deep sleep and MASTER_ACTIVATION,
+   which copies the RAM to the simulated screen (sim_screen()). On
+   panels with two RAM banks (panel.h) WRITE_RAM goes to one and each
+   MASTER_ACTIVATION shows it and swaps to the other, as the IL3820
+   does. The screen can be compared with the frame that was sent, to
+   check transfer optimisations bit for bit.
+
+   Time is modelled on top of the real clock: what the program does
+   takes as long as it does, while every syscall, every byte on the
+   wire at the SPI clock and every period the panel holds BUSY high
+   adds its modelled duration. GPIO_wait_low() returns at once,
+   having moved the modelled clock to the end of the busy period. So
+   oku runs as fast as the host allows and sim_stats() reports how
+   long each frame would have taken on the panel: from the first byte
+   sent after the panel was last idle to the end of its refresh.
+
+   | Modelled            | Duration                                  |
+   |---------------------+-------------------------------------------|
+   | syscall             | SIM_SYSCALL_US, every ioctl of gpio/spi.c |
+   | SPI byte            | 8 clocks at the SPI_start() speed         |
+   | reset, SW_RESET     | SIM_RESET_MS busy                         |
+   | refresh, LUT loaded | its phase lengths x SIM_FRAME_MS          |
+   | refresh, OTP        | SIM_REFRESH_MS                            |
+
+   Each may be overridden when building, e.g. -DSIM_REFRESH_MS=4000.
+   Bytes sent while deselected or asleep and commands other than NOP
+   sent while busy are counted as errors. Only the data entry mode
+   epd.c uses, x then y increment, is modelled. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "oku.h"
+#include "err.h"
+
+#include "gpio.h"
+#include "spi.h"
+#include "sim.h"
+#include "panel.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define PITCH(X)          ( X%8 ? 1+(X/8) : X/8  )
+#define LEN(X,Y)          ( PITCH(X) * Y         )
+
+#ifndef SIM_SYSCALL_US
+#define SIM_SYSCALL_US    10
+#endif
+#ifndef SIM_RESET_MS
+#define SIM_RESET_MS      5
+#endif
+#ifndef SIM_FRAME_MS
+#define SIM_FRAME_MS      20	/* one waveform frame, 50 Hz */
+#endif
+#ifndef SIM_REFRESH_MS
+#define SIM_REFRESH_MS    3000
+#endif
+
+#define SIM_BUFSIZ        4096	/* spidev bufsiz, see spi.c */
+#define LINE_MAX          50
+#define BULK_MAX          4
+#define LUT_LEN           30
+#define LUT_PHASES        20	/* LUT bytes before the phase lengths */
+#define NS_PER_MS         1000000L
+
+/* The HAT as wired in epd.c */
+enum SIM_PIN
+    {
+	SIM_PIN_ChipSelect  =  8,
+	SIM_PIN_Reset       = 17,
+	SIM_PIN_DataCommand = 25,
+	SIM_PIN_Busy        = 24
+    };
+
+/* Commands the model acts on, see epd.c */
+enum SIM_COMMAND
+    { DEEP_SLEEP_MODE                        = 0x10,
+      DATA_ENTRY_MODE_SETTING                = 0x11,
+      SW_RESET                               = 0x12,
+      MASTER_ACTIVATION                      = 0x20,
+      WRITE_RAM                              = 0x24,
+      WRITE_LUT_REGISTER                     = 0x32,
+      SET_RAM_X_ADDRESS_START_END_POSITION   = 0x44,
+      SET_RAM_Y_ADDRESS_START_END_POSITION   = 0x45,
+      SET_RAM_X_ADDRESS_COUNTER              = 0x4E,
+      SET_RAM_Y_ADDRESS_COUNTER              = 0x4F,
+      TERMINATE_FRAME_READ_WRITE             = 0xFF  };
+
+struct controller {
+    byte              ram[RAM_BANKS][LEN(WIDTH, HEIGHT)];
+    unsigned          bank;	/* written to, shown next */
+    byte              screen[LEN(WIDTH, HEIGHT)];
+    byte              lut[LUT_LEN];
+    int               lut_loaded;
+    int               asleep;
+
+    byte              command;	/* last command byte */
+    unsigned          narg;	/* data bytes since */
+    byte              arg[4];
+    unsigned          x0, x1, y0, y1; /* RAM window, x in bytes */
+    unsigned          x, y;	      /* address counter */
+
+    long long         offset;	/* ns modelled on top of the clock */
+    long long         busy_until; /* modelled ns BUSY falls */
+    long long         frame_start; /* -1 between frames */
+};
+
+struct sim {
+    int               level[LINE_MAX]; /* -1 if not reserved */
+    int               deflt[LINE_MAX]; /* level when reserved */
+    int               input[LINE_MAX];
+    unsigned          bulk_line[BULK_MAX];
+    unsigned          nbulk;
+    int               gpio_on;
+    int               spi_on;
+    uint32_t          speed_hz;
+
+    struct controller epd;
+    struct SimStats   stats;
+    struct GpioStats  gpio;
+};
+
+static struct sim sim;
+
+static void      set_line(unsigned line, int level);
+static void      receive(byte b);
+static void      receive_data(byte b);
+static void      activate(void);
+static void      hold_busy(long long ns);
+static long long lut_ns(void);
+static void      advance(long long ns);
+static long long now_ns(void);
+
+/* Simulated gpio.h */
+
+ErrCode
+GPIO_start(const char *device, const char *consumer)
+{
+    if (sim.gpio_on)
+	return E_INIT;
+    if (!device || !consumer)
+	return E_ARG;
+
+    memset(sim.level, -1, sizeof sim.level);
+    sim.nbulk  = 0;
+    sim.epd.frame_start = -1;
+    sim.gpio_on = 1;
+
+    return SUCCESS;
+}
+
+void
+GPIO_stop(void)
+{
+#ifdef DEBUG
+    if (sim.gpio_on)
+	printf("GPIO: %lu writes, %lu elided, %lu syscalls (simulated)\n",
+	       sim.gpio.writes, sim.gpio.elided, sim.gpio.syscalls);
+#endif
+    sim.gpio_on = 0;
+}
+
+ErrCode
+GPIO_reserve_input(unsigned line)
+{
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line >= LINE_MAX)
+	return E_ARG;
+
+    sim.input[line] = 1;
+    sim.level[line] = 0;
+    advance(SIM_SYSCALL_US * 1000L);
+
+    return SUCCESS;
+}
+
+ErrCode
+GPIO_reserve_input_falling(unsigned line)
+{
+    return GPIO_reserve_input(line);
+}
+
+ErrCode
+GPIO_reserve_output(unsigned line, enum GPIO_LEVEL initial)
+{
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line >= LINE_MAX)
+	return E_ARG;
+
+    sim.deflt[line] = initial;
+    set_line(line, initial);
+    advance(SIM_SYSCALL_US * 1000L);
+
+    return SUCCESS;
+}
+
+ErrCode
+GPIO_reserve_output_bulk(const unsigned *line, const enum GPIO_LEVEL *initial,
+			 unsigned n)
+{
+    unsigned i;
+
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (n > BULK_MAX || sim.nbulk)
+	return E_ARG;
+
+    for (i=0; i<n; ++i) {
+	if (line[i] >= LINE_MAX)
+	    return E_ARG;
+	sim.bulk_line[i]   = line[i];
+	sim.deflt[line[i]] = initial[i];
+	set_line(line[i], initial[i]);
+    }
+    sim.nbulk = n;
+    advance(SIM_SYSCALL_US * 1000L);
+
+    return SUCCESS;
+}
+
+/* Writes that change nothing are elided as by gpio.c, so the
+   syscall counts match */
+ErrCode
+GPIO_write(unsigned line, enum GPIO_LEVEL in)
+{
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line >= LINE_MAX || sim.level[line] == -1 || sim.input[line])
+	return E_GPIO;
+
+    ++sim.gpio.writes;
+    if (sim.level[line] == (int)in) {
+	++sim.gpio.elided;
+	return SUCCESS;
+    }
+
+    ++sim.gpio.syscalls;
+    advance(SIM_SYSCALL_US * 1000L);
+    set_line(line, in);
+
+    return SUCCESS;
+}
+
+/* Always written, see gpio.c */
+ErrCode
+GPIO_write_default(unsigned line)
+{
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line >= LINE_MAX || sim.level[line] == -1)
+	return E_GPIO;
+
+    ++sim.gpio.writes;
+    ++sim.gpio.syscalls;
+    advance(SIM_SYSCALL_US * 1000L);
+    set_line(line, sim.deflt[line]);
+
+    return SUCCESS;
+}
+
+ErrCode
+GPIO_write_bulk(const enum GPIO_LEVEL *in)
+{
+    unsigned i;
+
+    if (!sim.gpio_on || !sim.nbulk)
+	return E_INIT;
+
+    ++sim.gpio.writes;
+    for (i=0; i<sim.nbulk && sim.level[sim.bulk_line[i]] == (int)in[i]; ++i)
+	;
+    if (i == sim.nbulk) {
+	++sim.gpio.elided;
+	return SUCCESS;
+    }
+
+    ++sim.gpio.syscalls;
+    advance(SIM_SYSCALL_US * 1000L);
+    for (i=0; i<sim.nbulk; ++i)
+	set_line(sim.bulk_line[i], in[i]);
+
+    return SUCCESS;
+}
+
+/* BUSY reads high until the modelled clock passes the busy period */
+ErrCode
+GPIO_read(unsigned line, enum GPIO_LEVEL *out)
+{
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line >= LINE_MAX || sim.level[line] == -1)
+	return E_GPIO;
+
+    ++sim.gpio.syscalls;
+    advance(SIM_SYSCALL_US * 1000L);
+    if (line == SIM_PIN_Busy)
+	*out = now_ns() < sim.epd.busy_until;
+    else
+	*out = sim.level[line] ? 1 : 0;
+
+    return SUCCESS;
+}
+
+/* Returns once BUSY is low, moving the modelled clock to the end of
+   the busy period instead of sleeping. The syscalls are counted as
+   gpio.c makes them: a read, then an event wait, an event read and
+   a read again if the line was high. */
+ErrCode
+GPIO_wait_low(unsigned line, unsigned timeout_ms)
+{
+    long long left;
+
+    if (!sim.gpio_on)
+	return E_INIT;
+    if (line != SIM_PIN_Busy)
+	return E_GPIO;
+
+    ++sim.gpio.syscalls;
+    advance(SIM_SYSCALL_US * 1000L);
+    left = sim.epd.busy_until - now_ns();
+    if (left <= 0)
+	return SUCCESS;
+    if (left > timeout_ms * NS_PER_MS) {
+	advance(timeout_ms * NS_PER_MS);
+	return E_BUSY;
+    }
+
+    sim.gpio.syscalls += 3;
+    sim.stats.wait_ms += left / 1e6;
+    advance(left + 3 * SIM_SYSCALL_US * 1000L);
+
+    return SUCCESS;
+}
+
+void
+GPIO_dump(void)
+{
+    return;
+}
+
+void
+GPIO_stats(struct GpioStats *out)
+{
+    *out = sim.gpio;
+}
+
+/* Simulated spi.h */
+
+ErrCode
+SPI_start(const char *device, uint64_t speed_mhz)
+{
+    (void)device;
+
+    if (sim.spi_on)
+	return E_INIT;
+
+    sim.speed_hz = speed_mhz * 1000000;
+    sim.spi_on   = 1;
+    advance(4 * SIM_SYSCALL_US * 1000L); /* open and 3 ioctls */
+
+    return SUCCESS;
+}
+
+void
+SPI_stop(void)
+{
+#ifdef DEBUG
+    if (sim.spi_on)
+	printf("SPI: %lu refreshes, %luB in %lu syscalls, %luB to RAM, "
+	       "%lu errors; frames %.1fms on average %.1fms at most, "
+	       "wire %.1fms, busy %.1fms (simulated)\n",
+	       sim.stats.refreshes, sim.stats.bytes, sim.stats.spi_syscalls,
+	       sim.stats.ram_bytes, sim.stats.errors,
+	       sim.stats.refreshes ? sim.stats.frame_ms / sim.stats.refreshes : 0,
+	       sim.stats.frame_max_ms, sim.stats.wire_ms, sim.stats.busy_ms);
+#endif
+    sim.spi_on = 0;
+}
+
+ErrCode
+SPI_write_byte(byte tx)
+{
+    return SPI_write(&tx, 1);
+}
+
+/* Each byte reaches the model as it would the controller: ignored
+   unless CS is low, a command if DC is low, data otherwise */
+ErrCode
+SPI_write(const byte *tx, size_t len)
+{
+    long long wire;
+    size_t    i, msgs;
+
+    if (!sim.spi_on)
+	return E_INIT;
+
+    TRACE_BEGIN(TRACE_SPI);
+    if (sim.epd.frame_start < 0)
+	sim.epd.frame_start = now_ns();
+
+    msgs = (len + SIM_BUFSIZ-1) / SIM_BUFSIZ;
+    wire = (long long)len * 8 * 1000000000LL / sim.speed_hz;
+    sim.stats.bytes        += len;
+    sim.stats.spi_syscalls += msgs;
+    sim.stats.wire_ms      += wire / 1e6;
+    metrics_add(METRIC_SPI_BYTES, len);
+    metrics_add(METRIC_SPI_TRANSFERS, msgs);
+
+    for (i=0; i<len; ++i)
+	if (sim.level[SIM_PIN_ChipSelect])
+	    ++sim.stats.errors;	/* not selected */
+	else
+	    receive(tx[i]);
+    advance(wire + msgs * SIM_SYSCALL_US * 1000L);
+    TRACE_END_N(TRACE_SPI, len);
+
+    return SUCCESS;
+}
+
+/* Image shown by the last refresh, in the panel's layout */
+const byte *
+sim_screen(void)
+{
+    return sim.epd.screen;
+}
+
+void
+sim_stats(struct SimStats *out)
+{
+    *out = sim.stats;
+    out->model_ms = sim.epd.offset / 1e6;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Sets a line, acting on a reset: the controller is held while reset
+   is low and busy for SIM_RESET_MS after it rises, with its registers
+   back to their defaults and the RAM kept. Which bank is written
+   next is kept too; epd.c mustn't rely on it. */
+static void
+set_line(unsigned line, int level)
+{
+    int was = sim.level[line];
+
+    sim.level[line] = level;
+    if (line != SIM_PIN_Reset || was == -1 || was == level)
+	return;
+
+    if (level) {
+	if (sim.epd.frame_start < 0)
+	    sim.epd.frame_start = now_ns();
+	sim.epd.asleep     = 0;
+	sim.epd.lut_loaded = 0;
+	sim.epd.command    = 0;
+	hold_busy(SIM_RESET_MS * NS_PER_MS);
+    }
+}
+
+static void
+receive(byte b)
+{
+    struct controller *epd = &sim.epd;
+
+    if (epd->asleep || !sim.level[SIM_PIN_Reset]) {
+	++sim.stats.errors;	/* only a reset wakes it */
+	return;
+    }
+
+    if (sim.level[SIM_PIN_DataCommand]) {
+	receive_data(b);
+	return;
+    }
+
+    ++sim.stats.commands;
+    if (now_ns() < epd->busy_until && b != TERMINATE_FRAME_READ_WRITE)
+	++sim.stats.errors;	/* commands are ignored while busy */
+    epd->command = b;
+    epd->narg    = 0;
+
+    switch (b) {
+    case SW_RESET:
+	epd->lut_loaded = 0;
+	hold_busy(SIM_RESET_MS * NS_PER_MS);
+	break;
+    case MASTER_ACTIVATION:
+	activate();
+	break;
+    }
+}
+
+static void
+receive_data(byte b)
+{
+    struct controller *epd = &sim.epd;
+    unsigned           n;
+
+    n = epd->narg++;
+    if (n < sizeof epd->arg)
+	epd->arg[n] = b;
+
+    switch (epd->command) {
+    case WRITE_RAM:
+	if (epd->x < PITCH(WIDTH) && epd->y < HEIGHT)
+	    epd->ram[epd->bank][epd->y*PITCH(WIDTH) + epd->x] = b;
+	else
+	    ++sim.stats.errors;
+	++sim.stats.ram_bytes;
+	if (++epd->x > epd->x1) {
+	    epd->x = epd->x0;
+	    if (++epd->y > epd->y1)
+		epd->y = epd->y0;
+	}
+	break;
+    case WRITE_LUT_REGISTER:
+	if (n < LUT_LEN)
+	    epd->lut[n] = b;
+	epd->lut_loaded = n+1 == LUT_LEN;
+	break;
+    case DEEP_SLEEP_MODE:
+	epd->asleep = b & 0x01;
+	epd->frame_start = -1;
+	break;
+    case DATA_ENTRY_MODE_SETTING:
+	if ((b & 0x07) != 0x03)
+	    ++sim.stats.errors;	/* not modelled */
+	break;
+#if RAM_X_PX
+    case SET_RAM_X_ADDRESS_START_END_POSITION:
+	if (n == 3) {
+	    epd->x0 = (epd->arg[0] | epd->arg[1]<<8) / 8;
+	    epd->x1 = (epd->arg[2] | epd->arg[3]<<8) / 8;
+	}
+	break;
+    case SET_RAM_X_ADDRESS_COUNTER:
+	if (n == 1)
+	    epd->x = (epd->arg[0] | epd->arg[1]<<8) / 8;
+	break;
+#else
+    case SET_RAM_X_ADDRESS_START_END_POSITION:
+	if (n == 1) {
+	    epd->x0 = epd->arg[0];
+	    epd->x1 = epd->arg[1];
+	}
+	break;
+    case SET_RAM_X_ADDRESS_COUNTER:
+	if (n == 0)
+	    epd->x = epd->arg[0];
+	break;
+#endif
+    case SET_RAM_Y_ADDRESS_START_END_POSITION:
+	if (n == 3) {
+	    epd->y0 = epd->arg[0] | epd->arg[1]<<8;
+	    epd->y1 = epd->arg[2] | epd->arg[3]<<8;
+	}
+	break;
+    case SET_RAM_Y_ADDRESS_COUNTER:
+	if (n == 1)
+	    epd->y = epd->arg[0] | epd->arg[1]<<8;
+	break;
+    }
+}
+
+/* Shows the RAM bank written, swaps banks and holds BUSY for the
+   waveform's duration. The frame ends when BUSY falls. */
+static void
+activate(void)
+{
+    struct controller *epd = &sim.epd;
+    long long          ns, frame;
+
+    ns = epd->lut_loaded ? lut_ns() : SIM_REFRESH_MS * NS_PER_MS;
+    memcpy(epd->screen, epd->ram[epd->bank], sizeof epd->screen);
+    epd->bank = (epd->bank+1) % RAM_BANKS;
+    hold_busy(ns);
+
+    frame = epd->busy_until - epd->frame_start;
+    ++sim.stats.refreshes;
+    sim.stats.busy_ms  += ns / 1e6;
+    sim.stats.frame_ms += frame / 1e6;
+    if (frame / 1e6 > sim.stats.frame_max_ms)
+	sim.stats.frame_max_ms = frame / 1e6;
+    epd->frame_start = -1;
+}
+
+static void
+hold_busy(long long ns)
+{
+    sim.epd.busy_until = now_ns() + ns;
+}
+
+/* Waveform frames in the loaded LUT: each of its last bytes holds
+   the lengths of two phases, one a nibble */
+static long long
+lut_ns(void)
+{
+    long long frames = 0;
+    unsigned  i;
+
+    for (i=LUT_PHASES; i<LUT_LEN; ++i)
+	frames += (sim.epd.lut[i] >> 4) + (sim.epd.lut[i] & 0x0F);
+
+    return frames * SIM_FRAME_MS * NS_PER_MS;
+}
+
+static void
+advance(long long ns)
+{
+    sim.epd.offset += ns;
+}
+
+/* Modelled time: the monotonic clock plus everything modelled */
+static long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec + sim.epd.offset;
+}
@@ -0,0 +1,17 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* sim.h - simulated panel controller behind spi.h and gpio.h */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "oku.h"
+
+/* Image shown by the last refresh, in the panel's layout */
+const byte *sim_screen(void);
+/* Transfer counts and modelled times since the start */
+void        sim_stats(struct SimStats *out);
+
+#endif	/* SIM_H */
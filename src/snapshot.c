@@ -0,0 +1,138 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* snapshot.c - saves the page on screen for an instant resume.
+
+   On the way down the framebuffer on the panel is written to a file
+   named after the book's hash, with the position of the page it
+   shows. The next time the same book is opened the snapshot goes
+   straight back on the panel, before the font is loaded or anything
+   is laid out, and without the white page epd_clear() would show.
+
+   The file is written under a temporary name, synced and renamed
+   over the old one, so a power cut leaves the old snapshot or the
+   new one and never a mix. The CRC catches anything else, e.g. a
+   file from another build.
+
+   | Field | Type         | Meaning                           |
+   |-------+--------------+-----------------------------------|
+   | magic | 4 B          | SNAPSHOT_MAGIC                    |
+   | fhash | checksum     | book the page is from             |
+   | paper | struct Point | px, differs in landscape          |
+   | start | long         | book position of the page         |
+   | len   | size_t       | framebuffer bytes                 |
+   | crc   | uLong        | crc32 of start and the frame      |
+   | frame | len B        | framebuffer as passed to epd      | */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "snapshot.h"
+
+#define SNAPSHOT_FEXT     ".oks" /* snapshot file extension */
+#define SNAPSHOT_TEMP     ".oks.tmp"
+#define SNAPSHOT_MAGIC    "OKS1"
+#define FNAME_LEN         16
+
+static uLong frame_crc(long start, const byte *fb, size_t len);
+
+/* Replaces the book's snapshot with framebuffer fb */
+ErrCode
+snapshot_save(checksum fhash, struct Point paper, long start,
+	      const byte *fb, size_t len)
+{
+    char  fname[FNAME_LEN], tname[FNAME_LEN];
+    FILE *fh;
+    uLong crc;
+    int   ok;
+
+    snprintf(fname, sizeof fname, "%04x%s", fhash, SNAPSHOT_FEXT);
+    snprintf(tname, sizeof tname, "%04x%s", fhash, SNAPSHOT_TEMP);
+
+    fh = fopen(tname, "w");
+    if (!fh)
+	return E_IO;
+
+    crc = frame_crc(start, fb, len);
+    ok  = fwrite(SNAPSHOT_MAGIC, 4, 1, fh) == 1
+	&& fwrite(&fhash, sizeof fhash, 1, fh) == 1
+	&& fwrite(&paper, sizeof paper, 1, fh) == 1
+	&& fwrite(&start, sizeof start, 1, fh) == 1
+	&& fwrite(&len, sizeof len, 1, fh) == 1
+	&& fwrite(&crc, sizeof crc, 1, fh) == 1
+	&& fwrite(fb, len, 1, fh) == 1
+	&& fflush(fh) == 0
+	&& fsync(fileno(fh)) == 0;
+    ok = fclose(fh) == 0 && ok;
+
+    if (!ok || rename(tname, fname)) {
+	remove(tname);
+	return E_IO;
+    }
+
+#ifdef DEBUG
+    printf("Snapshot: saved @%ldB to %s\n", start, fname);
+#endif
+
+    return SUCCESS;
+}
+
+int
+snapshot_load(checksum fhash, struct Point paper, long *start,
+	      byte *fb, size_t len)
+{
+    char         fname[FNAME_LEN], magic[4];
+    FILE        *fh;
+    checksum     fhash_in;
+    struct Point paper_in;
+    size_t       len_in;
+    uLong        crc;
+    int          ok;
+
+    snprintf(fname, sizeof fname, "%04x%s", fhash, SNAPSHOT_FEXT);
+    fh = fopen(fname, "r");
+    if (!fh) {			/* not read before */
+	err_clear_errno();
+	return 0;
+    }
+
+    ok = fread(magic, sizeof magic, 1, fh) == 1
+	&& !memcmp(magic, SNAPSHOT_MAGIC, sizeof magic)
+	&& fread(&fhash_in, sizeof fhash_in, 1, fh) == 1
+	&& fhash_in == fhash
+	&& fread(&paper_in, sizeof paper_in, 1, fh) == 1
+	&& paper_in.x == paper.x && paper_in.y == paper.y
+	&& fread(start, sizeof *start, 1, fh) == 1
+	&& fread(&len_in, sizeof len_in, 1, fh) == 1
+	&& len_in == len
+	&& fread(&crc, sizeof crc, 1, fh) == 1
+	&& fread(fb, len, 1, fh) == 1
+	&& crc == frame_crc(*start, fb, len);
+    fclose(fh);
+
+#ifdef DEBUG
+    printf("Snapshot: %s @%ldB %s\n", fname, ok ? *start : -1L,
+	   ok ? "loaded" : "unusable");
+#endif
+
+    return ok;
+}
+
+/* STATIC FUNCTIONS */
+
+static uLong
+frame_crc(long start, const byte *fb, size_t len)
+{
+    uLong crc;
+
+    crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *)&start, sizeof start);
+
+    return crc32(crc, fb, len);
+}
@@ -0,0 +1,21 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* snapshot.h - saves the page on screen for an instant resume */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "err.h"
+#include "oku.h"
+
+/* Framebuffer fb of len bytes, paper px, shows the page at start */
+ErrCode snapshot_save(checksum fhash, struct Point paper, long start,
+		      const byte *fb, size_t len);
+/* Loads the page last shown of the book into fb and sets start to its
+   position. Returns 0 if there is no intact snapshot for this paper. */
+int     snapshot_load(checksum fhash, struct Point paper, long *start,
+		      byte *fb, size_t len);
+
+#endif	/* SNAPSHOT_H */
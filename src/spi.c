@@ -4,10 +4,7 @@
 
 /* spi.c - SPI communication using spidev.h */
 
-#ifdef DEBUG
 #include <stdio.h>
-#endif
-
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -18,6 +15,8 @@
 #include "oku.h"
 #include "err.h"
 #include "spi.h"
+#include "trace.h"
+#include "metrics.h"
 
 /* Default clocking modes and configuration used unless overridden
    using SPI_set_X() see linux/spi/spidev.h */
@@ -26,7 +25,12 @@
 #define DELAY_US          0
 #define CS_CHANGE         0
 
-static void spi_dump(byte tx);
+/* spidev copies each message through a kernel buffer of bufsiz
+   bytes, a module parameter, so no message may be longer */
+#define BUFSIZ_PARAM      "/sys/module/spidev/parameters/bufsiz"
+#define BUFSIZ_DEFAULT    4096
+
+static size_t spi_bufsiz(void);
 
 struct spi_defaults {
     const char *device;		  /* /dev/spiX.X */
@@ -34,6 +38,7 @@ struct spi_defaults {
     uint8_t mode;		  /* bitfield */
     uint8_t bits_per_word;	  
     uint32_t speed_hz;		  /* target clock speed in Hz */
+    size_t bufsiz;		  /* most bytes in one message */
 };
 
 struct spi_defaults spi;
@@ -48,6 +53,7 @@ SPI_start(const char *device, uint64_t speed_mhz)
     spi.device        = device;
     spi.speed_hz      = speed_mhz * 1000000;
     spi.bits_per_word = BITS_PER_WORD;
+    spi.bufsiz        = spi_bufsiz();
     spi.fd            = open(spi.device, O_RDWR);
     if (spi.fd < 0)
 	return E_IO;
@@ -77,41 +83,56 @@ SPI_stop(void)
 ErrCode
 SPI_write_byte(byte tx)
 {
+    return SPI_write(&tx, 1);
+}
+
+/* Transmits len bytes without recieving a response, as few messages
+   as the spidev buffer allows. The chip select line is not touched,
+   so the bytes reach the device as one continuous phase. */
+ErrCode
+SPI_write(const byte *tx, size_t len)
+{
+    struct spi_ioc_transfer tr;
+    ErrCode                 status = SUCCESS;
+    size_t                  n, total = len;
+
     if (!spi.device)
 	return E_INIT;
 
-    struct spi_ioc_transfer tr;
+    TRACE_BEGIN(TRACE_SPI);
     memset(&tr, 0, sizeof tr);
+    for (; len; tx+=n, len-=n) {
+	n = len < spi.bufsiz ? len : spi.bufsiz;
+	tr.tx_buf = (unsigned long)tx;
+	tr.len    = n;
+	if (ioctl(spi.fd, SPI_IOC_MESSAGE(1), &tr) < (int)n) {
+	    status = E_SPI;
+	    break;
+	}
+	metrics_add(METRIC_SPI_TRANSFERS, 1);
+    }
+    metrics_add(METRIC_SPI_BYTES, total - len);
+    TRACE_END_N(TRACE_SPI, total);
+
+    return status;
+}
 
-    tr.tx_buf        = (unsigned long)&tx;
-    tr.len           = 1;
-
-    spi_dump(tx);
+/* STATIC FUNCTIONS */
 
-    return ioctl(spi.fd, SPI_IOC_MESSAGE(1), &tr) < 1
-	? E_SPI : SUCCESS;
-}
-	
-/* Reads default device settings and outputs to stdout */
-static void
-spi_dump(byte tx)
+/* Reads spidev's buffer size, falling back to its default */
+static size_t
+spi_bufsiz(void)
 {
-#ifdef DEBUG
-    static unsigned long count;
-    uint8_t  lsb, bits, mode;
-    uint32_t speed;
-
-    ioctl(spi.fd, SPI_IOC_RD_MODE, &mode);
-    ioctl(spi.fd, SPI_IOC_RD_LSB_FIRST, &lsb);
-    ioctl(spi.fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-    ioctl(spi.fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);    
-
-    printf("SPI: %05ld:0x%02hhx @%dMHz "
-	   "mode=0x%02hhx lsb=0x%02hhx bits/word=%hhd\n",
-	   ++count, tx, speed/1000000, mode, lsb, bits);
-#endif
-    (void)tx;			/* supress unused warning */
+    FILE          *fh;
+    unsigned long  n = 0;
 
-    return;
+    fh = fopen(BUFSIZ_PARAM, "r");
+    if (fh) {
+	if (fscanf(fh, "%lu", &n) != 1)
+	    n = 0;
+	fclose(fh);
+    }
+
+    return n ? n : BUFSIZ_DEFAULT;
 }
 
@@ -7,8 +7,10 @@
  * SPI Clock Mode 0 (CPHA = 0, CPOL = 0).
  * Chip select line is not altered and must be configured manually.
  * Transmits 8 bits per word MSB first.
- * If COMMS_DEBUG is defined, each byte written is dumped to stdout.
- * 
+ * Each write is traced as a TRACE_SPI span, see trace.h.
+ *
+ * Writes longer than the spidev buffer (the module's bufsiz
+ * parameter, 4096B by default) are split into several transfers.
  */
 
 #include <stddef.h>
@@ -19,3 +21,4 @@
 ErrCode SPI_start(const char *device, uint64_t speed_mhz);
 void    SPI_stop(void);
 ErrCode SPI_write_byte(byte tx);
+ErrCode SPI_write(const byte *tx, size_t len);
@@ -0,0 +1,166 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* trace.c - per thread event rings, written out as Chrome trace JSON.
+
+   A thread's ring is allocated by its first event, or trace_thread(),
+   and published in a table of at most TRACE_THREADS; threads after
+   that aren't traced. Only the owning thread writes its ring: an
+   event is filled in, then the ring's count of events published with
+   release ordering, so recording costs a clock read and a store. Once
+   full the ring overwrites its oldest events, so the dump may start
+   with ends of spans whose beginnings were lost, which the viewers
+   ignore.
+
+   Only built with make TRACE=1, see trace.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "err.h"
+#include "oku.h"
+
+#include "trace.h"
+
+#define TRACE_EVENTS      (1<<16) /* per thread, a power of 2 */
+#define TRACE_THREADS     8
+#define TRACE_NAME_LEN    24
+
+struct TraceEvent {
+    uint64_t          ns;	/* CLOCK_MONOTONIC */
+    uint32_t          n;
+    uint8_t           span;
+    char              phase;	/* 'B' or 'E' */
+};
+
+struct TraceRing {
+    char              name[TRACE_NAME_LEN];
+    atomic_ulong      count;	/* events ever recorded */
+    struct TraceEvent ev[TRACE_EVENTS];
+};
+
+/* the span names seen on the timeline, and what n counts at the end
+   of each span, NULL if nothing */
+static const char *span_name[TRACE_NSPAN] = {
+    "page", "layout", "decode", "glyph", "blit", "refresh", "send",
+    "spi", "busy"
+};
+static const char *span_arg[TRACE_NSPAN] = {
+    "pages", "glyphs", "codepoint", "codepoint", NULL, "status", "bytes",
+    "bytes", NULL
+};
+
+static struct TraceRing *_Atomic ring[TRACE_THREADS];
+static atomic_int                nring;
+static _Thread_local struct TraceRing *mine;
+static _Thread_local int               untraced;
+
+static struct TraceRing *new_ring(void);
+
+void
+trace_event(enum TRACE_SPAN span, char phase, unsigned long n)
+{
+    struct TraceEvent *e;
+    struct timespec    ts;
+    unsigned long      at;
+
+    if (!mine && (untraced || !new_ring()))
+	return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    at = atomic_load_explicit(&mine->count, memory_order_relaxed);
+    e  = mine->ev + (at & (TRACE_EVENTS-1));
+    e->ns    = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->n     = n;
+    e->span  = span;
+    e->phase = phase;
+    atomic_store_explicit(&mine->count, at + 1, memory_order_release);
+}
+
+void
+trace_thread(const char *name)
+{
+    if (mine || (!untraced && new_ring()))
+	snprintf(mine->name, sizeof mine->name, "%s", name);
+}
+
+/* Writes the events of each ring oldest first, timestamps in us,
+   and each thread's name as metadata. Thread ids are ring indices. */
+ErrCode
+trace_dump(const char *path)
+{
+    const struct TraceEvent *e;
+    struct TraceRing        *r;
+    unsigned long            at, end;
+    ErrCode                  status = SUCCESS;
+    FILE                    *fh;
+    int                      i, pid = getpid(), first = 1;
+
+    fh = fopen(path, "w");
+    if (!fh)
+	return E_PATH;
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fh);
+    for (i=0; i<atomic_load(&nring) && i<TRACE_THREADS; ++i) {
+	r = atomic_load(&ring[i]);
+	if (!r)
+	    continue;
+	fprintf(fh, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		first ? "" : ",", pid, i, r->name);
+	first = 0;
+
+	end = atomic_load_explicit(&r->count, memory_order_acquire);
+	at  = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+	for (; at<end; ++at) {
+	    e = r->ev + (at & (TRACE_EVENTS-1));
+	    fprintf(fh, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+		    "\"pid\":%d,\"tid\":%d", span_name[e->span], e->phase,
+		    e->ns / 1e3, pid, i);
+	    if (e->phase == 'E' && span_arg[e->span])
+		fprintf(fh, ",\"args\":{\"%s\":%u}", span_arg[e->span], e->n);
+	    fputc('}', fh);
+	}
+    }
+    fputs("\n]}\n", fh);
+
+    if (ferror(fh))
+	status = E_IO;
+    if (fclose(fh))
+	status = E_IO;
+
+    return status;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Allocates the calling thread's ring and publishes it. Returns NULL,
+   and the thread goes untraced, if there are too many threads or no
+   memory. */
+static struct TraceRing *
+new_ring(void)
+{
+    struct TraceRing *r;
+    int               i;
+
+    untraced = 1;
+    r = calloc(1, sizeof *r);
+    if (!r)
+	return NULL;
+
+    i = atomic_fetch_add(&nring, 1);
+    if (i >= TRACE_THREADS) {
+	free(r);
+	return NULL;
+    }
+    snprintf(r->name, sizeof r->name, "thread %d", i);
+    atomic_store(&ring[i], r);
+    untraced = 0;
+
+    return mine = r;
+}
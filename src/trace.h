@@ -0,0 +1,56 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* trace.h - a timeline of where a page turn spends its time.
+
+   Spans are marked with TRACE_BEGIN() and TRACE_END() and are
+   compiled out unless built with make TRACE=1 (-DTRACE). Each thread
+   then records its events, timestamped, into a ring of its own
+   without locks, keeping the newest TRACE_EVENTS; trace_dump()
+   writes every ring as Chrome trace event JSON, for chrome://tracing
+   or ui.perfetto.dev. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "err.h"
+
+/* names and argument names are in trace.c */
+enum TRACE_SPAN {
+    TRACE_PAGE,			/* a turn, keypress to frame queued */
+    TRACE_LAYOUT,		/* layout_page() */
+    TRACE_DECODE,		/* book_get_codepoint() */
+    TRACE_GLYPH,		/* unifont lookup of a new glyph */
+    TRACE_BLIT,			/* layout_render() */
+    TRACE_REFRESH,		/* epd_refresh_frame() */
+    TRACE_SEND,			/* framebuffer to the epd's RAM */
+    TRACE_SPI,			/* SPI_write() */
+    TRACE_BUSY,			/* waiting on the busy line */
+    TRACE_NSPAN
+};
+
+#ifdef TRACE
+#define TRACE_BEGIN(S)     trace_event((S), 'B', 0)
+#define TRACE_END(S)       trace_event((S), 'E', 0)
+#define TRACE_END_N(S,N)   trace_event((S), 'E', (N))
+#define TRACE_THREAD(NAME) trace_thread(NAME)
+#define TRACE_DUMP(PATH)   trace_dump(PATH)
+#else
+#define TRACE_BEGIN(S)     ((void)0)
+#define TRACE_END(S)       ((void)0)
+#define TRACE_END_N(S,N)   ((void)(N)) /* no unused warnings */
+#define TRACE_THREAD(NAME) ((void)0)
+#define TRACE_DUMP(PATH)   (SUCCESS)
+#endif
+
+/* Records a begin ('B') or end ('E') of span on the calling thread.
+   n is kept with the event, see trace.c for what it counts. */
+void    trace_event(enum TRACE_SPAN span, char phase, unsigned long n);
+/* Names the calling thread on the timeline */
+void    trace_thread(const char *name);
+/* Writes every thread's events to path. Threads still recording may
+   have their newest events cut short, so stop them first. */
+ErrCode trace_dump(const char *path);
+
+#endif /* TRACE_H */
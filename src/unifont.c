@@ -66,7 +66,8 @@ unifont_close(struct Unifont *toclose)
 
 /* Populates the Raster for a Glyph. Retrieves bitmap comlimentary to
    the codepoint defined in the Glyph structure from a GNU Unicode
-   .hex file. */
+   .hex file. The bitmap is written to the caller's buffer at
+   out->render.bitmap, which must hold UNIFONT_BITMAP_LEN bytes. */
 ErrCode
 unifont_render(struct Unifont *font, struct Glyph *out)
 {
@@ -92,21 +93,18 @@ unifont_render(struct Unifont *font, struct Glyph *out)
 
     } while (out->codepoint != strtoul(line, &line_cur, 16));
 
-#ifdef DEBUG
-    printf("Unifont: 0x%04x: %s", out->codepoint, line);
-#endif
-
     /* Check and move past the delimiter */
     if (*line_cur++ != DELIMITER)
 	return E_FFORMAT;	/* invalid file format */
 
-    out->render.bitmap = calloc(32, sizeof *out->render.bitmap); 
     if (out->render.bitmap == NULL)
 	return E_MEM;
 
     bmp_len = 0;
     bmp_cur = out->render.bitmap;
     while (*line_cur!='\0' && !isspace(*line_cur)) {
+	if (bmp_len == UNIFONT_BITMAP_LEN)
+	    return E_FFORMAT;
 
 	if (sscanf(line_cur, "%02hhX", bmp_cur) != 1)
 	    return E_FFORMAT;
@@ -128,19 +126,10 @@ unifont_render(struct Unifont *font, struct Glyph *out)
 	out->render.size.y = 16;
 	break;
     default:
-	free(out->render.bitmap);
-	out->render.bitmap = NULL;
 	rewind(font->fh);
 	return E_FFORMAT;
     }
 
-#ifdef DEBUG
-    printf("Bitmap: 0x");
-    for (unsigned i=0; i<bmp_len; ++i)
-	printf("%02hhx", out->render.bitmap[i]);
-    printf("\n");
-#endif
-
     rewind(font->fh);
     return SUCCESS;
 }
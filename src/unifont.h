@@ -10,6 +10,8 @@
 #include "err.h"
 #include "oku.h"
 
+#define UNIFONT_BITMAP_LEN    32 /* bytes in the largest glyph, 16x16px */
+
 ErrCode unifont_open(const char *path_to_open, struct Unifont *new);
 void    unifont_close(struct Unifont *toclose);
 ErrCode unifont_render(struct Unifont *font, struct Glyph *out);
@@ -0,0 +1,275 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* virtual.c - a display with no panel behind it, for running oku on
+   any Linux machine. Implements the display half of epd.h, in place
+   of epd.c, gpio.c and spi.c, when built with make BACKEND=virtual.
+
+   Each refresh writes the frame as a binary PBM (P4) image, which is
+   the framebuffer's own packing with black and white swapped:
+
+   | File                   | Contents                               |
+   |------------------------+----------------------------------------|
+   | FRAME_LIVE             | newest frame, rewritten in place in    |
+   |                        | shared memory for a viewer to watch    |
+   | FRAME_DIR/NNNNNN.pbm   | every frame                            |
+   | FRAME_DIR/FRAME_TIMES  | a line of timings per frame            |
+
+   The timings are, tab separated: frame number, ms since
+   epd_start(), ms since the previous refresh returned, pixels changed
+   and us spent writing the images. Fed from a script on stdin, the
+   gap between refreshes is the time oku took to lay out and render
+   the page. Refreshes take no time here, there is no panel to wait
+   for. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "oku.h"
+#include "err.h"
+
+#include "epd.h"
+#include "panel.h"
+#include "framebuffer.h"
+
+#define PITCH(X)          ( X%8 ? 1+(X/8) : X/8  )
+#define LEN(X,Y)          ( PITCH(X) * Y         )
+
+#define FRAME_LIVE        "/dev/shm/oku.pbm"
+#define FRAME_DIR         "frames"
+#define FRAME_TIMES       "frames.tsv"
+#define FRAME_HEADER_MAX  32	/* "P4\n<w> <h>\n" */
+
+struct Virtual {
+    byte             *last;	/* previous frame, for pixels changed */
+    byte             *pbm;	/* frame as written, black is 1 */
+    byte             *live;	/* FRAME_LIVE mapped */
+    size_t            livelen;
+    FILE             *times;
+    int               asleep;
+    struct timespec   start;	/* epd_start() */
+    struct timespec   done;	/* previous refresh returned */
+};
+
+static struct Virtual virt;
+static struct EpdStats stats;
+
+static ErrCode       map_live(const char *header, size_t hlen);
+static ErrCode       write_frame(const char *header, size_t hlen);
+static unsigned long count_changed(const byte *a, const byte *b);
+static double        ms_between(const struct timespec *a,
+				const struct timespec *b);
+
+/* Allocates the framebuffers and creates FRAME_DIR, there is no
+   device to start */
+ErrCode
+epd_start(struct Point *px_out)
+{
+    fbuf      = epd_buffer_new();
+    virt.last = epd_buffer_new();
+    virt.pbm  = epd_buffer_new();
+    if (!fbuf || !virt.last || !virt.pbm)
+	return E_MEM;
+    epd_buffer_clear(virt.last);
+
+    if (mkdir(FRAME_DIR, 0755) && errno != EEXIST)
+	return E_PATH;
+    virt.times = fopen(FRAME_DIR "/" FRAME_TIMES, "w");
+    if (!virt.times)
+	return E_PATH;
+    fputs("frame\tt_ms\tgap_ms\tchanged_px\twrite_us\n", virt.times);
+
+    clock_gettime(CLOCK_MONOTONIC, &virt.start);
+    virt.done = virt.start;
+
+#ifdef DEBUG
+    printf("EPD: virtual %s %dx%d, frames in %s/ and %s\n", PANEL_NAME,
+	   WIDTH, HEIGHT, FRAME_DIR, FRAME_LIVE);
+#endif
+
+    px_out->x = WIDTH;
+    px_out->y = HEIGHT;
+
+    return SUCCESS;
+}
+
+/* Writes frame to the images and its timings to FRAME_TIMES */
+ErrCode
+epd_refresh_frame(const byte *frame, int (*pending)(void))
+{
+    struct timespec now, written;
+    char            header[FRAME_HEADER_MAX];
+    unsigned long   diff;
+    ErrCode         status;
+    int             hlen;
+    size_t          i;
+
+    assert(frame && virt.pbm && "Display not started");
+
+    if (pending && pending())
+	return E_CANCELLED;
+    if (virt.asleep) {
+	virt.asleep = 0;
+	++stats.wakes;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    diff = count_changed(virt.last, frame);
+    memcpy(virt.last, frame, LEN(WIDTH, HEIGHT));
+    for (i=0; i<LEN(WIDTH, HEIGHT); ++i)
+	virt.pbm[i] = ~frame[i];
+
+    hlen = snprintf(header, sizeof header, "P4\n%d %d\n",
+		    landscape ? HEIGHT : WIDTH, landscape ? WIDTH : HEIGHT);
+    status = write_frame(header, hlen);
+    if (status)
+	return status;
+    clock_gettime(CLOCK_MONOTONIC, &written);
+
+    fprintf(virt.times, "%lu\t%.3f\t%.3f\t%lu\t%.0f\n", stats.refreshes,
+	    ms_between(&virt.start, &now), ms_between(&virt.done, &now),
+	    diff, ms_between(&now, &written) * 1000);
+
+    ++stats.refreshes;
+    ++stats.bands;
+    stats.sent += LEN(WIDTH, HEIGHT);
+    clock_gettime(CLOCK_MONOTONIC, &virt.done);
+
+    return SUCCESS;
+}
+
+/* Frames are written whole, there is no partial refresh to schedule */
+void
+epd_refresh_policy(const struct RefreshPolicy *newpolicy)
+{
+    (void)newpolicy;
+}
+
+void
+epd_stats(struct EpdStats *out)
+{
+    *out = stats;
+}
+
+/* Nothing to power down, counted so the idle policy can be tested */
+ErrCode
+epd_sleep(void)
+{
+    if (!virt.asleep) {
+	virt.asleep = 1;
+	++stats.sleeps;
+    }
+
+    return SUCCESS;
+}
+
+ErrCode
+epd_stop(void)
+{
+    ErrCode status = SUCCESS;
+
+#ifdef DEBUG
+    printf("EPD: virtual, %lu frames written\n", stats.refreshes);
+#endif
+    if (virt.times && fclose(virt.times))
+	status = E_IO;
+    if (virt.live)
+	munmap(virt.live, virt.livelen);
+    free(fbuf);
+    free(virt.last);
+    free(virt.pbm);
+    memset(&virt, 0, sizeof virt);
+
+    return status;
+}
+
+/* STATIC FUNCTIONS */
+
+/* Maps FRAME_LIVE, sized for the header and a frame. The size is
+   known at the first refresh, after any call to epd_landscape(). */
+static ErrCode
+map_live(const char *header, size_t hlen)
+{
+    ErrCode status = SUCCESS;
+    size_t  len = hlen + LEN(WIDTH, HEIGHT);
+    void   *map;
+    int     fd;
+
+    fd = open(FRAME_LIVE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+	return E_PATH;
+    if (ftruncate(fd, len)) {
+	status = E_IO;
+	goto err;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	status = E_MEM;
+	goto err;
+    }
+    memcpy(map, header, hlen);
+    virt.live    = map;
+    virt.livelen = len;
+
+ err:
+    close(fd);
+    return status;
+}
+
+/* Copies the frame into the live image and writes it to the next
+   numbered file */
+static ErrCode
+write_frame(const char *header, size_t hlen)
+{
+    char    path[sizeof FRAME_DIR + 16];
+    ErrCode status;
+    FILE   *fh;
+
+    if (!virt.live) {
+	status = map_live(header, hlen);
+	if (status)
+	    return status;
+    }
+    memcpy(virt.live + hlen, virt.pbm, LEN(WIDTH, HEIGHT));
+
+    snprintf(path, sizeof path, FRAME_DIR "/%06lu.pbm", stats.refreshes);
+    fh = fopen(path, "wb");
+    if (!fh)
+	return E_PATH;
+    status = SUCCESS;
+    if (fwrite(header, 1, hlen, fh) != hlen
+	|| fwrite(virt.pbm, 1, LEN(WIDTH, HEIGHT), fh) != LEN(WIDTH, HEIGHT))
+	status = E_IO;
+    if (fclose(fh) && !status)
+	status = E_IO;
+
+    return status;
+}
+
+/* Number of pixels that differ between two frames */
+static unsigned long
+count_changed(const byte *a, const byte *b)
+{
+    unsigned long n = 0;
+    size_t        i;
+
+    for (i=0; i<LEN(WIDTH, HEIGHT); ++i)
+	n += __builtin_popcount(a[i] ^ b[i]);
+
+    return n;
+}
+
+static double
+ms_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
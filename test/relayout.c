@@ -0,0 +1,230 @@
+/* This file is part of oku - an electronic paper book reader
+   Copyright (C) 2020  Ellis Rhys Thomas <e.rhys.thomas@gmail.com>
+   See COPYING for licence details. */
+
+/* relayout.c - bookmarks survive an edit in the middle of a page.
+
+   Lays a book out, saving a bookmark at every page boundary, then
+   inserts a word in the middle of a page, inside a chunk that holds
+   no bookmark: on the larger panels a page spans several chunks. The
+   book is opened again and its bookmarks repaired with
+   bookmarks_relayout(), which must give the same boundaries as laying
+   the edited book out from the start.
+
+   Pages are runs of at least PAGE_BYTES followed by a space, so where
+   one ends depends on where it starts, like the real layout.
+
+   Bookmark files are written to the working directory, so the test
+   runs in a scratch directory that is removed afterwards.
+
+   USAGE: relayout                                                   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "oku.h"
+#include "err.h"
+#include "book.h"
+
+#define BOOK_BYTES        (64*1024)
+#define PAGE_BYTES        3000	/* roughly a 7.5" page of text */
+#define MAX_PAGES         (BOOK_BYTES / PAGE_BYTES + 2)
+#define BOOK_PATH         "book.txt"
+#define INSERTED          "inserted "
+
+static struct Book book;	/* measure() has no arguments */
+
+/* Lays out one page from the book's position without drawing it */
+static ErrCode
+measure(void)
+{
+    ErrCode status;
+    unicode c;
+    long    n;
+
+    for (n=0; ; ++n) {
+	status = book_get_codepoint(&book, &c);
+	if (status == E_EOF)
+	    return n ? SUCCESS : E_EOF;
+	if (status)
+	    return status;
+	if (n >= PAGE_BYTES && c == ' ')
+	    return SUCCESS;
+    }
+}
+
+/* Pseudo random words, the same every run */
+static void
+make_text(char *text, size_t len)
+{
+    unsigned long seed = 12345;
+    size_t        i, word = 0;
+
+    for (i=0; i<len; ++i) {
+	seed = seed * 1103515245 + 12345;
+	if (word && (seed >> 16) % 6 == 0) {
+	    text[i] = ' ';
+	    word    = 0;
+	} else {
+	    text[i] = 'a' + (seed >> 16) % 26;
+	    ++word;
+	}
+    }
+}
+
+static ErrCode
+write_book(const char *text, size_t len)
+{
+    FILE *fh;
+    int   ok;
+
+    fh = fopen(BOOK_PATH, "w");
+    if (!fh)
+	return E_IO;
+    ok = fwrite(text, 1, len, fh) == len;
+    return fclose(fh) == 0 && ok ? SUCCESS : E_IO;
+}
+
+/* Page boundaries of the book from the start, bookmarked if pages.
+   The reader bookmarks the start of each page turned to, so the end
+   of the last page is not one. */
+static ErrCode
+layout(long *ends, size_t *n, struct Bookmarks *pages)
+{
+    ErrCode status;
+
+    for (*n=0; *n<MAX_PAGES; ++*n) {
+	status = measure();
+	if (status == E_EOF)
+	    return SUCCESS;
+	if (status)
+	    return status;
+	ends[*n] = book_tell(&book);
+	if (ends[*n] == (long)book.len)
+	    return SUCCESS;
+	if (pages && (status=bookmarks_push(&book, pages)))
+	    return status;
+    }
+
+    return E_OVERFLOW;
+}
+
+/* Somewhere to insert a word: a space in the middle of a chunk lying
+   wholly inside a page, or -1 if there is none */
+static long
+edit_position(const char *text, const long *ends, size_t n)
+{
+    const struct Chunk *c;
+    size_t              i, k;
+    long                pos;
+
+    for (k=1; k<n; ++k)
+	for (i=0; i<book.chunks.n; ++i) {
+	    c = book.chunks.chunk + i;
+	    if (c->offset <= ends[k-1] || c->offset + (long)c->len >= ends[k])
+		continue;
+	    for (pos=c->offset + c->len/2; pos<c->offset + (long)c->len; ++pos)
+		if (text[pos] == ' ')
+		    return pos + 1;
+	}
+
+    return -1;
+}
+
+static void
+remove_scratch(const char *dir)
+{
+    DIR           *d;
+    struct dirent *e;
+
+    d = opendir(".");
+    if (d) {
+	while ((e=readdir(d)))
+	    if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+		remove(e->d_name);
+	closedir(d);
+    }
+    if (chdir("..") == 0)
+	rmdir(dir);
+}
+
+int
+main(void)
+{
+    ErrCode          status;
+    struct Bookmarks pages = { 0 };
+    char             dir[] = "/tmp/oku-relayout.XXXXXX";
+    char            *text;
+    long             old[MAX_PAGES], want[MAX_PAGES], pos;
+    size_t           nold, nwant, i, len = BOOK_BYTES;
+    int              failed = 1;
+
+    text = malloc(len + sizeof INSERTED);
+    if (!text || !mkdtemp(dir) || chdir(dir)) {
+	perror("relayout");
+	return 1;
+    }
+    make_text(text, len);
+
+    /* read the original, bookmarking every page */
+    if ((status=write_book(text, len))
+	|| (status=book_open(BOOK_PATH, &book))
+	|| (status=bookmarks_open(&book, &pages))
+	|| (status=layout(old, &nold, &pages)))
+	goto err;
+    pos = edit_position(text, old, nold);
+    bookmarks_close(&pages);
+    book_close(&book);
+    memset(&pages, 0, sizeof pages);
+    if (pos == -1) {
+	fprintf(stderr, "relayout: no chunk inside a page to edit\n");
+	goto out;
+    }
+
+    /* insert a word mid page and lay the edited book out afresh */
+    memmove(text + pos + strlen(INSERTED), text + pos, len - pos);
+    memcpy(text + pos, INSERTED, strlen(INSERTED));
+    len += strlen(INSERTED);
+    if ((status=write_book(text, len))
+	|| (status=book_open(BOOK_PATH, &book))
+	|| (status=layout(want, &nwant, NULL)))
+	goto err;
+
+    /* then repair the old bookmarks */
+    if ((status=book_seek(&book, 0))
+	|| (status=bookmarks_open(&book, &pages))
+	|| (status=bookmarks_relayout(&book, &pages, measure)))
+	goto err;
+
+    failed = pages.n != nwant;
+    for (i=0; i<nwant && !failed; ++i)
+	failed = pages.stack[i] != want[i];
+    if (failed) {
+	fprintf(stderr, "relayout: edit @%ldB, %zu pages, want %zu:\n",
+		pos, pages.n, nwant);
+	for (i=0; i<pages.n || i<nwant; ++i)
+	    fprintf(stderr, "  %4zu %8ld %8ld\n", i,
+		    i < pages.n ? pages.stack[i] : -1L,
+		    i < nwant ? want[i] : -1L);
+    } else {
+	for (i=0; i<nwant && want[i] <= pos; ++i)
+	    ;
+	printf("relayout: edit @%ldB in page %zu of %zu: ok\n", pos, i, nwant);
+    }
+    pages.n = 0;		/* nothing to save */
+
+ err:
+    if (status) {
+	fprintf(stderr, "relayout: ");
+	err_print(status);
+    }
+    bookmarks_close(&pages);
+    book_close(&book);
+ out:
+    remove_scratch(dir);
+    free(text);
+    return failed;
+}